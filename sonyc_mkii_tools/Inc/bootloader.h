@@ -11,6 +11,10 @@ typedef enum {
 	boot_cmd_boot		=0x8,
 	boot_cmd_bms_hello	=0x10,
 	boot_cmd_bms_prog	=0x20,
+	boot_cmd_program_win=0x40,
+	boot_cmd_digest		=0x80,
+	boot_cmd_program_lz	=0x100,
+	boot_cmd_verify		=0x200,
 	boot_cmd_fake		=0x80000000,	// To force compiler to use 4-byte enums
 } boot_cmd_t;
 
@@ -21,12 +25,51 @@ typedef struct __attribute__((packed)) {
 	boot_cmd_t cmd;
 } boot_cmd_packet_t;
 
+// boot_cmd_program_win arg1
+#define BOOT_PROG_LAST			0x1			// Final frame of the image
+#define BOOT_PROG_SESSION(x)	((uint32_t)(x) << 16)	// A new session id starts the sequence over
+#define BOOT_PROG_GET_SESSION(a)	((a) >> 16)
+
+#define BOOT_PROG_WINDOW_MAX 33	// next plus the 32 frames after it that sack can hold
+
+// ACK (and NACK) payload for boot_cmd_program_win
+typedef struct __attribute__((packed)) {
+	uint32_t next;	// Every seq below this is programmed. NACK: the seq that failed.
+	uint32_t sack;	// Bit i: next + 1 + i is programmed too
+} boot_prog_ack_t;
+
+#define BOOT_CHUNK_LEGACY 256	// Program payload per frame for a bootloader that doesn't say
+
+// ACK payload for boot_cmd_hello
+typedef struct __attribute__((packed)) {
+	uint32_t chunk_max;	// Largest program payload per frame, bytes, a multiple of 32
+	uint32_t cmds;		// boot_cmd_t bits this bootloader knows
+} boot_hello_info_t;
+
+#define BOOT_DIGEST_MAX 256	// Blocks per boot_cmd_digest
+
+// ACK payload for boot_cmd_digest
+typedef struct __attribute__((packed)) {
+	uint32_t addr;		// Echo of the request
+	uint32_t block;
+	uint32_t count;		// CRCs that follow
+	uint32_t crc[];		// sf_crc32(0, block) of each, the last one may be short
+} boot_digest_t;
+
+// ACK payload for boot_cmd_verify
+typedef struct __attribute__((packed)) {
+	uint32_t addr;		// Echo of the request
+	uint32_t len;
+	uint32_t crc;		// sf_crc32(0, range)
+} boot_verify_t;
+
 /*
 boot_cmd_null:
 No args. Used to signal an empty bootloader packet and provoke App to reboot to bootloader.
 
 boot_cmd_hello:
 No args. Bootloader will repy with info string(s) as debug_string frame and finish with ACK.
+Newer ones put boot_hello_info_t in the ACK, older ones send it empty: BOOT_CHUNK_LEGACY.
 
 boot_cmd_erase:
 Arg0: Start sector. Arg2: End sector. Both inclusive.
@@ -40,4 +83,32 @@ Replies with ACK when done and debug_info frames for status
 boot_cmd_boot:
 No args. ACK, reset, and jump to application.
 
+boot_cmd_program_win:
+Arg0: Write address. Arg1: BOOT_PROG_LAST | BOOT_PROG_SESSION(id). Arg2: Sequence number from 0.
+Same data as boot_cmd_program, but the sender keeps up to BOOT_PROG_WINDOW_MAX frames in
+flight instead of waiting for each ACK. Replies with an ACK carrying boot_prog_ack_t, one
+per batch of frames that arrived together. Frames may arrive out of order or twice; those
+already programmed are acknowledged again, never rewritten. A NACK with boot_prog_ack_t
+means flash programming failed, give up. Bootloaders that predate it NACK without a
+payload or don't answer at all, fall back to boot_cmd_program.
+
+boot_cmd_digest:
+Arg0: Start address. Arg1: Length in bytes. Arg2: Block size, a multiple of 32.
+At most BOOT_DIGEST_MAX blocks. Replies with an ACK carrying boot_digest_t, the CRC32
+of each block of flash as it is now, or NACK if the range is bad. Lets the host
+erase and program only the sectors that changed.
+
+boot_cmd_program_lz:
+Same args, window and replies as boot_cmd_program_win, and shares its sequence numbers, so a
+session can mix the two. The data is one boot_lz.h block that decodes to the frame's bytes,
+a whole number of flash words, at most the frame size the bootloader takes. Each frame is
+compressed on its own. The host sends frames that don't shrink as boot_cmd_program_win.
+Hello lists it on the H7. The F1 NACKs it without a payload if it doesn't know it.
+
+boot_cmd_verify:
+Arg0: Start address. Arg1: Length in bytes. Arg2: Unused.
+Replies with an ACK carrying boot_verify_t, one CRC32 of the whole range of flash as it is
+now, or NACK if the range is bad. The host compares it with the image after programming,
+one round trip instead of reading the flash back. H7 only, hello lists it.
+
 */
\ No newline at end of file
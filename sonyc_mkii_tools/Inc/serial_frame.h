@@ -1,6 +1,10 @@
 #pragma once
 #include <stdint.h>
 
+#ifndef FRAME_MAX_SIZE
+#define FRAME_MAX_SIZE 2048 // Only used for decoding. Host end should set larger for audio etc.
+#endif
+
 #define FRAME_MIN_SIZE 20 // Size of a 0 payload frame
 
 typedef enum {
@@ -19,6 +23,9 @@ typedef enum {
 	PARTIAL		= 0x02,
 	NO_PAYLOAD	= 0x04,
 	CRC_ERROR	= 0x08,
+	BUF_VIEW	= 0x10,	// buf points into decoder storage, do NOT free
+	STREAMED	= 0x20,	// Payload went to the stream callback, buf is NULL, sz is the total
+	COBS_FRAMED	= 0x40,	// Came in COBS framed, otherwise HDLC
 } frame_flag_t;
 
 typedef struct {
@@ -32,6 +39,52 @@ typedef struct {
 	uint8_t  dest;		// Dest types
 } serial_frame_t;
 
+// Receives payload of frames too big for the decoder buffer, in order, as it is decoded.
+// offset is the position of buf within the payload. offset 0 starts a new frame, if the
+// previous one never completed it was aborted. The CRC is only known once sf_decode()
+// returns the frame (flagged STREAMED), so consumers must be ready to discard.
+typedef void (*sf_stream_cb_t)(void *ctx, uint8_t dest, uint32_t type, uint32_t offset, const uint8_t *buf, uint32_t len);
+
+// Decoder context. One per input stream (port, thread, etc.)
+// Treat as opaque, use sf_decoder_init() to set up.
+typedef struct {
+	uint8_t *out;		// Working buffer, caller owned
+	uint32_t out_max;	// Size of working buffer
+	uint32_t in_idx;	// index into INPUT buffer
+	uint32_t out_idx;	// index into OUT buffer
+	uint32_t data_count;// ESP3: payload bytes seen. COBS: bytes left in the current block
+	int state;			// State of decoding, preserved over calls
+	uint32_t opts;		// SF_OPT_* flags
+	sf_stream_cb_t stream_cb;	// Spill handler for oversize frames, NULL to truncate them
+	void *stream_ctx;
+	uint32_t stream_crc;		// Running CRC of the payload already spilled
+	uint32_t streamed;			// Payload bytes already spilled for this frame
+	uint32_t aborted;			// Partial frames tossed to resync (HDLC abort, COBS block cut short)
+	uint32_t skipped;			// Bytes dropped looking for a frame start. Both are the caller's to read and clear.
+} sf_decoder_t;
+
+// Decoder options
+enum {
+	SF_OPT_VIEW = 0x1,	// Return frames as a view into decoder storage, valid until the next call. No malloc.
+	SF_OPT_COBS = 0x2,	// Also accept COBS framed frames, told apart from HDLC by their first byte
+};
+
+// Framings, as bits so a HELLO can advertise several
+// HDLC is the default and all a peer that has never said HELLO can be assumed to speak.
+// COBS: [0x00 COBS(DEST TYPE DATA-N CRC32 TIMESTAMP) 0x00], overhead is 1 byte per 254, never 2x.
+enum {
+	SF_FRAMING_HDLC = 0x1,
+	SF_FRAMING_COBS = 0x2,
+};
+#define SF_FRAMINGS_SUPPORTED (SF_FRAMING_HDLC | SF_FRAMING_COBS)
+
+// FRAME_TYPE_HELLO payload. The initiator sends the framings it supports, the
+// reply (always sent HDLC) carries the one picked for the link from then on.
+// An empty HELLO is the old style and selects HDLC.
+typedef struct __attribute__((packed)) {
+	uint32_t framings;
+} sf_hello_t;
+
 // Frame types, DATA_STRING is typically JSON
 enum {
 	FRAME_TYPE_DEBUG_STRING		=0,
@@ -45,11 +98,33 @@ enum {
 	FRAME_TYPE_NACK				=8,
 	FRAME_TYPE_HELLO			=9,
 	FRAME_TYPE_DEBUG_STRING_BMS	=10,
+	FRAME_TYPE_BMS_STATS_v7		=11,
 };
 
 // Dest types
 enum { DEST_BASE=0, DEST_H7=1, DEST_BMS=2 };
 
+// Payload segment for sf_encodev()
+typedef struct {
+	const void *buf;
+	uint32_t len;
+} sf_iovec_t;
+
+// Dest + type + CRC32 + time, before escaping
+#define SF_FRAME_OVERHEAD	(1 + 4 + 4 + 8)
+// Worst case encoded size for a payload of n bytes (every byte escaped, plus both FLAGs)
+#define SF_ENCODED_MAX(n)	(2 + 2 * ((n) + SF_FRAME_OVERHEAD))
+// Worst case COBS encoded size (one code byte per 254, plus both delimiters)
+#define SF_COBS_ENCODED_MAX(n)	(3 + ((n) + SF_FRAME_OVERHEAD) + ((n) + SF_FRAME_OVERHEAD) / 254)
+
+// Monotonic microseconds for the frame timestamp. Weak default returns 0,
+// targets override it (LPTIM on the H7, RTC tick on the F1, clock_gettime on the host)
+uint64_t serial_frame_now_us(void);
+
+int sf_encodev(const sf_iovec_t *iov, uint32_t iovcnt, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type, uint32_t *needed);
+int sf_cobs_encodev(const sf_iovec_t *iov, uint32_t iovcnt, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type, uint32_t *needed);
+int sf_encodev_framing(uint32_t framing, const sf_iovec_t *iov, uint32_t iovcnt, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type, uint32_t *needed);
+uint32_t sf_hello_select(const uint8_t *buf, uint32_t sz);
 int serial_frame_encode_count(const uint8_t *in, uint32_t len_in, uint8_t dest, uint32_t pkt_type);
 int serial_frame_encode(const uint8_t *in, uint32_t len_in, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type);
 int sf_encode_from_struct_count(serial_frame_t *f);
@@ -58,5 +133,18 @@ int serial_frame_decode(const uint8_t *in, uint32_t len_in, serial_frame_t *fram
 void serial_frame_reset(void);
 void * serial_frame_malloc(size_t size);
 
+// Re-entrant decoding. serial_frame_decode() and serial_frame_reset() use a default context.
+void sf_decoder_init(sf_decoder_t *d, uint8_t *buf, uint32_t buf_sz);
+void sf_decoder_reset(sf_decoder_t *d);
+void sf_decoder_set_opts(sf_decoder_t *d, uint32_t opts);
+void sf_decoder_set_stream(sf_decoder_t *d, sf_stream_cb_t cb, void *ctx);
+int sf_decode(sf_decoder_t *d, const uint8_t *in, uint32_t len_in, serial_frame_t *frame);
+
+// CRC-32 (ethernet/zlib) over the payload, chainable: sf_crc32(sf_crc32(0, a), b) covers a then b
+uint32_t sf_crc32(uint32_t crc, const uint8_t *buf, uint32_t len);
+
+// Provided externally when built with SERIAL_FRAME_HW_CRC, same contract as sf_crc32()
+uint32_t serial_frame_hw_crc32(uint32_t crc, const uint8_t *buf, uint32_t len);
+
 // Provided externally e.g., in main.c
 void Error_Handler(void);
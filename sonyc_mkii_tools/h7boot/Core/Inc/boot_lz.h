@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+
+// Small-window LZ for boot_cmd_program_lz, see boot_lz.c for the format.
+// The host compresses each program frame on its own, the bootloader decodes it
+// straight into flash one flash word at a time, keeping only the window in RAM.
+
+#define BLZ_WINDOW		2048	// Furthest match back, a power of 2. Sets decoder RAM.
+#define BLZ_MIN_MATCH	4
+#define BLZ_WORD_MAX	32		// Largest flash word the decoder stages (H7)
+
+// Compressed size can't exceed this, for incompressible input
+#define BLZ_BOUND(n)	((n) + (n) / 255 + 16)
+
+#define BLZ_ERR_DATA	-1		// Malformed block, or output past max or not whole words
+#define BLZ_ERR_PUT		-2		// put() failed
+
+// Takes each whole flash word of output, in order. off is its position in the output.
+// Returns 0, or < 0 to stop decoding.
+typedef int (*blz_put_t)(void *ctx, uint32_t off, const uint8_t *word);
+
+// Treat as opaque. Big enough that firmware wants it static rather than on the stack.
+typedef struct {
+	uint32_t stage[BLZ_WORD_MAX / 4];	// Flash word being assembled, word aligned for the HAL
+	uint8_t hist[BLZ_WINDOW];			// Last BLZ_WINDOW bytes out
+} blz_decoder_t;
+
+// Host side. Returns the compressed size, or -1 if it doesn't fit in out_max.
+// Uses 16 KiB of stack.
+int32_t blz_compress(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t out_max);
+
+// Decodes one block, handing each flash word of output to put. word is a power of 2 up to
+// BLZ_WORD_MAX, max caps the output. Returns the bytes out, or BLZ_ERR_*.
+int32_t blz_decode(blz_decoder_t *d, const uint8_t *in, uint32_t len, uint32_t word, uint32_t max, blz_put_t put, void *ctx);
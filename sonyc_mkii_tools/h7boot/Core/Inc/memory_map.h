@@ -6,6 +6,10 @@
 #define FIRST_SECTOR 0
 #define LAST_SECTOR 15
 
+#define H7_FLASH_START	0x08000000
+#define H7_FLASH_SIZE	(2*1024*1024)
+#define H7_SECTOR_SIZE	(128*1024)	// Erase unit. Sectors are numbered 0-15 across both banks.
+
 typedef struct {
 	uint32_t bank;		// 1 or 2
 	uint32_t sector;	// 0-7
@@ -0,0 +1,137 @@
+/*
+Small-window LZ for compressed programming
+
+LZ4's block layout with a window small enough for the F1 to keep in RAM.
+A block is a run of sequences up to the end of its input:
+[TOKEN LITLEN-EXT LITERALS OFFSET MATCHLEN-EXT]
+
+Where
+TOKEN: literal count in the high nibble, match length - BLZ_MIN_MATCH in the low
+LITLEN-EXT, MATCHLEN-EXT: present when the nibble is 15, bytes added to it until one isn't 255
+OFFSET: 2 bytes little endian, 1 to BLZ_WINDOW back from the current output
+The last sequence may stop after its literals, the block ends there.
+
+Each block stands alone, no history carries over from the one before. Frames are
+programmed in whatever order they arrive, so each one has to decode by itself.
+Long constant runs come out as one offset 1 match, repeated table rows as matches
+at the row stride.
+
+Decoding writes the output through a ring of the last BLZ_WINDOW bytes, which
+matches copy from, and a staging buffer that goes to put() each time it fills a
+flash word. Nothing else of the output is kept.
+*/
+
+#include <string.h>
+#include "boot_lz.h"
+
+#define HASH_BITS 12
+
+static uint32_t hash4(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_len(uint8_t *o, uint32_t n) {
+	for (; n >= 255; n -= 255) *o++ = 255;
+	*o++ = n;
+	return o;
+}
+
+// One sequence, mlen 0 for literals only. Returns -1 if it doesn't fit.
+static int put_seq(uint8_t **po, const uint8_t *end, const uint8_t *lit, uint32_t nlit, uint32_t mlen, uint32_t off) {
+	uint8_t *o = *po;
+	uint32_t m = mlen ? mlen - BLZ_MIN_MATCH : 0;
+
+	if ((size_t)(end - o) < 1 + nlit / 255 + 1 + nlit + 2 + m / 255 + 1) return -1;
+	*o++ = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+	if (nlit >= 15) o = put_len(o, nlit - 15);
+	memcpy(o, lit, nlit);
+	o += nlit;
+	if (mlen) {
+		*o++ = off;
+		*o++ = off >> 8;
+		if (m >= 15) o = put_len(o, m - 15);
+	}
+	*po = o;
+	return 0;
+}
+
+// Greedy, the last position with the same 4 bytes is the only candidate
+int32_t blz_compress(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t out_max) {
+	uint32_t table[1 << HASH_BITS];	// Position + 1, 0 if none yet
+	uint8_t *o = out, *end = out + out_max;
+	uint32_t i = 0, lit = 0;
+
+	memset(table, 0, sizeof(table));
+	while (i + BLZ_MIN_MATCH <= len) {
+		uint32_t h = hash4(&in[i]), cand = table[h], n = 0;
+		table[h] = i + 1;
+		if (cand && i - (cand - 1) <= BLZ_WINDOW) {
+			cand--;
+			while (i + n < len && in[cand + n] == in[i + n]) n++;
+		}
+		if (n < BLZ_MIN_MATCH) {
+			i++;
+			continue;
+		}
+		if (put_seq(&o, end, &in[lit], i - lit, n, i - cand) < 0) return -1;
+		for (uint32_t j = i + 1; j < i + n && j + 4 <= len; j++) table[hash4(&in[j])] = j + 1;
+		i += n;
+		lit = i;
+	}
+	if (lit < len && put_seq(&o, end, &in[lit], len - lit, 0, 0) < 0) return -1;
+	return o - out;
+}
+
+static int get_len(const uint8_t **in, const uint8_t *end, uint32_t *n, uint32_t max) {
+	uint8_t b;
+	do {
+		if (*in == end || *n > max) return BLZ_ERR_DATA;
+		b = *(*in)++;
+		*n += b;
+	} while (b == 255);
+	return 0;
+}
+
+typedef struct {
+	blz_decoder_t *d;
+	uint32_t out, word, max;
+	blz_put_t put;
+	void *ctx;
+} blz_out_t;
+
+static inline int out_byte(blz_out_t *o, uint8_t b) {
+	if (o->out == o->max) return BLZ_ERR_DATA;
+	o->d->hist[o->out & (BLZ_WINDOW - 1)] = b;
+	((uint8_t *)o->d->stage)[o->out & (o->word - 1)] = b;
+	o->out++;
+	if ((o->out & (o->word - 1)) == 0 && o->put(o->ctx, o->out - o->word, (const uint8_t *)o->d->stage) < 0) return BLZ_ERR_PUT;
+	return 0;
+}
+
+int32_t blz_decode(blz_decoder_t *d, const uint8_t *in, uint32_t len, uint32_t word, uint32_t max, blz_put_t put, void *ctx) {
+	const uint8_t *end = in + len;
+	blz_out_t o = { d, 0, word, max, put, ctx };
+	int ret;
+
+	if (word == 0 || word > BLZ_WORD_MAX || (word & (word - 1))) return BLZ_ERR_DATA;
+	while (in < end) {
+		uint32_t token = *in++, n = token >> 4, off;
+		if (n == 15 && get_len(&in, end, &n, max) < 0) return BLZ_ERR_DATA;
+		if (n > (uint32_t)(end - in)) return BLZ_ERR_DATA;
+		while (n--) if ((ret = out_byte(&o, *in++)) < 0) return ret;
+		if (in == end) break;
+
+		if (end - in < 2) return BLZ_ERR_DATA;
+		off = in[0] | in[1] << 8;
+		in += 2;
+		if (off == 0 || off > BLZ_WINDOW || off > o.out) return BLZ_ERR_DATA;
+		n = token & 15;
+		if (n == 15 && get_len(&in, end, &n, max) < 0) return BLZ_ERR_DATA;
+		n += BLZ_MIN_MATCH;
+		while (n--) if ((ret = out_byte(&o, d->hist[(o.out - off) & (BLZ_WINDOW - 1)])) < 0) return ret;
+	}
+	if (o.out & (word - 1)) return BLZ_ERR_DATA;
+	return o.out;
+}
@@ -21,7 +21,7 @@
 #include "crc.h"
 
 /* USER CODE BEGIN 0 */
-
+#include "serial_frame.h"
 /* USER CODE END 0 */
 
 CRC_HandleTypeDef hcrc;
@@ -33,8 +33,8 @@ void MX_CRC_Init(void)
   hcrc.Instance = CRC;
   hcrc.Init.DefaultPolynomialUse = DEFAULT_POLYNOMIAL_ENABLE;
   hcrc.Init.DefaultInitValueUse = DEFAULT_INIT_VALUE_ENABLE;
-  hcrc.Init.InputDataInversionMode = CRC_INPUTDATA_INVERSION_NONE;
-  hcrc.Init.OutputDataInversionMode = CRC_OUTPUTDATA_INVERSION_DISABLE;
+  hcrc.Init.InputDataInversionMode = CRC_INPUTDATA_INVERSION_BYTE;
+  hcrc.Init.OutputDataInversionMode = CRC_OUTPUTDATA_INVERSION_ENABLE;
   hcrc.InputDataFormat = CRC_INPUTDATA_FORMAT_BYTES;
   if (HAL_CRC_Init(&hcrc) != HAL_OK)
   {
@@ -77,6 +77,14 @@ void HAL_CRC_MspDeInit(CRC_HandleTypeDef* crcHandle)
 
 /* USER CODE BEGIN 1 */
 
+// Backend for sf_crc32() when built with SERIAL_FRAME_HW_CRC
+// Byte input and word output reflection give the ethernet/zlib CRC less the final XOR.
+// INIT holds the un-reflected running CRC, which lets calls chain like zlib crc32().
+uint32_t serial_frame_hw_crc32(uint32_t crc, const uint8_t *buf, uint32_t len) {
+	hcrc.Instance->INIT = __RBIT(~crc);
+	return ~HAL_CRC_Calculate(&hcrc, (uint32_t *)buf, len);
+}
+
 /* USER CODE END 1 */
 
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
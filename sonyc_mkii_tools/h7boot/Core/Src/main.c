@@ -16,6 +16,7 @@
 #include "message.h" // nanopb message handler
 #include "memory_map.h" // Defines flash memory regions etc.
 #include "bootloader.h"
+#include "boot_lz.h"
 #include "bms_serial.h"
 #include "network_id.h"
 
@@ -257,12 +258,41 @@ static void nuke_flash(void) {
 	// Error_Handler();
 // }
 
+// Frame timestamps come from the LSE clocked LPTIM, same clock as everything else
+uint64_t serial_frame_now_us(void) {
+	return lptim_get_us();
+}
+
+// Program payload per frame we take, advertised in the hello reply. The USB frame
+// buffer lives in RAM_D1, DTCM can't spare it.
+#define BOOT_CHUNK_MAX (32*1024)
+
+// USB and BMS links are independent byte streams, so each gets its own decoder
+// Frames are views into these buffers, no heap use on the RX path
+static uint8_t usb_frame_buf[BOOT_CHUNK_MAX + sizeof(boot_cmd_packet_t) + SF_FRAME_OVERHEAD + 8] __attribute__ ((section(".ram_d1"), aligned (32)));
+static uint8_t bms_frame_buf[FRAME_MAX_SIZE];
+static sf_decoder_t usb_decoder;
+static sf_decoder_t bms_decoder;
+
+// Each link's framing is settled by its own HELLO exchange, HDLC until then
+static uint32_t usb_framing = SF_FRAMING_HDLC;
+static uint32_t bms_framing = SF_FRAMING_HDLC;
+
+static void set_link_framing(sf_decoder_t *d, uint32_t *framing, uint32_t selected) {
+	*framing = selected;
+	sf_decoder_set_opts(d, SF_OPT_VIEW | (selected == SF_FRAMING_COBS ? SF_OPT_COBS : 0));
+}
+
+static int usb_encodev(const sf_iovec_t *iov, uint32_t iovcnt, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type, uint32_t *needed) {
+	return sf_encodev_framing(usb_framing, iov, iovcnt, buf_max, buf, dest, pkt_type, needed);
+}
+
 // Signals action complete
 static void send_ack_reply(void) {
 	uint8_t buf[FRAME_MIN_SIZE*2];
 	int ret;
-	ret = serial_frame_encode(NULL, 0, sizeof(buf), buf, DEST_BASE, FRAME_TYPE_ACK);
-	write(STDOUT_FILENO, buf, ret);
+	ret = usb_encodev(NULL, 0, sizeof(buf), buf, DEST_BASE, FRAME_TYPE_ACK, NULL);
+	if (ret > 0) write(STDOUT_FILENO, buf, ret);
 }
 
 // Error condition
@@ -271,12 +301,13 @@ static void send_nack_reply(void) __attribute__ ((unused));
 static void send_nack_reply(void) {
 	uint8_t buf[FRAME_MIN_SIZE*2];
 	int ret;
-	ret = serial_frame_encode(NULL, 0, sizeof(buf), buf, DEST_BASE, FRAME_TYPE_NACK);
-	write(STDOUT_FILENO, buf, ret);
+	ret = usb_encodev(NULL, 0, sizeof(buf), buf, DEST_BASE, FRAME_TYPE_NACK, NULL);
+	if (ret > 0) write(STDOUT_FILENO, buf, ret);
 }
 
 static void printf_frame(const char * restrict fmt, ...) {
-	size_t needed, needed_frame;
+	size_t needed;
+	uint32_t needed_frame;
 	int ret;
 	char *debug_string_buf=NULL, *debug_send_buf=NULL;
 	va_list argptr;
@@ -288,12 +319,20 @@ static void printf_frame(const char * restrict fmt, ...) {
 	if (debug_string_buf == NULL) goto out;
 	vsnprintf(debug_string_buf, needed, fmt, argptr);
 
-	needed_frame = serial_frame_encode_count((uint8_t *)debug_string_buf, needed, DEST_BASE, FRAME_TYPE_DEBUG_STRING);
+	// Text rarely needs escaping (and COBS never grows it much), so guess close to
+	// the raw size and only re-encode (once, with the size asked for) if that was too small
+	sf_iovec_t iov = { debug_string_buf, needed };
+	needed_frame = needed + SF_FRAME_OVERHEAD + 2 + 8;
 	debug_send_buf = (char *)malloc(needed_frame);
 	if (debug_send_buf == NULL) goto out;
-	ret = serial_frame_encode((uint8_t *)debug_string_buf, needed, needed_frame, (uint8_t *)debug_send_buf, DEST_BASE, FRAME_TYPE_DEBUG_STRING);
-
-	if (ret != needed_frame) __BKPT(); // Sanity check
+	ret = usb_encodev(&iov, 1, needed_frame, (uint8_t *)debug_send_buf, DEST_BASE, FRAME_TYPE_DEBUG_STRING, &needed_frame);
+	if (ret < 0 && needed_frame > 0) {
+		free(debug_send_buf);
+		debug_send_buf = (char *)malloc(needed_frame);
+		if (debug_send_buf == NULL) goto out;
+		ret = usb_encodev(&iov, 1, needed_frame, (uint8_t *)debug_send_buf, DEST_BASE, FRAME_TYPE_DEBUG_STRING, NULL);
+	}
+	if (ret < 0) goto out;
 
 	write(STDOUT_FILENO, debug_send_buf, ret);
 
@@ -316,7 +355,13 @@ static void send_hello_reply(void) {
 		printf_frame("ERROR: Unexpected UID size\r\n");
 
 	printf_frame("Device Network ID %u (0x%.4X)\r\n", uid_hash, uid_hash);
-	send_ack_reply();
+
+	// ACK says what we can take, hosts that don't look still see a plain ACK
+	boot_hello_info_t info = { BOOT_CHUNK_MAX, boot_cmd_hello | boot_cmd_erase | boot_cmd_program | boot_cmd_boot | boot_cmd_program_win | boot_cmd_digest | boot_cmd_program_lz | boot_cmd_verify };
+	sf_iovec_t iov = { &info, sizeof(info) };
+	uint8_t buf[SF_ENCODED_MAX(sizeof(info))];
+	int ret = usb_encodev(&iov, 1, sizeof(buf), buf, DEST_BASE, FRAME_TYPE_ACK, NULL);
+	if (ret > 0) write(STDOUT_FILENO, buf, ret);
 }
 
 static void erase_helper(boot_cmd_packet_t *p) {
@@ -410,6 +455,162 @@ out:
 	send_ack_reply();
 }
 
+// boot_cmd_program_win state. Frames are programmed as they come, whatever the order,
+// and acknowledged together once the USB read that brought them is decoded.
+static struct {
+	uint32_t session;
+	uint32_t next;			// Every seq below is programmed
+	uint32_t sack;			// Bit i: next + 1 + i is programmed
+	uint32_t last;			// Seq of the BOOT_PROG_LAST frame
+	bool have_last;
+	bool ack_pending;
+	uint64_t start_ms;
+} prog_win;
+
+static void send_prog_win_reply(uint32_t type, uint32_t next) {
+	boot_prog_ack_t ack = { next, prog_win.sack };
+	sf_iovec_t iov = { &ack, sizeof(ack) };
+	uint8_t buf[SF_ENCODED_MAX(sizeof(ack))];
+	int ret = usb_encodev(&iov, 1, sizeof(buf), buf, DEST_BASE, type, NULL);
+	if (ret > 0) write(STDOUT_FILENO, buf, ret);
+}
+
+static blz_decoder_t prog_lz; // boot_cmd_program_lz, decodes straight into flash
+
+// blz_put_t, ctx is the frame's address
+static int prog_lz_put(void *ctx, uint32_t off, const uint8_t *word) {
+	uint32_t addr = *(uint32_t *)ctx + off;
+	return HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, addr, (uint32_t)word) == HAL_OK ? 0 : -1;
+}
+
+// boot_cmd_program_win and boot_cmd_program_lz, only the data differs
+static void prog_win_helper(boot_cmd_packet_t *p, serial_frame_t *f) {
+	const int offset = sizeof(*p);
+	uint32_t *data = (uint32_t *)(&f->buf[offset]);
+	uint32_t addr = p->arg0;
+	uint32_t seq = p->arg2;
+	uint32_t d;
+	int bin_len = f->sz - offset;
+
+	if (BOOT_PROG_GET_SESSION(p->arg1) != prog_win.session || prog_win.start_ms == 0) {
+		memset(&prog_win, 0, sizeof(prog_win));
+		prog_win.session = BOOT_PROG_GET_SESSION(p->arg1);
+		prog_win.start_ms = lptim_get_ms();
+	}
+	prog_win.ack_pending = true; // Even for duplicates, the sender lost our last answer
+
+	d = seq - prog_win.next;
+	if (seq < prog_win.next || d >= BOOT_PROG_WINDOW_MAX) return; // Done already, or too far ahead
+	if (d > 0 && (prog_win.sack & (1u << (d - 1)))) return;
+
+	if (p->cmd == boot_cmd_program_win && bin_len % FLASH_WORD_SIZE != 0) {
+		printf_frame("Binary is sized %d but must be padded to mod 32\r\n", bin_len);
+		send_prog_win_reply(FRAME_TYPE_NACK, seq);
+		return;
+	}
+
+	HAL_FLASH_Unlock(); __DMB();
+	if (p->cmd == boot_cmd_program_lz) {
+		int32_t ret = blz_decode(&prog_lz, (const uint8_t *)data, bin_len, FLASH_WORD_SIZE, BOOT_CHUNK_MAX, prog_lz_put, &addr);
+		if (ret < 0) {
+			HAL_FLASH_Lock();
+			printf_frame(ret == BLZ_ERR_PUT ? "Program failed in %p\r\n" : "Bad compressed frame for %p\r\n", (void *)addr);
+			send_prog_win_reply(FRAME_TYPE_NACK, seq);
+			return;
+		}
+	}
+	else for (; bin_len; bin_len -= FLASH_WORD_SIZE, addr += FLASH_WORD_SIZE, data += FLASH_WORD_SIZE/sizeof(*data)) {
+		if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, addr, (uint32_t)data) != HAL_OK) {
+			HAL_FLASH_Lock();
+			printf_frame("Program failed at %p\r\n", (void *)addr);
+			send_prog_win_reply(FRAME_TYPE_NACK, seq);
+			return;
+		}
+	}
+	HAL_FLASH_Lock();
+
+	if (d == 0) { // Slide past it and anything after it that already came
+		prog_win.next++;
+		while (prog_win.sack & 1) {
+			prog_win.sack >>= 1;
+			prog_win.next++;
+		}
+		prog_win.sack >>= 1;
+	}
+	else prog_win.sack |= 1u << (d - 1);
+
+	if (p->arg1 & BOOT_PROG_LAST) {
+		prog_win.last = seq;
+		prog_win.have_last = true;
+	}
+	if (prog_win.have_last && prog_win.next == prog_win.last + 1) {
+		uint32_t diff_time = (lptim_get_ms() - prog_win.start_ms)&0xFFFFFFFF;
+		printf_frame("Program operation completed in %lu ms\r\n", diff_time);
+		prog_win.have_last = false;
+	}
+}
+
+// One cumulative ACK for every program frame in a read
+static void prog_win_flush(void) {
+	if (!prog_win.ack_pending) return;
+	prog_win.ack_pending = false;
+	send_prog_win_reply(FRAME_TYPE_ACK, prog_win.next);
+}
+
+// CRC32 of each block of the range, on the CRC peripheral like the frame CRC
+static void digest_helper(boot_cmd_packet_t *p) {
+	static struct __attribute__((packed)) {
+		boot_digest_t h;
+		uint32_t crc[BOOT_DIGEST_MAX];
+	} reply;
+	static uint8_t buf[SF_ENCODED_MAX(sizeof(reply))];
+	uint32_t addr = p->arg0;
+	uint32_t len = p->arg1;
+	uint32_t block = p->arg2;
+	sf_iovec_t iov;
+	int ret;
+
+	if (block == 0 || block % FLASH_WORD_SIZE || len == 0 || len > block * BOOT_DIGEST_MAX
+			|| addr < H7_FLASH_START || len > H7_FLASH_SIZE || addr - H7_FLASH_START > H7_FLASH_SIZE - len) {
+		printf_frame("BAD DIGEST ARGS %p %lu %lu\r\n", (void *)addr, len, block);
+		send_nack_reply();
+		return;
+	}
+
+	reply.h.addr = addr;
+	reply.h.block = block;
+	reply.h.count = 0;
+	for (uint32_t off = 0; off < len; off += block) {
+		uint32_t n = len - off < block ? len - off : block;
+		reply.crc[reply.h.count++] = sf_crc32(0, (const uint8_t *)(addr + off), n);
+	}
+
+	iov.buf = &reply;
+	iov.len = sizeof(reply.h) + reply.h.count * sizeof(reply.crc[0]);
+	ret = usb_encodev(&iov, 1, sizeof(buf), buf, DEST_BASE, FRAME_TYPE_ACK, NULL);
+	if (ret > 0) write(STDOUT_FILENO, buf, ret);
+}
+
+// One CRC32 of the whole range, so the host can check what it programmed in one round trip
+static void verify_helper(boot_cmd_packet_t *p) {
+	boot_verify_t reply;
+	uint8_t buf[SF_ENCODED_MAX(sizeof(reply))];
+	sf_iovec_t iov = { &reply, sizeof(reply) };
+	int ret;
+
+	if (p->arg1 == 0 || p->arg0 < H7_FLASH_START || p->arg1 > H7_FLASH_SIZE || p->arg0 - H7_FLASH_START > H7_FLASH_SIZE - p->arg1) {
+		printf_frame("BAD VERIFY ARGS %p %lu\r\n", (void *)p->arg0, p->arg1);
+		send_nack_reply();
+		return;
+	}
+
+	reply.addr = p->arg0;
+	reply.len = p->arg1;
+	reply.crc = sf_crc32(0, (const uint8_t *)p->arg0, p->arg1); // The CRC peripheral, a few ms for all of flash
+	ret = usb_encodev(&iov, 1, sizeof(buf), buf, DEST_BASE, FRAME_TYPE_ACK, NULL);
+	if (ret > 0) write(STDOUT_FILENO, buf, ret);
+}
+
 static void boot_helper(void) {
 	printf_frame("Reset and booting to application at %p...\r\n", (void *)APPLICATION_START_ADDR);
 	send_ack_reply();
@@ -427,6 +628,10 @@ static void boot_frame_handler(serial_frame_t *f, mel_status_t *status) {
 		case boot_cmd_hello: 	send_hello_reply(); 	break;
 		case boot_cmd_erase: 	erase_helper(&pkt); 	break;
 		case boot_cmd_program:	prog_helper(&pkt, f); 	break;
+		case boot_cmd_program_win: prog_win_helper(&pkt, f); break;
+		case boot_cmd_program_lz: prog_win_helper(&pkt, f); break;
+		case boot_cmd_digest:	digest_helper(&pkt);	break;
+		case boot_cmd_verify:	verify_helper(&pkt);	break;
 		case boot_cmd_boot:		boot_helper();			break;
 		default: set_magic_word();
 	}
@@ -434,30 +639,65 @@ static void boot_frame_handler(serial_frame_t *f, mel_status_t *status) {
 	status->boot_bytes_written += f->sz;
 }
 
+// The BMS decodes into FRAME_MAX_SIZE, so that is all we forward either way. Frames from
+// the BMS are no bigger, USB ones can be (usb_frame_buf) and handle_frame() turns those away.
+#define FORWARD_PAYLOAD_MAX	(FRAME_MAX_SIZE - SF_FRAME_OVERHEAD)
+static uint8_t forward_buf[SF_ENCODED_MAX(FORWARD_PAYLOAD_MAX)];
+
+static int encode_forward(serial_frame_t *f, uint32_t framing) {
+	sf_iovec_t iov = { f->buf, f->sz };
+	return sf_encodev_framing(framing, &iov, 1, sizeof(forward_buf), forward_buf, f->dest, f->type, NULL);
+}
+
+// A HELLO for the BMS negotiates the H7 <-> BMS link, not the one it came in on,
+// so it goes out with our capabilities instead of the sender's. HELLO is always
+// sent HDLC so a BMS that has reset since the last one still understands it.
 static void forward_frame_to_bms(serial_frame_t *f) {
-	unsigned bytes = sf_encode_from_struct_count(f);
-	uint8_t *forward_buf = (uint8_t *)malloc(bytes);
-	sf_encode_from_struct(f, forward_buf, bytes);
-	bms_transmit(forward_buf, bytes);
-	free(forward_buf);
+	int bytes;
+	if (f->type == FRAME_TYPE_HELLO) {
+		sf_hello_t hello = { SF_FRAMINGS_SUPPORTED };
+		serial_frame_t h = *f;
+		h.buf = (uint8_t *)&hello;
+		h.sz = sizeof(hello);
+		sf_decoder_set_opts(&bms_decoder, SF_OPT_VIEW | SF_OPT_COBS); // Reply may switch before we see it
+		bytes = encode_forward(&h, SF_FRAMING_HDLC);
+	}
+	else bytes = encode_forward(f, bms_framing);
+	if (bytes > 0) bms_transmit(forward_buf, bytes);
 }
 
+// The BMS answers a HELLO with the framing it picked for our link
 static void forward_frame_to_base(serial_frame_t *f) {
-	unsigned bytes = sf_encode_from_struct_count(f);
-	uint8_t *forward_buf = (uint8_t *)malloc(bytes);
-	sf_encode_from_struct(f, forward_buf, bytes);
-	write(STDOUT_FILENO, forward_buf, bytes);
-	free(forward_buf);
+	int bytes;
+	if (f->type == FRAME_TYPE_HELLO)
+		set_link_framing(&bms_decoder, &bms_framing, sf_hello_select(f->buf, f->sz));
+	bytes = encode_forward(f, usb_framing);
+	if (bytes > 0) write(STDOUT_FILENO, forward_buf, bytes);
+}
+
+// HELLO addressed to us negotiates the USB link. Reply in HDLC, then switch.
+static void hello_frame_handler(serial_frame_t *f) {
+	sf_hello_t hello = { sf_hello_select(f->buf, f->sz) };
+	sf_iovec_t iov = { &hello, sizeof(hello) };
+	uint8_t buf[SF_ENCODED_MAX(sizeof(hello))];
+	int ret = sf_encodev(&iov, 1, sizeof(buf), buf, DEST_BASE, FRAME_TYPE_HELLO, NULL);
+	if (ret > 0) write(STDOUT_FILENO, buf, ret);
+	set_link_framing(&usb_decoder, &usb_framing, hello.framings);
+	send_ack_reply();
 }
 
 static void handle_frame(serial_frame_t *f, mel_status_t *status) {
-	if (f->dest == DEST_BMS) forward_frame_to_bms(f);
+	if ((f->dest == DEST_BMS || f->dest == DEST_BASE) && f->sz > FORWARD_PAYLOAD_MAX) {
+		printf_frame("FRAME FOR %u TOO BIG TO FORWARD, %lu BYTES\r\n", f->dest, f->sz);
+		send_nack_reply();
+	}
+	else if (f->dest == DEST_BMS) forward_frame_to_bms(f);
 	else if (f->dest == DEST_BASE) forward_frame_to_base(f);
 	else switch(f->type) {
 		// case FRAME_TYPE_DEBUG_STRING: debug_frame_handler(f, status); break;
 		// case FRAME_TYPE_DATA_STRING: data_string_frame_handler(f, status); break;
 		// case FRAME_TYPE_BIN_AUDIO: audio_frame_handler(f, status); break;
-		// case FRAME_TYPE_HELLO: fprintf(stderr,"Got Hello\r\n"); break;
+		case FRAME_TYPE_HELLO: hello_frame_handler(f); break;
 		case FRAME_TYPE_BOOTLOADER_BIN: boot_frame_handler(f, status); break;
 		default: debug_printf("ERROR: Unknown frame type %lu\r\n", f->type);
 	}
@@ -478,13 +718,11 @@ static bool parse_frame(serial_frame_t *f, mel_status_t *status) {
 	//CHECK_FLAG(NO_PAYLOAD);
 	CHECK_FLAG(CRC_ERROR);
 
-	if (flag & CRC_ERROR) {
-
-	}
-
 	if (flag & FRAME_FOUND) {
-		handle_frame(f, status);
-		if (f->buf)
+		// Nothing in a CRC failure can be trusted, not its args nor where it goes. Dropped
+		// like a lost frame, never acted on or forwarded with a fresh CRC. The sender resends.
+		if (!(flag & CRC_ERROR)) handle_frame(f, status);
+		if (f->buf && !(flag & BUF_VIEW))
 			free(f->buf);
 		f->buf = NULL;
 		f->sz = 0;
@@ -493,15 +731,30 @@ static bool parse_frame(serial_frame_t *f, mel_status_t *status) {
 	return false;
 }
 
+static void init_decoders(void) {
+	sf_decoder_init(&usb_decoder, usb_frame_buf, sizeof(usb_frame_buf));
+	sf_decoder_init(&bms_decoder, bms_frame_buf, sizeof(bms_frame_buf));
+	sf_decoder_set_opts(&usb_decoder, SF_OPT_VIEW);
+	sf_decoder_set_opts(&bms_decoder, SF_OPT_VIEW);
+}
+
+// Only HELLO comes HDLC once a link is COBS. A good frame that doesn't means the other end
+// restarted or missed the HELLO reply, so back to HDLC before answering, until the next HELLO.
+static void check_link_framing(serial_frame_t *f, sf_decoder_t *d, uint32_t *framing) {
+	if ((f->flag & FRAME_FOUND) && !(f->flag & (CRC_ERROR | COBS_FRAMED)) && f->type != FRAME_TYPE_HELLO && *framing == SF_FRAMING_COBS)
+		set_link_framing(d, framing, SF_FRAMING_HDLC);
+}
+
 void do_uart_rx(uint8_t *read_buf, int sz) {
 	serial_frame_t f = {0};
 	int i=0;
 	int decode_ret;
 	bool go = false;
 	do {
-		decode_ret = serial_frame_decode(&read_buf[i], sz-i, &f);
+		decode_ret = sf_decode(&bms_decoder, &read_buf[i], sz-i, &f);
 		if (decode_ret < 0) { __BKPT(); break; }
 		i += decode_ret;
+		check_link_framing(&f, &bms_decoder, &bms_framing);
 		go = parse_frame(&f, NULL);
 	} while (go);
 }
@@ -518,11 +771,13 @@ static void do_usb_rx(void) {
 	if (ret < 0) { __BKPT(); return; }
 
 	do {
-		decode_ret = serial_frame_decode(&read_buf[i], ret-i, &f);
+		decode_ret = sf_decode(&usb_decoder, &read_buf[i], ret-i, &f);
 		if (decode_ret < 0) { __BKPT(); break; }
 		i += decode_ret;
+		check_link_framing(&f, &usb_decoder, &usb_framing);
 		go = parse_frame(&f, &status);
 	} while (go);
+	prog_win_flush();
 }
 
 
@@ -596,7 +851,8 @@ int main(void)
 #ifdef USE_UART5_DEBUG
 	MX_UART5_Init();
 #endif
-	// MX_CRC_Init();
+	MX_CRC_Init(); // Frame CRC32
+	init_decoders();
 	// MX_QUADSPI_Init();
 
 	uint32_t timeout_ms = 10000;
@@ -23,6 +23,7 @@ static uint8_t rx_pkt_buf[USB_CDC_PACKET_SIZE] __attribute__ ((aligned (32)));
 static uint8_t tx_pkt_buf[USB_CDC_PACKET_SIZE] __attribute__ ((aligned (32)));
 
 static usb_cdc_status_t usb_cdc_status;
+static volatile int rx_paused; // inbuf can't take another packet, the host is NAKed until _read() makes room
 
 // ST Driver Stuff
 extern USBD_HandleTypeDef hUsbDeviceFS;
@@ -89,6 +90,7 @@ static int8_t my_cdc_init_fs(void) {
 	__disable_irq();
 	reset_status(&usb_cdc_status);
 	usb_cdc_status.is_connected = 1;
+	rx_paused = 0;
 	__enable_irq();
 	return USBD_OK;
 }
@@ -113,9 +115,13 @@ static int8_t my_cdc_rx_fs(uint8_t* pbuf, uint32_t *Len) {
 	memcpy(&inbuf[INBUF_IDX], rx_pkt_buf, *Len);
 	INBUF_IDX += *Len;
 
-	// Sets up the NEXT Rx
+	// Sets up the NEXT Rx, if there is room for it. Otherwise the host waits, nothing is lost
+	// while a flash write holds up the main loop with more program frames on the way.
 	USBD_CDC_SetRxBuffer(&hUsbDeviceFS, rx_pkt_buf);
-	USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+	if (sizeof(inbuf) - INBUF_IDX >= USB_CDC_PACKET_SIZE)
+		USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+	else
+		rx_paused = 1;
 	return USBD_OK;
 }
 
@@ -166,6 +172,10 @@ int _read(int handle, void *buf, int size) {
 		ret = size;
 	}
 	usb_cdc_status.RxBytes += ret;
+	if (rx_paused && sizeof(inbuf) - INBUF_IDX >= USB_CDC_PACKET_SIZE) {
+		rx_paused = 0;
+		USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+	}
 	__enable_irq();
 	return ret;
 }
@@ -0,0 +1,270 @@
+/*
+Rotating WAV writer for master_mel's audio frames
+
+Frames are small and arrive often, writing each one costs an SD card a
+read-modify-write of a whole erase block. Audio is collected into a 1 MiB
+aligned block instead and written with one pwrite(), O_DIRECT if the
+filesystem allows it. The header is padded to 4096 bytes with a JUNK chunk
+(any RIFF reader skips it) so the samples, and every block write, stay
+aligned. Space is preallocated ahead of the writes to keep the file in one
+extent. The header is rewritten after every block, so a capture cut short by
+a crash or power loss is still a valid WAV up to the last full block.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "audio_sink.h"
+
+#define AUDIO_PREALLOC	(64*1024*1024)	// fallocate() step
+#define WAV_MAX_DATA	0xFFFFF000u		// 32 bit sizes in the header, leave room for it
+
+static void put_le32(uint8_t *p, uint32_t v) {
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void put_le16(uint8_t *p, uint16_t v) {
+	p[0] = v; p[1] = v >> 8;
+}
+
+int audio_sink_init(audio_sink_t *a, const char *prefix, const char *device, const audio_conf_t *conf) {
+	memset(a, 0, sizeof(*a));
+	a->fd = -1;
+	a->device = device;
+	a->conf = *conf;
+	snprintf(a->prefix, sizeof(a->prefix), "%s", prefix);
+
+	unsigned align = conf->channels * ((conf->bits + 7) / 8);
+	if (align == 0 || conf->rate == 0) {
+		fprintf(stderr, "Audio: bad format %u Hz, %u ch, %u bit\r\n", conf->rate, conf->channels, conf->bits);
+		return -1;
+	}
+	if (a->conf.rotate_bytes == 0 || a->conf.rotate_bytes > WAV_MAX_DATA) a->conf.rotate_bytes = WAV_MAX_DATA;
+	a->conf.rotate_bytes -= a->conf.rotate_bytes % align; // Split between samples, never inside one
+	if (a->conf.rotate_bytes == 0) a->conf.rotate_bytes = align;
+
+	if (posix_memalign((void **)&a->block, 4096, AUDIO_BLOCK_SZ) != 0 ||
+		posix_memalign((void **)&a->hdr, 4096, AUDIO_HDR_SZ) != 0) {
+		fprintf(stderr, "Audio: out of memory\r\n");
+		free(a->block);
+		a->block = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+// Builds the 4096 byte header for data_bytes of audio into a->hdr
+static void wav_header(audio_sink_t *a, uint64_t data_bytes) {
+	uint8_t *h = a->hdr;
+	unsigned block_align = a->conf.channels * ((a->conf.bits + 7) / 8);
+	uint32_t junk = AUDIO_HDR_SZ - 12 - 24 - 8 - 8;
+
+	memset(h, 0, AUDIO_HDR_SZ);
+	memcpy(&h[0], "RIFF", 4);
+	put_le32(&h[4], AUDIO_HDR_SZ - 8 + data_bytes + (data_bytes & 1));
+	memcpy(&h[8], "WAVE", 4);
+
+	memcpy(&h[12], "fmt ", 4);
+	put_le32(&h[16], 16);
+	put_le16(&h[20], 1); // PCM
+	put_le16(&h[22], a->conf.channels);
+	put_le32(&h[24], a->conf.rate);
+	put_le32(&h[28], a->conf.rate * block_align);
+	put_le16(&h[32], block_align);
+	put_le16(&h[34], a->conf.bits);
+
+	memcpy(&h[36], "JUNK", 4);
+	put_le32(&h[40], junk);
+
+	memcpy(&h[AUDIO_HDR_SZ - 8], "data", 4);
+	put_le32(&h[AUDIO_HDR_SZ - 4], data_bytes);
+}
+
+static void write_header(audio_sink_t *a, uint64_t data_bytes) {
+	wav_header(a, data_bytes);
+	if (pwrite(a->fd, a->hdr, AUDIO_HDR_SZ, 0) != AUDIO_HDR_SZ) {
+		perror("Audio header write");
+		a->errors++;
+	}
+}
+
+static void file_open(audio_sink_t *a) {
+	struct timespec ts;
+	struct tm tm;
+	char when[32];
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	gmtime_r(&ts.tv_sec, &tm);
+	strftime(when, sizeof(when), "%Y%m%dT%H%M%SZ", &tm);
+	snprintf(a->cur.path, sizeof(a->cur.path), "%s.%s.%04u.wav", a->prefix, when, a->seq++);
+
+	// O_DIRECT skips the page cache. tmpfs and some FUSE mounts refuse it, they get buffered writes.
+	a->direct = true;
+	a->fd = open(a->cur.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+	if (a->fd < 0 && errno == EINVAL) {
+		a->direct = false;
+		a->fd = open(a->cur.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	}
+	if (a->fd < 0) {
+		fprintf(stderr, "Audio file %s: %s\r\n", a->cur.path, strerror(errno));
+		a->errors++;
+		return;
+	}
+
+	a->cur.bytes = a->flushed = a->prealloc = 0;
+	a->cur.frame_at = 0;
+	a->cur.bad_count = 0;
+	a->block_len = 0;
+	write_header(a, 0);
+}
+
+// Keeps the next block inside space that is already allocated
+static void preallocate(audio_sink_t *a) {
+	uint64_t want = AUDIO_HDR_SZ + a->flushed + AUDIO_BLOCK_SZ;
+	uint64_t end = AUDIO_HDR_SZ + a->conf.rotate_bytes + AUDIO_BLOCK_SZ;
+	if (want <= a->prealloc) return;
+	want = a->prealloc + AUDIO_PREALLOC;
+	if (want > end) want = end;
+	// KEEP_SIZE: the file length still says how much was written. Unsupported is fine, just slower.
+	if (fallocate(a->fd, FALLOC_FL_KEEP_SIZE, a->prealloc, want - a->prealloc) == 0 || errno == EOPNOTSUPP)
+		a->prealloc = want;
+}
+
+// Writes the block out, zero padded to 4096 if it isn't full (last one of a file)
+static void block_flush(audio_sink_t *a) {
+	uint32_t len = (a->block_len + 4095) & ~4095u;
+	if (a->block_len == 0) return;
+	memset(&a->block[a->block_len], 0, len - a->block_len);
+	preallocate(a);
+	if (pwrite(a->fd, a->block, len, AUDIO_HDR_SZ + a->flushed) != (ssize_t)len) {
+		perror("Audio write");
+		a->errors++;
+	}
+	a->flushed += a->block_len;
+	a->block_len = 0;
+	write_header(a, a->flushed);
+}
+
+static void sidecar_write(audio_sink_t *a, const audio_file_info_t *info) {
+	char path[sizeof(info->path) + 8];
+	unsigned bytes_per_sec = a->conf.rate * a->conf.channels * ((a->conf.bits + 7) / 8);
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%.*s.json", (int)(strlen(info->path) - 4), info->path); // .wav -> .json
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror("Audio sidecar");
+		a->errors++;
+		return;
+	}
+	fprintf(f, "{\"device\": \"%s\", \"wav\": \"%s\", ", a->device, info->path);
+	fprintf(f, "\"sample_rate\": %u, \"channels\": %u, \"bits\": %u, \"bytes\": %" PRIu64 ", \"seconds\": %.6f, ",
+		a->conf.rate, a->conf.channels, a->conf.bits, info->bytes, (double)info->bytes / bytes_per_sec);
+	if (info->first_dev_us) {
+		fprintf(f, "\"first_frame_dev_us\": %" PRIu64 ", \"first_frame_host_us\": %" PRIu64 ", ", info->first_dev_us, info->first_host_us);
+		if (info->first_est_us) fprintf(f, "\"first_frame_est_us\": %" PRIu64 ", ", info->first_est_us);
+		else fprintf(f, "\"first_frame_est_us\": null, ");
+	}
+	else fprintf(f, "\"first_frame_dev_us\": null, \"first_frame_host_us\": null, \"first_frame_est_us\": null, ");
+	fprintf(f, "\"first_sample_offset\": %u, \"crc_error_frames\": %u, \"crc_error_spans\": [", info->first_offset, info->bad_count);
+	for (unsigned i=0; i<info->bad_count && i<AUDIO_BAD_SPANS; i++)
+		fprintf(f, "%s[%" PRIu64 ", %" PRIu64 "]", i ? ", " : "", info->bad_at[i], info->bad_len[i]);
+	fprintf(f, "]}\n");
+	fclose(f);
+}
+
+static void file_close(audio_sink_t *a) {
+	if (a->fd < 0) return;
+	block_flush(a);
+	// Drop the block padding and any preallocation past the end, keep RIFF's pad byte
+	if (ftruncate(a->fd, AUDIO_HDR_SZ + a->cur.bytes + (a->cur.bytes & 1)) < 0) {
+		perror("Audio truncate");
+		a->errors++;
+	}
+	close(a->fd);
+	a->fd = -1;
+
+	// Ended inside a streamed frame: its time or CRC may still change the sidecar, which waits for it
+	if (a->in_frame && a->deferred_count < AUDIO_DEFERRED) a->deferred[a->deferred_count++] = a->cur;
+	else sidecar_write(a, &a->cur);
+}
+
+static void deferred_flush(audio_sink_t *a) {
+	for (unsigned i=0; i<a->deferred_count; i++) sidecar_write(a, &a->deferred[i]);
+	a->deferred_count = 0;
+}
+
+void audio_sink_write(audio_sink_t *a, const uint8_t *buf, uint32_t len, uint32_t offset, uint64_t dev_us, uint64_t host_us, uint64_t est_us) {
+	if (a->block == NULL) return;
+	if (offset == 0) {
+		if (a->in_frame) { // New frame, the streamed one before it was cut off and has no time
+			deferred_flush(a);
+			a->cur.stamp_pending = false;
+		}
+		a->in_frame = (dev_us == 0);
+		a->cur.frame_at = a->cur.bytes;
+	}
+	while (len) {
+		uint32_t n = len;
+		if (a->fd < 0) {
+			file_open(a);
+			if (a->fd < 0) return; // Already reported, drop this piece and try again with the next
+			a->cur.first_dev_us = dev_us;
+			a->cur.first_host_us = host_us;
+			a->cur.first_est_us = est_us;
+			a->cur.first_offset = offset;
+			a->cur.stamp_pending = (dev_us == 0);
+		}
+		if (n > AUDIO_BLOCK_SZ - a->block_len) n = AUDIO_BLOCK_SZ - a->block_len;
+		if (n > a->conf.rotate_bytes - a->cur.bytes) n = a->conf.rotate_bytes - a->cur.bytes;
+
+		memcpy(&a->block[a->block_len], buf, n);
+		a->block_len += n;
+		a->cur.bytes += n;
+		buf += n;
+		offset += n;
+		len -= n;
+
+		if (a->block_len == AUDIO_BLOCK_SZ) block_flush(a);
+		if (a->cur.bytes == a->conf.rotate_bytes) file_close(a);
+	}
+}
+
+// Frame end for one file holding part of the frame
+static void frame_end(audio_file_info_t *info, uint64_t dev_us, uint64_t host_us, uint64_t est_us, bool crc_error) {
+	if (info->stamp_pending) {
+		info->first_dev_us = dev_us;
+		info->first_host_us = host_us;
+		info->first_est_us = est_us;
+		info->stamp_pending = false;
+	}
+	if (!crc_error || info->bytes == info->frame_at) return;
+	if (info->bad_count < AUDIO_BAD_SPANS) {
+		info->bad_at[info->bad_count] = info->frame_at;
+		info->bad_len[info->bad_count] = info->bytes - info->frame_at;
+	}
+	info->bad_count++;
+}
+
+void audio_sink_stamp(audio_sink_t *a, uint64_t dev_us, uint64_t host_us, uint64_t est_us, bool crc_error) {
+	if (!a->in_frame) return;
+	for (unsigned i=0; i<a->deferred_count; i++) frame_end(&a->deferred[i], dev_us, host_us, est_us, crc_error);
+	deferred_flush(a);
+	if (a->fd >= 0) frame_end(&a->cur, dev_us, host_us, est_us, crc_error);
+	a->in_frame = false;
+}
+
+void audio_sink_close(audio_sink_t *a) {
+	file_close(a);
+	deferred_flush(a); // Cut off mid-frame, the time never came
+	free(a->block);
+	free(a->hdr);
+	a->block = a->hdr = NULL;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Audio capture to rotating WAV files, written in large aligned blocks
+// (O_DIRECT where the filesystem takes it) into preallocated files.
+// Each WAV gets a .json sidecar with the device time of its first sample.
+
+#define AUDIO_BLOCK_SZ	(1024*1024)	// Write size, multiple of 4096
+#define AUDIO_HDR_SZ	4096		// WAV header padded with a JUNK chunk so samples start aligned
+#define AUDIO_DEFERRED	8			// Closed files still waiting on their streamed frame's end
+#define AUDIO_BAD_SPANS	16			// CRC failed spans listed per sidecar, more are only counted
+
+// What a sidecar says about its WAV
+typedef struct {
+	char path[300];
+	uint64_t bytes;
+	uint64_t first_dev_us;	// Device time of the frame holding the first sample, 0 if unknown
+	uint64_t first_host_us;
+	uint64_t first_est_us;	// Its send time on the host clock (clock_est.h), 0 if unknown
+	uint32_t first_offset;	// Where the first sample sits in that frame
+	bool stamp_pending;		// The first sample's frame is streamed and hasn't ended yet
+	uint64_t frame_at;		// Where the frame being written started in this file
+	unsigned bad_count;		// Frames that failed their CRC with audio in this file
+	uint64_t bad_at[AUDIO_BAD_SPANS];	// Their audio, byte offsets into the data chunk
+	uint64_t bad_len[AUDIO_BAD_SPANS];
+} audio_file_info_t;
+
+typedef struct {
+	unsigned rate;			// Samples per second
+	unsigned channels;
+	unsigned bits;			// Per sample
+	uint64_t rotate_bytes;	// Start a new file after this much audio, 0 for the WAV limit
+} audio_conf_t;
+
+typedef struct {
+	char prefix[256];		// Files are <prefix>.<UTC start>.<seq>.wav
+	const char *device;		// For the sidecar
+	audio_conf_t conf;
+
+	int fd;					// -1 between files
+	bool direct;			// fd was opened O_DIRECT
+	unsigned seq;
+	audio_file_info_t cur;	// cur.bytes: audio in this file, block included
+	uint8_t *block;			// AUDIO_BLOCK_SZ, 4096 aligned
+	uint8_t *hdr;			// AUDIO_HDR_SZ, 4096 aligned
+	uint32_t block_len;
+	uint64_t flushed;		// Audio bytes on disk
+	uint64_t prealloc;		// Bytes fallocate()d so far, header included
+
+	// Streamed frames only get their time and CRC once the last piece is in.
+	// Files closed inside such a frame wait here for it.
+	bool in_frame;
+	audio_file_info_t deferred[AUDIO_DEFERRED];
+	unsigned deferred_count;
+	uint32_t errors;
+} audio_sink_t;
+
+// Returns 0 or -1. Files are only created once audio arrives.
+int audio_sink_init(audio_sink_t *a, const char *prefix, const char *device, const audio_conf_t *conf);
+
+// Part of a frame: offset is where buf sits in the frame. dev_us is the frame's
+// timestamp, or 0 if it isn't known yet (see audio_sink_stamp()).
+void audio_sink_write(audio_sink_t *a, const uint8_t *buf, uint32_t len, uint32_t offset, uint64_t dev_us, uint64_t host_us, uint64_t est_us);
+
+// End of the frame whose pieces were written with no time: its timestamp, and
+// whether it failed its CRC. The audio of a damaged frame is listed in the sidecars.
+void audio_sink_stamp(audio_sink_t *a, uint64_t dev_us, uint64_t host_us, uint64_t est_us, bool crc_error);
+
+// Finishes the current file (header, sidecar) and frees the buffers
+void audio_sink_close(audio_sink_t *a);
@@ -0,0 +1,81 @@
+/*
+Device to host clock estimator, see clock_est.h
+
+The fit is redone when a bucket closes, once a second of device time, so a
+sample costs a compare or two. Until two buckets exist the drift is taken as
+zero and the offset is the smallest delta seen.
+*/
+
+#include <string.h>
+
+#include "clock_est.h"
+
+void clock_est_init(clock_est_t *c) {
+	unsigned resets = c->resets;
+	memset(c, 0, sizeof(*c));
+	c->resets = resets;
+}
+
+// Least squares line through the bucket minima, the open bucket included
+static void fit(clock_est_t *c) {
+	clock_pt_t pts[CLOCK_BUCKETS + 1];
+	unsigned n = 0;
+	double sx = 0, sy = 0, sxx = 0, sxy = 0, mx, my, den;
+
+	for (unsigned i=0; i<c->count; i++) pts[n++] = c->pt[(c->next + CLOCK_BUCKETS - c->count + i) % CLOCK_BUCKETS];
+	if (c->cur_valid) pts[n++] = c->cur;
+	if (n == 0) return;
+
+	c->ref_us = pts[0].dev_us;
+	for (unsigned i=0; i<n; i++) {
+		double x = (double)(pts[i].dev_us - c->ref_us);
+		double y = (double)(pts[i].delta_us - pts[0].delta_us);
+		sx += x; sy += y; sxx += x * x; sxy += x * y;
+	}
+	mx = sx / n;
+	my = sy / n;
+	den = sxx - sx * mx;
+	c->skew = (n > 1 && den > 0) ? (sxy - sx * my) / den : 0;
+	c->offset_us = pts[0].delta_us + my - c->skew * mx;
+	c->valid = true;
+}
+
+void clock_est_add(clock_est_t *c, uint64_t dev_us, uint64_t host_us) {
+	int64_t delta = (int64_t)(host_us - dev_us);
+
+	if (c->valid) {
+		int64_t err = delta - (int64_t)(clock_est_map(c, dev_us) - dev_us);
+		// A late frame is only a slow link. Early, or going back in time, the device clock moved.
+		if (dev_us + CLOCK_JUMP_US < c->last_dev_us || err < -CLOCK_JUMP_US) {
+			clock_est_init(c);
+			c->resets++;
+		}
+	}
+	c->samples++;
+	c->last_dev_us = dev_us;
+
+	if (c->cur_valid && dev_us >= c->cur_end) { // Close the bucket
+		c->pt[c->next] = c->cur;
+		c->next = (c->next + 1) % CLOCK_BUCKETS;
+		if (c->count < CLOCK_BUCKETS) c->count++;
+		c->cur_valid = false;
+	}
+	if (!c->cur_valid) {
+		c->cur.dev_us = dev_us;
+		c->cur.delta_us = delta;
+		c->cur_end = dev_us + CLOCK_BUCKET_US;
+		c->cur_valid = true;
+		fit(c);
+		return;
+	}
+	if (delta < c->cur.delta_us) {
+		c->cur.dev_us = dev_us;
+		c->cur.delta_us = delta;
+		if (c->count < 2) fit(c); // Early on every new minimum counts
+	}
+}
+
+uint64_t clock_est_map(const clock_est_t *c, uint64_t dev_us) {
+	if (!c->valid) return 0;
+	return dev_us + (int64_t)(c->offset_us + c->skew * (double)(int64_t)(dev_us - c->ref_us));
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Online device clock to host clock mapping, one per device.
+// A frame's arrival time is its send time plus a link delay that is never
+// negative and is often close to its minimum, so the lower envelope of
+// (host - device) over time is the clock offset, and its slope the drift.
+// Samples go into buckets of device time, each keeps its minimum, and a
+// least squares line through the last CLOCK_BUCKETS minima is the estimate.
+
+#define CLOCK_BUCKET_US	1000000		// Device time per bucket
+#define CLOCK_BUCKETS	64			// About a minute of history
+#define CLOCK_JUMP_US	1000000		// Earlier than the estimate by more than this: device rebooted or clock stepped, start over
+
+typedef struct {
+	uint64_t dev_us;
+	int64_t delta_us;		// host - device, the bucket's minimum
+} clock_pt_t;
+
+typedef struct {
+	clock_pt_t pt[CLOCK_BUCKETS];	// Closed buckets, circular
+	unsigned count, next;
+	clock_pt_t cur;					// Bucket being filled
+	uint64_t cur_end;				// Device time that closes it
+	bool cur_valid;
+
+	// Estimate: host = dev + offset_us + skew * (dev - ref_us)
+	bool valid;
+	uint64_t ref_us;
+	double offset_us;
+	double skew;					// Drift, e.g. 20e-6 for a device 20 ppm slow
+	uint64_t last_dev_us;
+	unsigned resets;
+	uint64_t samples;
+} clock_est_t;
+
+void clock_est_init(clock_est_t *c);
+
+// A frame stamped dev_us by the device arrived by host_us (monotonic)
+void clock_est_add(clock_est_t *c, uint64_t dev_us, uint64_t host_us);
+
+// Host time (same clock as clock_est_add()) the device sent dev_us at, 0 before the first sample
+uint64_t clock_est_map(const clock_est_t *c, uint64_t dev_us);
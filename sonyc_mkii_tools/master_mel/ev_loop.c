@@ -0,0 +1,136 @@
+/*
+Minimal epoll event loop for master_mel
+
+Level triggered. Watches are a small fixed table, the epoll data pointer is
+the table slot. A callback may add or remove watches (its own included),
+slots freed mid-batch are skipped for the rest of that batch and only
+reused after it, so a stale event never reaches a new watch.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "ev_loop.h"
+
+#define EV_BATCH 16
+#define EV_FREED -2	// Slot freed during dispatch, free for reuse after the batch
+
+int ev_init(ev_loop_t *l) {
+	memset(l, 0, sizeof(*l));
+	for (unsigned i=0; i<EV_MAX_WATCHES; i++) l->watch[i].fd = -1;
+	l->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (l->epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	return 0;
+}
+
+void ev_close(ev_loop_t *l) {
+	for (unsigned i=0; i<EV_MAX_WATCHES; i++) {
+		if (l->watch[i].timer && l->watch[i].fd >= 0) close(l->watch[i].fd);
+		l->watch[i].fd = -1;
+	}
+	if (l->epfd >= 0) close(l->epfd);
+	l->epfd = -1;
+}
+
+static ev_watch_t * find_watch(ev_loop_t *l, int fd) {
+	for (unsigned i=0; i<EV_MAX_WATCHES; i++)
+		if (l->watch[i].fd == fd) return &l->watch[i];
+	return NULL;
+}
+
+int ev_add(ev_loop_t *l, int fd, uint32_t events, ev_cb_t cb, void *ctx) {
+	struct epoll_event ev = {0};
+	ev_watch_t *w;
+	if (fd < 0 || find_watch(l, fd) != NULL) { errno = EINVAL; return -1; }
+	w = find_watch(l, -1);
+	if (w == NULL) { errno = ENOSPC; return -1; }
+
+	ev.events = events;
+	ev.data.ptr = w;
+	if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) return -1;
+	w->fd = fd;
+	w->cb = cb;
+	w->ctx = ctx;
+	w->timer = false;
+	w->repeat = false;
+	return 0;
+}
+
+int ev_mod(ev_loop_t *l, int fd, uint32_t events) {
+	struct epoll_event ev = {0};
+	ev_watch_t *w = find_watch(l, fd);
+	if (fd < 0 || w == NULL) { errno = EINVAL; return -1; }
+	ev.events = events;
+	ev.data.ptr = w;
+	return epoll_ctl(l->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int ev_del(ev_loop_t *l, int fd) {
+	ev_watch_t *w = find_watch(l, fd);
+	if (fd < 0 || w == NULL) { errno = EINVAL; return -1; }
+	epoll_ctl(l->epfd, EPOLL_CTL_DEL, fd, NULL);
+	w->fd = l->dispatching ? EV_FREED : -1;
+	return 0;
+}
+
+int ev_timer(ev_loop_t *l, unsigned ms, bool repeat, ev_cb_t cb, void *ctx) {
+	struct itimerspec its = {0};
+	ev_watch_t *w;
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	if (ms == 0) its.it_value.tv_nsec = 1; // 0 would disarm it
+	if (repeat) its.it_interval = its.it_value;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0 || ev_add(l, fd, EPOLLIN, cb, ctx) < 0) {
+		close(fd);
+		return -1;
+	}
+	w = find_watch(l, fd);
+	w->timer = true;
+	w->repeat = repeat;
+	return fd;
+}
+
+void ev_timer_cancel(ev_loop_t *l, int timer) {
+	ev_watch_t *w = find_watch(l, timer);
+	if (timer < 0 || w == NULL || !w->timer) return;
+	ev_del(l, timer);
+	w->timer = false;
+	close(timer);
+}
+
+int ev_run_once(ev_loop_t *l, int timeout_ms) {
+	struct epoll_event events[EV_BATCH];
+	int n = epoll_wait(l->epfd, events, EV_BATCH, timeout_ms);
+	if (n < 0) return errno == EINTR ? 0 : -1;
+
+	l->dispatching = true;
+	for (int i=0; i<n; i++) {
+		ev_watch_t *w = events[i].data.ptr;
+		ev_cb_t cb = w->cb;
+		void *ctx = w->ctx;
+		if (w->fd < 0) continue; // Removed by an earlier callback in this batch
+
+		if (w->timer) {
+			uint64_t expirations;
+			if (read(w->fd, &expirations, sizeof(expirations)) < 0) continue; // Spurious
+			if (!w->repeat) ev_timer_cancel(l, w->fd);
+		}
+		cb(ctx, events[i].events);
+	}
+	l->dispatching = false;
+	for (unsigned i=0; i<EV_MAX_WATCHES; i++)
+		if (l->watch[i].fd == EV_FREED) l->watch[i].fd = -1;
+	return n;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+
+// Minimal epoll loop: fd watches and timers (timerfd), callbacks on the loop thread
+
+#define EV_MAX_WATCHES 16
+
+// events is the epoll mask that fired (EPOLLIN, EPOLLOUT, EPOLLHUP...), EPOLLIN for timers
+typedef void (*ev_cb_t)(void *ctx, uint32_t events);
+
+typedef struct {
+	int fd;			// -1 if free
+	ev_cb_t cb;
+	void *ctx;
+	bool timer;		// fd is a timerfd owned by the loop
+	bool repeat;
+} ev_watch_t;
+
+typedef struct {
+	int epfd;
+	ev_watch_t watch[EV_MAX_WATCHES];
+	bool dispatching;
+} ev_loop_t;
+
+int ev_init(ev_loop_t *l);
+void ev_close(ev_loop_t *l);
+
+// Returns 0 or -1 with errno set. Regular files can't be watched (EPERM).
+int ev_add(ev_loop_t *l, int fd, uint32_t events, ev_cb_t cb, void *ctx);
+int ev_mod(ev_loop_t *l, int fd, uint32_t events);
+int ev_del(ev_loop_t *l, int fd);
+
+// Returns a timer id for ev_timer_cancel(), or -1. One-shot timers are removed before cb runs.
+int ev_timer(ev_loop_t *l, unsigned ms, bool repeat, ev_cb_t cb, void *ctx);
+void ev_timer_cancel(ev_loop_t *l, int timer);
+
+// Waits up to timeout_ms (-1 forever) and runs callbacks for whatever is ready
+// Returns number of events handled, -1 on error
+int ev_run_once(ev_loop_t *l, int timeout_ms);
@@ -0,0 +1,313 @@
+/*
+Firmware image loaders, see fw_image.h
+
+Each format is read into pieces, address and bytes, in file order. Records that
+follow on from the last one grow it, so a HEX or SREC file of 16 byte records
+still makes a handful of pieces. The flat buffer is then laid out from the
+pieces, later ones winning where they overlap, as a flash writer would.
+
+ELF: 32-bit little endian, PT_LOAD program headers with file bytes, placed at
+p_paddr. That is the load address, .data's initial values in flash rather than
+RAM, and what objcopy -O binary/ihex/srec would have written.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fw_image.h"
+
+typedef struct {
+	uint32_t addr;
+	uint32_t len;
+	size_t off;				// In bytes
+} piece_t;
+
+typedef struct {
+	piece_t *p;
+	unsigned count, cap;
+	uint8_t *bytes;
+	size_t size, bytes_cap;
+} pieces_t;
+
+static int add(pieces_t *ps, uint32_t addr, const uint8_t *buf, uint32_t len) {
+	piece_t *last = ps->count ? &ps->p[ps->count - 1] : NULL;
+	if (len == 0) return 0;
+	if ((uint64_t)addr + len > 0x100000000ull) {
+		fprintf(stderr, "Image: data at 0x%08x runs past 4 GiB\r\n", addr);
+		return -1;
+	}
+	if (ps->size + len > ps->bytes_cap) {
+		size_t cap = ps->bytes_cap ? ps->bytes_cap : 256 * 1024;
+		uint8_t *b;
+		while (cap < ps->size + len) cap *= 2;
+		if ((b = realloc(ps->bytes, cap)) == NULL) goto oom;
+		ps->bytes = b;
+		ps->bytes_cap = cap;
+	}
+	if (last && last->addr + last->len == addr && last->off + last->len == ps->size) {
+		last->len += len;
+	}
+	else {
+		if (ps->count == ps->cap) {
+			unsigned cap = ps->cap ? ps->cap * 2 : 16;
+			piece_t *p = realloc(ps->p, cap * sizeof(*p));
+			if (p == NULL) goto oom;
+			ps->p = p;
+			ps->cap = cap;
+		}
+		ps->p[ps->count++] = (piece_t){ addr, len, ps->size };
+	}
+	memcpy(&ps->bytes[ps->size], buf, len);
+	ps->size += len;
+	return 0;
+oom:
+	fprintf(stderr, "Image: out of memory\r\n");
+	return -1;
+}
+
+static uint16_t le16(const uint8_t *p) { return p[0] | p[1] << 8; }
+static uint32_t le32(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+static int load_elf(pieces_t *ps, const uint8_t *f, size_t len) {
+	uint32_t phoff;
+	unsigned phentsize, phnum;
+
+	if (len < 52 || f[4] != 1 || f[5] != 1) { // EI_CLASS ELFCLASS32, EI_DATA ELFDATA2LSB
+		fprintf(stderr, "Image: only 32-bit little endian ELF\r\n");
+		return -1;
+	}
+	phoff = le32(&f[28]);
+	phentsize = le16(&f[42]);
+	phnum = le16(&f[44]);
+	if (phnum == 0 || phentsize < 32 || phoff > len || (size_t)phnum * phentsize > len - phoff) {
+		fprintf(stderr, "Image: ELF has no usable program headers\r\n");
+		return -1;
+	}
+	for (unsigned i=0; i<phnum; i++) {
+		const uint8_t *ph = &f[phoff + i * phentsize];
+		uint32_t offset = le32(&ph[4]), paddr = le32(&ph[12]), filesz = le32(&ph[16]);
+		if (le32(&ph[0]) != 1 || filesz == 0) continue; // PT_LOAD with bytes in the file, not .bss
+		if (offset > len || filesz > len - offset) {
+			fprintf(stderr, "Image: ELF segment %u is cut short\r\n", i);
+			return -1;
+		}
+		if (add(ps, paddr, &f[offset], filesz) < 0) return -1;
+	}
+	return 0;
+}
+
+static int hex_digit(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Hex pairs from s up to the end of the line into rec. Returns the byte count or -1.
+static int hex_bytes(const char *s, const char *end, uint8_t *rec, unsigned max) {
+	unsigned n = 0;
+	while (s < end && *s != '\r' && *s != '\n') {
+		int hi = hex_digit(s[0]), lo = s + 1 < end ? hex_digit(s[1]) : -1;
+		if (hi < 0 || lo < 0 || n == max) return -1;
+		rec[n++] = hi << 4 | lo;
+		s += 2;
+	}
+	return n;
+}
+
+// Next line of text, NULL at the end. Blank lines are skipped.
+static const char *next_line(const char **pos, const char *end, unsigned *line) {
+	const char *s = *pos;
+	while (s < end && (*s == '\r' || *s == '\n' || *s == ' ' || *s == '\t')) {
+		if (*s == '\n') (*line)++;
+		s++;
+	}
+	if (s == end) return NULL;
+	*pos = memchr(s, '\n', end - s);
+	if (*pos == NULL) *pos = end;
+	return s;
+}
+
+static int load_ihex(pieces_t *ps, const char *text, size_t len) {
+	const char *pos = text, *end = text + len, *s;
+	uint8_t rec[256 + 5];
+	uint32_t upper = 0;
+	unsigned line = 1;
+
+	while ((s = next_line(&pos, end, &line)) != NULL) {
+		int n = (*s == ':') ? hex_bytes(s + 1, end, rec, sizeof(rec)) : -1;
+		uint8_t sum = 0;
+		if (n < 5 || n != rec[0] + 5) goto bad;
+		for (int i=0; i<n; i++) sum += rec[i];
+		if (sum != 0) {
+			fprintf(stderr, "Image: HEX line %u: checksum\r\n", line);
+			return -1;
+		}
+		switch (rec[3]) {
+			case 0: if (add(ps, upper + (rec[1] << 8 | rec[2]), &rec[4], rec[0]) < 0) return -1; break;
+			case 1: return 0; // EOF
+			case 2: if (rec[0] != 2) goto bad; upper = (uint32_t)(rec[4] << 8 | rec[5]) << 4; break;
+			case 4: if (rec[0] != 2) goto bad; upper = (uint32_t)(rec[4] << 8 | rec[5]) << 16; break;
+			case 3: case 5: break; // Start address, nothing to program
+			default: goto bad;
+		}
+	}
+	return 0;
+bad:
+	fprintf(stderr, "Image: HEX line %u is not a record\r\n", line);
+	return -1;
+}
+
+static int load_srec(pieces_t *ps, const char *text, size_t len) {
+	const char *pos = text, *end = text + len, *s;
+	uint8_t rec[256];
+	unsigned line = 1;
+
+	while ((s = next_line(&pos, end, &line)) != NULL) {
+		int n = (*s == 'S' && s + 1 < end) ? hex_bytes(s + 2, end, rec, sizeof(rec)) : -1;
+		unsigned type = s[1] - '0', alen;
+		uint32_t addr = 0;
+		uint8_t sum = 0;
+		if (n < 3 || n != rec[0] + 1 || type > 9) goto bad;
+		for (int i=0; i<n-1; i++) sum += rec[i];
+		if ((uint8_t)(sum + rec[n-1]) != 0xFF) { // Ones' complement of the rest
+			fprintf(stderr, "Image: SREC line %u: checksum\r\n", line);
+			return -1;
+		}
+		if (type < 1 || type > 3) continue; // Header, count and start records
+		alen = type + 1;
+		if ((unsigned)n < 1 + alen + 1) goto bad;
+		for (unsigned i=0; i<alen; i++) addr = addr << 8 | rec[1 + i];
+		if (add(ps, addr, &rec[1 + alen], n - 2 - alen) < 0) return -1;
+	}
+	return 0;
+bad:
+	fprintf(stderr, "Image: SREC line %u is not a record\r\n", line);
+	return -1;
+}
+
+// The first line is all hex after its lead character(s)
+static int text_format(const uint8_t *f, size_t len, const char *lead) {
+	size_t i = strlen(lead), n = 0;
+	if (len < i || memcmp(f, lead, i) != 0) return 0;
+	for (; i < len && f[i] != '\r' && f[i] != '\n'; i++, n++)
+		if (hex_digit(f[i]) < 0) return 0;
+	return n >= 4;
+}
+
+static int read_all(FILE *f, uint8_t **buf, size_t *len) {
+	size_t cap = 0, n;
+	*buf = NULL;
+	*len = 0;
+	do {
+		if (*len == cap) {
+			uint8_t *b = realloc(*buf, cap = cap ? cap * 2 : 256 * 1024);
+			if (b == NULL) {
+				fprintf(stderr, "Image: out of memory\r\n");
+				return -1;
+			}
+			*buf = b;
+		}
+		n = fread(&(*buf)[*len], 1, cap - *len, f);
+		*len += n;
+	} while (n > 0);
+	if (ferror(f)) {
+		perror("Image");
+		return -1;
+	}
+	return 0;
+}
+
+static int range_cmp(const void *a, const void *b) {
+	const fw_range_t *x = a, *y = b;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+int fw_image_load(fw_image_t *img, FILE *f, uint32_t bin_addr, unsigned align) {
+	pieces_t ps = {0};
+	uint8_t *file;
+	size_t len;
+	uint64_t lo = UINT64_MAX, hi = 0;
+	int ret = -1;
+
+	memset(img, 0, sizeof(*img));
+	if (read_all(f, &file, &len) < 0) goto out;
+
+	if (len >= 4 && memcmp(file, "\x7f" "ELF", 4) == 0) {
+		img->format = "elf";
+		ret = load_elf(&ps, file, len);
+	}
+	else if (text_format(file, len, ":")) {
+		img->format = "ihex";
+		ret = load_ihex(&ps, (const char *)file, len);
+	}
+	else if (len >= 2 && file[1] >= '0' && file[1] <= '9' && text_format(file, len, (const char []){ 'S', file[1], 0 })) {
+		img->format = "srec";
+		ret = load_srec(&ps, (const char *)file, len);
+	}
+	else {
+		img->format = "bin";
+		ret = len > UINT32_MAX ? -1 : add(&ps, bin_addr, file, len);
+	}
+	if (ret < 0) goto out;
+	ret = -1;
+	if (ps.count == 0) {
+		fprintf(stderr, "Image: nothing to program, empty %s\r\n", img->format);
+		goto out;
+	}
+
+	// Flat buffer over everything, widened to whole flash words
+	for (unsigned i=0; i<ps.count; i++) {
+		if (ps.p[i].addr < lo) lo = ps.p[i].addr;
+		if ((uint64_t)ps.p[i].addr + ps.p[i].len > hi) hi = (uint64_t)ps.p[i].addr + ps.p[i].len;
+	}
+	lo &= ~(uint64_t)(align - 1);
+	hi = (hi + align - 1) & ~(uint64_t)(align - 1);
+	if (hi - lo > FW_SPAN_MAX) {
+		fprintf(stderr, "Image: %s spans 0x%08llx to 0x%08llx, too far apart for one flash\r\n",
+			img->format, (unsigned long long)lo, (unsigned long long)hi);
+		goto out;
+	}
+	img->base = lo;
+	img->size = hi - lo;
+	img->data = malloc(img->size);
+	img->ranges = malloc(ps.count * sizeof(*img->ranges));
+	if (img->data == NULL || img->ranges == NULL) {
+		fprintf(stderr, "Image: out of memory\r\n");
+		goto out;
+	}
+	memset(img->data, 0xFF, img->size);
+	for (unsigned i=0; i<ps.count; i++) {
+		uint32_t a = ps.p[i].addr & ~(align - 1);
+		uint64_t e = ((uint64_t)ps.p[i].addr + ps.p[i].len + align - 1) & ~(uint64_t)(align - 1);
+		memcpy(&img->data[ps.p[i].addr - img->base], &ps.bytes[ps.p[i].off], ps.p[i].len);
+		img->ranges[i] = (fw_range_t){ a, e - a };
+	}
+
+	// Sorted and merged, a flash word is written once however many pieces touch it
+	qsort(img->ranges, ps.count, sizeof(*img->ranges), range_cmp);
+	img->count = 0;
+	for (unsigned i=0; i<ps.count; i++) {
+		fw_range_t *r = img->count ? &img->ranges[img->count - 1] : NULL;
+		if (r && img->ranges[i].addr <= r->addr + r->len) {
+			uint32_t e = img->ranges[i].addr + img->ranges[i].len;
+			if (e > r->addr + r->len) r->len = e - r->addr;
+		}
+		else img->ranges[img->count++] = img->ranges[i];
+	}
+	ret = 0;
+out:
+	if (ret < 0) fw_image_free(img);
+	free(file);
+	free(ps.p);
+	free(ps.bytes);
+	return ret;
+}
+
+void fw_image_free(fw_image_t *img) {
+	free(img->data);
+	free(img->ranges);
+	img->data = NULL;
+	img->ranges = NULL;
+	img->count = 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Firmware image for --program-binary, from a flat .bin, an ELF (PT_LOAD program
+// headers, at their physical address), Intel HEX or SREC, told apart by content.
+// Whatever the format it ends up flat: one buffer from the lowest loaded address
+// to the highest, 0xFF (erased flash) in between, plus the address ranges that
+// were actually in the file. Only those need programming.
+
+#define FW_SPAN_MAX (16*1024*1024)	// Lowest to highest address, more is a mistake (e.g. RAM addresses)
+
+typedef struct {
+	uint32_t addr;
+	uint32_t len;
+} fw_range_t;
+
+typedef struct {
+	const char *format;		// "bin", "elf", "ihex" or "srec"
+	uint8_t *data;			// base .. base + size
+	uint32_t base;
+	size_t size;
+	fw_range_t *ranges;		// Sorted, merged, widened to whole flash words
+	unsigned count;
+} fw_image_t;
+
+// Loads the whole of f. bin_addr places a flat binary, the other formats carry their
+// addresses. align is the flash word, a power of 2. Returns 0, or -1 after saying why.
+int fw_image_load(fw_image_t *img, FILE *f, uint32_t bin_addr, unsigned align);
+
+void fw_image_free(fw_image_t *img);
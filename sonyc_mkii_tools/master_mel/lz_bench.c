@@ -0,0 +1,303 @@
+/*
+Host side round trip test and benchmark for boot_lz.c
+
+Build with 'make bench', runs ./lz_bench on generated images and on the BMS
+bootloader.bin in the tree. Give it files to try real images: ./lz_bench fw.bin
+Exits 1 if any frame doesn't decode to exactly what went in.
+
+Images are cut into frames of the sizes master_mel sends, each compressed on
+its own the way boot_cmd_program_lz does. A frame that doesn't shrink goes
+uncompressed, as master_mel would send it, so the ratio is what crosses the link.
+Decode runs through the same put() per flash word the bootloaders use. After the
+round trip, corrupted blocks are fed to the decoder, which must reject them or
+stay within the frame.
+Numbers are wall clock on an otherwise idle machine, take them as relative.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "boot_lz.h"
+
+#define IMAGE_SIZE		(1024*1024)
+#define DEFAULT_MIN_MS	100
+#define FLASH_WORD		32
+#define FUZZ_ROUNDS		20000
+
+// USB FS CDC tops out around 1 MB/s in practice, the BMS UART far lower
+#define LINE_RATE_BYTES_PER_SEC (1000*1000)
+
+typedef struct {
+	const char *name;
+	uint8_t *data;
+	size_t size;
+} image_t;
+
+static const unsigned frame_sizes[] = { 256, 1024, 32768 };	// BMS today, BMS UART limit, H7 BOOT_CHUNK_MAX
+
+static unsigned min_ms = DEFAULT_MIN_MS;
+static blz_decoder_t dec;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Where put() writes, like flash at the frame's address
+typedef struct {
+	uint8_t *out;
+	uint32_t max;
+} sink_t;
+
+static int put_word(void *ctx, uint32_t off, const uint8_t *word) {
+	sink_t *s = ctx;
+	if (off + FLASH_WORD > s->max) return -1;
+	memcpy(&s->out[off], word, FLASH_WORD);
+	return 0;
+}
+
+// Thumb-2 like: a few hundred common instructions, some with fresh immediates
+static void gen_code(uint8_t *p, size_t n) {
+	uint16_t vocab[384];
+	for (unsigned i=0; i<sizeof(vocab)/sizeof(vocab[0]); i++) vocab[i] = rand();
+	for (size_t i=0; i+2<=n; i+=2) {
+		uint16_t op = vocab[(rand() % 64) * (rand() % 6)];
+		if (rand() % 4 == 0) op = (op & 0xFF00) | (rand() & 0xFF);
+		memcpy(&p[i], &op, 2);
+	}
+}
+
+// Sine table, CRC table and a sparse glyph bitmap, the kinds of tables firmware carries
+static void gen_tables(uint8_t *p, size_t n) {
+	size_t i = 0;
+	while (i < n) {
+		switch (rand() % 3) {
+			case 0:
+				for (unsigned k=0; k<1024 && i+2<=n; k++, i+=2) {
+					int16_t v = 32767 * sin(2 * M_PI * k / 1024);
+					memcpy(&p[i], &v, 2);
+				}
+				break;
+			case 1:
+				for (uint32_t k=0; k<256 && i+4<=n; k++, i+=4) {
+					uint32_t c = k;
+					for (int b=0; b<8; b++) c = c & 1 ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+					memcpy(&p[i], &c, 4);
+				}
+				break;
+			default:
+				for (unsigned k=0; k<2048 && i<n; k++, i++) p[i] = rand() % 5 ? 0 : 1u << (rand() % 8);
+				break;
+		}
+		if (i < n && n - i < 4) memset(&p[i], 0, n - i), i = n;
+	}
+}
+
+// Zeroed .data, 0xFF padding between sections
+static void gen_runs(uint8_t *p, size_t n) {
+	for (size_t i=0; i<n; ) {
+		size_t len = 64 + rand() % 8192;
+		if (len > n - i) len = n - i;
+		memset(&p[i], rand() % 2 ? 0x00 : 0xFF, len);
+		i += len;
+	}
+}
+
+static void gen_random(uint8_t *p, size_t n) {
+	for (size_t i=0; i<n; i++) p[i] = rand();
+}
+
+// Blocks of the above, mostly code
+static void gen_firmware(uint8_t *p, size_t n) {
+	for (size_t i=0; i<n; ) {
+		size_t len = 4096 + rand() % 65536;
+		unsigned kind = rand() % 20;
+		if (len > n - i) len = n - i;
+		if (kind < 12) gen_code(&p[i], len);
+		else if (kind < 15) gen_tables(&p[i], len);
+		else if (kind < 18) gen_runs(&p[i], len);
+		else gen_random(&p[i], len);
+		i += len;
+	}
+}
+
+static bool image_gen(image_t *img, const char *name, void (*gen)(uint8_t *, size_t)) {
+	img->name = name;
+	img->size = IMAGE_SIZE;
+	img->data = malloc(img->size);
+	if (img->data == NULL) return false;
+	gen(img->data, img->size);
+	return true;
+}
+
+// Padded to the flash word with 0xFF, as master_mel does
+static bool image_load(image_t *img, const char *path) {
+	FILE *f = fopen(path, "rb");
+	long len;
+	if (f == NULL) return false;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	img->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	img->size = (len + FLASH_WORD - 1) / FLASH_WORD * FLASH_WORD;
+	img->data = malloc(img->size ? img->size : 1);
+	if (img->data == NULL || len <= 0 || fread(img->data, 1, len, f) != (size_t)len) {
+		fclose(f);
+		return false;
+	}
+	memset(&img->data[len], 0xFF, img->size - len);
+	fclose(f);
+	return true;
+}
+
+// Round trip and throughput for one frame size. False if any frame came back different.
+static bool bench(const image_t *img, unsigned frame) {
+	unsigned nframes = (img->size + frame - 1) / frame;
+	uint8_t *z = malloc((size_t)nframes * BLZ_BOUND(frame));
+	uint32_t *zlen = malloc(nframes * sizeof(*zlen));
+	uint8_t *back = malloc(frame);
+	uint64_t start, comp_ns, dec_ns, iters;
+	size_t wire = 0, raw_frames = 0, decoded = 0;
+	char dec_rate[16] = "-";
+	bool ok = true;
+
+	if (z == NULL || zlen == NULL || back == NULL) {
+		ok = false;
+		goto out;
+	}
+
+	start = now_ns();
+	iters = 0;
+	do {
+		for (unsigned k=0; k<nframes; k++) {
+			size_t off = (size_t)k * frame;
+			uint32_t n = img->size - off < frame ? img->size - off : frame;
+			int32_t ret = blz_compress(&img->data[off], n, &z[(size_t)k * BLZ_BOUND(frame)], n - 1);
+			zlen[k] = ret < 0 ? 0 : ret; // 0: goes raw
+		}
+		iters++;
+		comp_ns = now_ns() - start;
+	} while (comp_ns < min_ms * 1000000ULL);
+	comp_ns /= iters;
+
+	start = now_ns();
+	iters = 0;
+	do {
+		for (unsigned k=0; k<nframes && ok; k++) {
+			size_t off = (size_t)k * frame;
+			uint32_t n = img->size - off < frame ? img->size - off : frame;
+			sink_t s = { back, frame };
+			int32_t ret;
+			if (zlen[k] == 0) continue;
+			ret = blz_decode(&dec, &z[(size_t)k * BLZ_BOUND(frame)], zlen[k], FLASH_WORD, frame, put_word, &s);
+			if (ret != (int32_t)n || memcmp(back, &img->data[off], n) != 0) {
+				fprintf(stderr, "%s: frame %u of %u bytes FAILED round trip (%d)\n", img->name, k, frame, ret);
+				ok = false;
+			}
+		}
+		iters++;
+		dec_ns = now_ns() - start;
+	} while (ok && dec_ns < min_ms * 1000000ULL);
+	dec_ns /= iters;
+	if (!ok) goto out;
+
+	for (unsigned k=0; k<nframes; k++) {
+		size_t off = (size_t)k * frame;
+		uint32_t n = img->size - off < frame ? img->size - off : frame;
+		wire += zlen[k] ? zlen[k] : n;
+		decoded += zlen[k] ? n : 0;
+		raw_frames += zlen[k] == 0;
+	}
+	if (decoded) snprintf(dec_rate, sizeof(dec_rate), "%.1f", decoded / (dec_ns / 1e9) / 1e6); // Raw frames aren't decoded
+	printf("%-20.20s %6u %7.1f%% %5u/%-5u %8.1f MB/s %8s MB/s %8.2f s %8.2f s\n",
+		img->name, frame, 100.0 * wire / img->size, (unsigned)raw_frames, nframes,
+		img->size / (comp_ns / 1e9) / 1e6, dec_rate,
+		(double)img->size / LINE_RATE_BYTES_PER_SEC, (double)wire / LINE_RATE_BYTES_PER_SEC);
+out:
+	free(z);
+	free(zlen);
+	free(back);
+	return ok;
+}
+
+// Corrupt blocks never make the decoder write outside the frame or read past the input
+static bool fuzz(const image_t *img) {
+	const unsigned frame = 1024;
+	uint8_t z[BLZ_BOUND(1024)], back[1024];
+	unsigned rejected = 0;
+
+	for (unsigned r=0; r<FUZZ_ROUNDS; r++) {
+		size_t off = (size_t)(rand() % (img->size / frame)) * frame;
+		int32_t len = blz_compress(&img->data[off], frame, z, sizeof(z));
+		sink_t s = { back, frame };
+		int32_t ret;
+		if (len <= 0) continue;
+		for (int k = 1 + rand() % 4; k; k--) z[rand() % len] ^= 1u << (rand() % 8);
+		if (rand() % 4 == 0) len = rand() % len; // Cut short
+		ret = blz_decode(&dec, z, len, FLASH_WORD, frame, put_word, &s);
+		if (ret > (int32_t)frame || (ret >= 0 && ret % FLASH_WORD)) {
+			fprintf(stderr, "Fuzz FAILED: decoder returned %d for a %u byte frame\n", ret, frame);
+			return false;
+		}
+		rejected += ret < 0;
+	}
+	printf("Fuzz: %u corrupt blocks, %u rejected, the rest stayed within the frame\n", FUZZ_ROUNDS, rejected);
+	return true;
+}
+
+static void usage(const char *me) {
+	fprintf(stderr, "Usage: %s [--min-ms ms] [image.bin ...]\n", me);
+}
+
+int main(int argc, char **argv) {
+	static struct option long_options[] = {
+		{"min-ms", required_argument, 0, 'm'},
+		{0, 0, 0, 0}
+	};
+	static const struct { const char *name; void (*gen)(uint8_t *, size_t); } gens[] = {
+		{ "gen:firmware", gen_firmware },
+		{ "gen:code", gen_code },
+		{ "gen:tables", gen_tables },
+		{ "gen:runs", gen_runs },
+		{ "gen:random", gen_random },
+	};
+	bool ok = true;
+
+	while (1) {
+		int c = getopt_long(argc, argv, "m:", long_options, NULL);
+		if (c == -1) break;
+		switch (c) {
+			case 'm': min_ms = strtoul(optarg, NULL, 0); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	srand(1);
+	printf("Window %u, min match %u. Wire is compressed frames plus the ones sent raw, time at %u kB/s.\n",
+		BLZ_WINDOW, BLZ_MIN_MATCH, LINE_RATE_BYTES_PER_SEC / 1000);
+	printf("%-20s %6s %8s %11s %13s %13s %10s %10s\n", "image", "frame", "wire", "raw/frames", "compress", "decode", "raw time", "lz time");
+	for (unsigned i=0; i<sizeof(gens)/sizeof(gens[0]); i++) {
+		image_t img;
+		if (!image_gen(&img, gens[i].name, gens[i].gen)) return 1;
+		for (unsigned f=0; f<sizeof(frame_sizes)/sizeof(frame_sizes[0]); f++) ok &= bench(&img, frame_sizes[f]);
+		if (i == 0) ok &= fuzz(&img);
+		free(img.data);
+	}
+	for (int i=optind; i<argc; i++) {
+		image_t img;
+		if (!image_load(&img, argv[i])) {
+			fprintf(stderr, "Can't read %s\n", argv[i]);
+			return 1;
+		}
+		for (unsigned f=0; f<sizeof(frame_sizes)/sizeof(frame_sizes[0]); f++) ok &= bench(&img, frame_sizes[f]);
+		free(img.data);
+	}
+	return ok ? 0 : 1;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // sendmmsg() in udp_out.h
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
@@ -7,8 +8,13 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 //#include <sys/ioctl.h>
 //#include <ctype.h>
 //#include <errno.h>
@@ -19,14 +25,52 @@
 #include "serial_frame.h"
 #include "master_mel.h"
 #include "bootloader.h"
+#include "memory_map.h"
+#include "ev_loop.h"
+#include "spsc_ring.h"
+#include "audio_sink.h"
+#include "udp_out.h"
+#include "shm_out.h"
+#include "mel_record.h"
+#include "clock_est.h"
+#include "metrics.h"
+#include "fw_image.h"
+#include "boot_lz.h"
 
 //#define ALWAYS_FLUSH_FILE
 
 #define BUF_SZ 4096
 #define MY_STDIN_BUF_SZ 1024
 
+// --audio-wav format unless told otherwise
+#define AUDIO_DEFAULT_RATE		48000
+#define AUDIO_DEFAULT_BITS		16
+#define AUDIO_DEFAULT_CHANNELS	1
+
+// Frames up to this size are decoded whole, bigger ones (long audio captures) are
+// streamed through audio_stream_handler() so memory use doesn't grow with frame size
+#define DECODE_BUF_SZ (16*1024)
+
 // Must be % 32 , must fit in mote side buffer (2 kByte typ) when encoded
-#define PROGRAM_CHUNK_SIZE 256 // For some reason, F1 programming fails if > 512. Should investigate.
+#define PROGRAM_CHUNK_SIZE BOOT_CHUNK_LEGACY // For some reason, F1 programming fails if > 512. Should investigate.
+// The H7 says how much it takes in its hello reply. Bigger frames mean fewer ACKs, but
+// the window is cut so no more than this is in flight.
+#define PROG_INFLIGHT_MAX	(128*1024)
+
+// boot_cmd_program_win: frames in flight. USB flow control on the H7 holds back whatever it
+// can't buffer yet. The BMS UART takes one frame per exchange, more would be dropped by the H7.
+#define PROG_WINDOW_DEFAULT	16
+#define PROG_WINDOW_BMS		1
+#define PROG_TIMEOUT_MS		1000	// First resend, and a silent H7 falls back to stop-and-wait after this
+#define PROG_TIMEOUT_BMS_MS	5000	// The F1 erases before its first write
+#define PROG_RETRIES		5		// Fail after this many timeouts without progress
+#define ERASE_SECTOR_MS		4000	// H7 worst case per sector, an erase with no answer by then is sent again
+#define CMD_TIMEOUT_MS		1000	// Same for hello, boot stops waiting
+#define PROG_TICK_MS		10		// Resend check, the timeout itself follows the measured round trip
+#define PROG_RTO_MIN_US		50000
+#define PROG_SLOTS			64		// Send times kept, > BOOT_PROG_WINDOW_MAX
+#define PROG_DIGEST_BLOCK	4096	// --delta compares flash in blocks this big
+#define PROG_SKIP_MIN		512		// Erased (0xFF) runs at least this long aren't sent, shorter ones cost less than a new frame
 
 //#define DEFAULT_ALLOW_UNSAFE
 #define DEFAULT_VERBOSE
@@ -34,7 +78,7 @@
 #define COND_FCLOSE(x) if (x != NULL) fclose(x)
 
 // random between 49152 and 65535
-//#define MASTER_MEL_DEFAULT_UDP_LISTEN_PORT 51210 // NYI
+#define MASTER_MEL_DEFAULT_UDP_LISTEN_PORT 51210 // --control, config pushes
 #define MASTER_MEL_DEFAULT_UDP_SEND_PORT   61393
 
 // On Linux (but not cygwin) there are too many newlines in the debug output...
@@ -47,12 +91,29 @@ static void filter_last_newline(uint8_t *str, int len) { ; }
 
 #include "my_socket.c"
 
-/* TODO
-	Fix all the write() calls which assume buffer goes out in one shot... rookie mistake yeah...
-*/
+// Stamps frames we send, monotonic like the mote side clocks
+uint64_t serial_frame_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-// CTRL-C Handler flag
-static volatile bool caught_stop = false;
+// Arrival time of a read() batch, taken once for every frame decoded from it.
+// Wall clock to line up with other host logs, monotonic for the clock estimate.
+typedef struct {
+	uint64_t real_us;
+	uint64_t mono_us;
+} host_stamp_t;
+
+static void host_stamp(host_stamp_t *t) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	t->real_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	t->mono_us = serial_frame_now_us();
+}
+
+// CTRL-C Handler flag, also set to stop every device
+static atomic_bool caught_stop = false;
 
 static int verbose_flag;
 static int listen_flag;
@@ -60,31 +121,193 @@ static int unsafe_flag;
 static int input_stdin_flag;
 static int print_data_stdout_flag;
 static int print_timestamps_flag;
+static int cobs_flag;
+static int binary_flag;		// --binary: mel_rec_t records to the data files and UDP instead of bare payload
+static int delta_flag;		// --delta: only erase and program the H7 sectors that differ from the image
+static int no_compress_flag;	// --no-compress: never boot_cmd_program_lz
+static int no_verify_flag;		// --no-verify: don't check the H7's flash against the image after programming
+static int multi_dev_flag;	// More than one --dev, tag console output with the device
+
+static const char *metrics_path;	// --metrics-file, NULL if not asked for
+static unsigned metrics_sec = 10;
 
-static int got_ack;		// Global shared ACK flag.
-static int got_nack; 	// Global shared NACK flag.
+#define HELLO_TIMEOUT_MS 1000	// Older firmware ignores a framing HELLO, don't wait forever
+#define MEL_MAX_DEVS 16			// One thread each
 
 typedef struct {
+	const char *name;		// Device tag for console output, e.g. ttyACM0
+	uint8_t dev;			// Index in the device list, mel_rec_t.dev
+	uint32_t rec_seq;		// Next mel_rec_t.seq
 	FILE *audio_file;
+	audio_sink_t *audio_wav;	// --audio-wav, NULL if not asked for
 	FILE *data_file;
 	FILE *data_and_debug_file;
-	int tx_socket_fd;
+	udp_out_t *udp;			// UDP consumers, NULL if none
+	shm_out_t *shm;			// --shm ring, NULL if none
+	sf_decoder_t decoder;	// Per-port decoder state
+	int got_ack;			// ACK/NACK arrived, consumed by the command in flight
+	int got_nack;
+	uint32_t link_framing;	// Framing we send in, set by the HELLO reply
+	int hello_pending;		// Our HELLO to the H7 is unanswered
 	unsigned audio_bytes_written;
+	unsigned audio_crc_errors;	// Audio frames that failed their CRC, written and marked in the sidecar
 	unsigned debug_bytes_written;
 	unsigned data_bytes_written;
 	unsigned frame_count;
+	uint64_t dev_us;		// Last frame: device timestamp
+	uint64_t host_us;		// Last frame: host arrival, wall clock
+	int64_t delta_us;		// host_us - dev_us, offset + link latency
+	uint64_t est_us;		// Last frame: when it was sent, device time mapped to wall clock. 0 if unknown.
 } mel_status_t;
 
-static bool parse_frame(serial_frame_t *f, mel_status_t *status);
+// Decoded frames are handed to the sink thread through a ring, the ingest thread
+// never waits on a file, socket or stdout. Size it for a few seconds of audio.
+#define SINK_RING_SZ (4*1024*1024)
+
+// Ring records are the mel_rec_t every binary output uses, then the payload.
+// seq is filled in on the sink side.
+
+#define TX_HIGH_WATER (64*1024)	// Stop taking stdin/control input while a device has this much queued
+#define CMD_FRAMING 0x10000		// Not a bootloader cmd, the --cobs HELLO. Runs first.
+
+// One program frame, a piece of the image
+typedef struct {
+	uint32_t off;
+	uint32_t len;
+	uint32_t zoff;			// boot_cmd_program_lz: its block in prog.z
+	uint32_t zlen;			// 0 if it goes uncompressed
+} prog_frame_t;
+
+// Everything one serial port needs. Each runs its own event loop on its own thread
+// and only the inbox is shared with the main thread.
+typedef struct {
+	ev_loop_t loop;
+	pthread_t thread;
+	const char *path;
+	int fd;						// Serial port, non-blocking
+	bool stop;					// Port failed or a command gave up, this device is done
+	bool failed;				// A command failed or went unanswered, master_mel exits 1
+	atomic_bool running;
+	mel_status_t status;		// Counters are split: frame_count is ingest's, the rest the sink's
+	uint8_t frame_buf[DECODE_BUF_SZ];	// Decoder working buffer
+	serial_frame_t f;			// Last decoded frame
+	uint8_t rx_buf[BUF_SZ];
+	host_stamp_t rx_stamp;		// When rx_buf was read
+	clock_est_t clock;			// Device time_us to host time
+	metrics_t metrics;			// Live counters, see metrics.h for who writes what
+	uint8_t enc_buf[BUF_SZ];	// Encode scratch, queued straight away
+
+	// Handlers that write files, sockets and stdout run on the sink thread
+	pthread_t sink_thread;
+	spsc_ring_t sink_ring;
+	int sink_wake;				// eventfd, blocking, poked once per read that queued anything
+	bool sink_pushed;
+	atomic_bool sink_stop;
+
+	// Bytes the port didn't take yet, drained on EPOLLOUT
+	uint8_t *tx_buf;
+	size_t tx_len, tx_off, tx_cap;
+
+	// Data frames posted by the main thread, [uint32_t len][payload] back to back
+	int wake;					// eventfd, poked after a post or when input closes
+	pthread_mutex_t inbox_lock;
+	uint8_t *inbox;
+	size_t inbox_len, inbox_cap;
+	atomic_size_t backlog;		// Inbox + TX queue, updated under inbox_lock
+
+	// Commands run one at a time, each waits for its ACK. Programming keeps a window of frames in flight.
+	int command_field;			// boot_cmd_* (and CMD_FRAMING) still to do
+	int in_flight;				// Waiting on its ACK, 0 if none
+	bool cmds_done;
+	int hello_timer;
+	bool hello_timed_out;
+	int cmd_timer;				// Hello, erase or boot in flight: no answer yet
+	unsigned cmd_tries;			// Its resends
+	bool cmd_timed_out;
+	int erase_start, erase_end;
+	FILE *prog_bin_file, *prog_bms_bin_file;
+	uint32_t program_addr;
+	unsigned program_window;
+	uint32_t boot_chunk;		// From the H7's hello reply, PROGRAM_CHUNK_SIZE if it didn't say
+	uint32_t boot_cmds;			// Same, boot_cmd_t it knows, 0 if it didn't say
+	struct {					// Program command in progress
+		enum { PROG_SEND, PROG_DIGEST, PROG_ERASE, PROG_VERIFY } phase;
+		uint8_t *image;			// Lowest to highest address in the file, 0xFF between
+		size_t size;
+		uint32_t addr;			// Where image[0] goes
+		fw_range_t *ranges;		// What the file has, the rest of image is filler
+		unsigned range_count;
+		uint32_t word;			// Flash word, ranges and frames are whole ones
+		size_t skipped;			// Erased bytes in ranges that weren't sent
+		uint8_t dest;
+		uint32_t chunk;			// Payload per frame
+		prog_frame_t *frames;	// What to send, all of the image unless --delta left some out
+		uint32_t count, frames_cap;
+		size_t bytes;			// Sum of the frames
+		uint8_t *z;				// Compressed frames, back to back
+		size_t zbytes;			// What the frames take on the wire, compressed or not
+		bool lz;				// Send boot_cmd_program_lz where it shrinks a frame
+		uint32_t *digest;		// --delta: the device's CRC of each PROG_DIGEST_BLOCK of the image
+		uint32_t digest_count, digest_got, digest_req;	// digest_req: blocks in the request out
+		uint32_t dirty;			// --delta: bit per sector to erase and program
+		int erase_first;		// Erase out: erase_first to erase_sector - 1
+		int erase_sector;		// First sector not erased yet
+		unsigned tries;			// Resends of the digest, erase or verify request out
+		unsigned verify_got;	// Ranges verified so far
+		uint64_t verify_us;		// When verifying started
+		uint32_t next;			// Every frame below is acknowledged
+		uint32_t sent;			// Frames below were sent at least once
+		uint32_t sack;			// Last ACK: bit i, next + 1 + i arrived too
+		uint32_t fast_resent;	// next + 1 when resent for a hole in sack, 0 if not
+		unsigned window;
+		uint16_t session;
+		bool legacy;			// boot_cmd_program, one frame per ACK
+		bool acked;				// Any windowed ACK yet
+		bool failed;
+		int timer;
+		unsigned timeout_ms;
+		uint32_t resent;
+		uint64_t start_us, progress_us;	// progress_us: next last moved
+		uint64_t resend_us;				// Last timeout resend
+		uint64_t sent_us[PROG_SLOTS];	// By seq, 0 once resent: those don't give a round trip (Karn)
+		uint32_t srtt_us, rttvar_us, rto_us;
+	} prog;
+	uint8_t ack_payload[sizeof(boot_digest_t) + BOOT_DIGEST_MAX * sizeof(uint32_t)]; // Of the last ACK/NACK, boot_*_t
+	uint32_t ack_len;			// 0 if it had none, cleared once used
+} mel_ctx_t;
+
+// Config input, read on the main thread once every device is done with its
+// commands and copied to all of them
+typedef struct {
+	ev_loop_t loop;
+	bool started;
+	bool paused;				// Some device is over TX_HIGH_WATER
+	bool stdin_open;
+	bool stdin_poll;			// Regular file, epoll can't watch those, just read it
+	char line_buf[MY_STDIN_BUF_SZ];
+	size_t line_len;
+	int ctl_fd;					// UDP control socket, -1 if none
+} mel_input_t;
+
+static mel_ctx_t *devs[MEL_MAX_DEVS];
+static unsigned dev_count;
+static int main_wake = -1;			// eventfd, devices poke it when commands finish, backlog drains or they exit
+static atomic_int cmds_pending;		// Devices still running their commands
+static atomic_int devs_running;
+static atomic_bool inputs_open;		// Main thread may still post data frames
+
+static bool parse_frame(mel_ctx_t *m, serial_frame_t *f);
 //static void error_frame(serial_frame_t *f, mel_status_t *status);
-static void handle_frame(serial_frame_t *f, mel_status_t *status);
-static void handle_frame(serial_frame_t *f, mel_status_t *status);
+static void handle_frame(mel_ctx_t *m, serial_frame_t *f);
+static void sink_frame(mel_status_t *status, mel_rec_t *rec);
 static void debug_frame_handler(serial_frame_t *f, mel_status_t *status);
 static void debug_bms_frame_handler(serial_frame_t *f, mel_status_t *status);
 static void data_string_frame_handler(serial_frame_t *f, mel_status_t *status);
 static void audio_frame_handler(serial_frame_t *f, mel_status_t *status);
+static void audio_stream_handler(void *ctx, uint8_t dest, uint32_t type, uint32_t offset, const uint8_t *buf, uint32_t len);
+static void hello_frame_handler(serial_frame_t *f, mel_status_t *status);
+static void cmd_advance(mel_ctx_t *m);
 
-static void get_frames(int fd, uint8_t *buf, serial_frame_t *f, mel_status_t *status);
 
 #define MY_PRINTF(...) \
 	do { \
@@ -92,6 +315,19 @@ static void get_frames(int fd, uint8_t *buf, serial_frame_t *f, mel_status_t *st
 			printf(__VA_ARGS__); \
 	} while(0)
 
+static void print_tag(FILE *out, mel_status_t *status);
+
+// MY_PRINTF from a device thread, tagged and kept in one piece
+#define DEV_PRINTF(status, ...) \
+	do { \
+		if (verbose_flag) { \
+			flockfile(stdout); \
+			print_tag(stdout, status); \
+			printf(__VA_ARGS__); \
+			funlockfile(stdout); \
+		} \
+	} while(0)
+
 // Needed to support serial_frame_decode()
 // Caller (us) must handle free()
 void * serial_frame_malloc(size_t size) {
@@ -99,27 +335,88 @@ void * serial_frame_malloc(size_t size) {
 	return p;
 }
 
+// Stops everything through the main loop so audio files get their final header and sidecar
 void intHandler(int dummy __attribute__ ((unused))) {
-	//caught_stop = true;
-	exit(0); // more responsive
+	uint64_t one = 1;
+	caught_stop = true;
+	if (main_wake >= 0 && write(main_wake, &one, sizeof(one)) < 0) exit(0);
+}
+
+static void wake(int efd) {
+	uint64_t one = 1;
+	if (write(efd, &one, sizeof(one)) < 0) perror("eventfd write");
+}
+
+static void wake_drain(int efd) {
+	uint64_t count;
+	if (read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("eventfd read");
+}
+
+// Republishes the device backlog, the main thread resumes input once it drops below the mark
+static void update_interest(mel_ctx_t *m) {
+	size_t queued = m->tx_len - m->tx_off;
+	size_t old, now;
+	ev_mod(&m->loop, m->fd, EPOLLIN | (queued ? EPOLLOUT : 0));
+
+	pthread_mutex_lock(&m->inbox_lock);
+	now = queued + m->inbox_len;
+	old = atomic_exchange(&m->backlog, now);
+	pthread_mutex_unlock(&m->inbox_lock);
+	if (old >= TX_HIGH_WATER && now < TX_HIGH_WATER) wake(main_wake);
 }
 
-// Wrapper to ensure full buffer goes out and basic error check
-// Returns number of bytes written but does not need to be checked unless for error (-1)
-static int my_write_buf(int fd, uint8_t *buf, int len) {
-	int ret = write(fd, buf, len);
-	int written = ret;
-	while (ret < len) {
-		if (ret <= 0) {
-			perror("write()");
-			return -1;
+// Writes as much of the TX queue as the port takes without blocking
+static void tx_flush(mel_ctx_t *m) {
+	while (m->tx_off < m->tx_len) {
+		ssize_t ret = write(m->fd, &m->tx_buf[m->tx_off], m->tx_len - m->tx_off);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR) break;
+			perror("Serial device write error");
+			m->stop = true;
+			break;
 		}
-		buf += ret;
-		len -= ret;
-		ret = write(fd, buf, len);
-		written += ret;
+		m->tx_off += ret;
+	}
+	if (m->tx_off == m->tx_len) m->tx_off = m->tx_len = 0;
+	update_interest(m);
+}
+
+// Room for len more bytes at the end of the TX queue
+static bool tx_reserve(mel_ctx_t *m, size_t len) {
+	if (m->tx_off) { // Compact
+		memmove(m->tx_buf, &m->tx_buf[m->tx_off], m->tx_len - m->tx_off);
+		m->tx_len -= m->tx_off;
+		m->tx_off = 0;
 	}
-	return written;
+	if (m->tx_len + len > m->tx_cap) {
+		size_t cap = m->tx_cap ? m->tx_cap : BUF_SZ;
+		uint8_t *p;
+		while (cap < m->tx_len + len) cap *= 2;
+		p = realloc(m->tx_buf, cap);
+		if (p == NULL) { fprintf(stderr, "TX queue: out of memory, frame dropped\r\n"); return false; }
+		m->tx_buf = p;
+		m->tx_cap = cap;
+	}
+	return true;
+}
+
+// Queues an encoded frame for the port. Never blocks, never short writes.
+static void link_send(mel_ctx_t *m, const uint8_t *buf, size_t len) {
+	if (!tx_reserve(m, len)) return;
+	memcpy(&m->tx_buf[m->tx_len], buf, len);
+	m->tx_len += len;
+	tx_flush(m);
+}
+
+// Encodes straight into the TX queue, for frames bigger than enc_buf. len is the payload.
+static int link_sendv(mel_ctx_t *m, const sf_iovec_t *iov, uint32_t iovcnt, uint32_t len, uint8_t dest, uint32_t pkt_type) {
+	int ret;
+	if (!tx_reserve(m, SF_ENCODED_MAX(len))) return -1;
+	ret = sf_encodev_framing(m->status.link_framing, iov, iovcnt, m->tx_cap - m->tx_len, &m->tx_buf[m->tx_len], dest, pkt_type, NULL);
+	if (ret < 0) return ret;
+	m->tx_len += ret;
+	tx_flush(m);
+	return ret;
 }
 
 static int set_both_file(const char *path, mel_status_t *status) {
@@ -188,17 +485,19 @@ static void set_mf_attr(int fd) {
 	options.c_cc[VTIME] = 0;
 
 	options.c_iflag &= ~(IXON | IXOFF | IXANY);
+	options.c_iflag &= ~(ICRNL | INLCR | IGNCR | ISTRIP | BRKINT | PARMRK); // Frames are binary, a 0x0D must stay one
 
 	//cfsetspeed(&options, 9600); // baud is meaningless for usb-serial
 	tcsetattr(fd, TCSANOW, &options);
 }
 
-#define CHECK_FLAG(x) {if (flag & x) MY_PRINTF("Flag: " #x "\r\n");}
-static bool parse_frame(serial_frame_t *f, mel_status_t *status) {
+#define CHECK_FLAG(x) {if (flag & x) DEV_PRINTF(status, "Flag: " #x "\r\n");}
+static bool parse_frame(mel_ctx_t *m, serial_frame_t *f) {
+	mel_status_t *status = &m->status;
 	if (f == NULL) { MY_PRINTF("NULL!!!\r\n"); return false; }
 	frame_flag_t flag = f->flag;
 	if (f->err == NO_FRAME) return false;
-	if (f->err) MY_PRINTF("Frame Error %d\r\n", f->err);
+	if (f->err) DEV_PRINTF(status, "Frame Error %d\r\n", f->err);
 
 	CHECK_FLAG(NONE_FLAG);
 	//CHECK_FLAG(FRAME_FOUND);
@@ -207,12 +506,13 @@ static bool parse_frame(serial_frame_t *f, mel_status_t *status) {
 	CHECK_FLAG(CRC_ERROR);
 
 	if (flag & CRC_ERROR) {
-		MY_PRINTF("DEBUG: PAYLOAD SIZE: %u\r\n", f->sz);
+		metrics_add(&m->metrics.crc_errors, 1);
+		DEV_PRINTF(status, "DEBUG: PAYLOAD SIZE: %u\r\n", f->sz);
 	}
 
 	if (flag & FRAME_FOUND) {
-		handle_frame(f, status);
-		if (f->buf)
+		handle_frame(m, f);
+		if (f->buf && !(flag & BUF_VIEW))
 			free(f->buf);
 		f->buf = NULL;
 		f->sz = 0;
@@ -240,47 +540,205 @@ static bool parse_frame(serial_frame_t *f, mel_status_t *status) {
 	// return 0;
 // }
 
-// Called on completed valid frames as they come in from parse_frame()
-// parse_frame() will free() after this function returns
-static void handle_frame(serial_frame_t *f, mel_status_t *status) {
+// Copies a frame (or piece) into the sink ring, the decoder reuses its buffer
+// Full ring: the record is dropped and counted, ingest never waits
+static void sink_push(mel_ctx_t *m, uint8_t kind, uint8_t type, uint8_t dest, uint32_t offset,
+		const serial_frame_t *f, uint64_t est_us, const uint8_t *buf, uint32_t len) {
+	mel_rec_t *rec = spsc_reserve(&m->sink_ring, sizeof(*rec) + len);
+	if (rec == NULL) return;
+	memset(rec, 0, sizeof(*rec));
+	rec->magic = MEL_REC_MAGIC;
+	rec->version = MEL_REC_VERSION;
+	rec->kind = kind;
+	rec->type = type;
+	rec->dest = dest;
+	rec->dev = m->status.dev;
+	rec->len = len;
+	rec->offset = offset;
+	if (f != NULL) {
+		rec->flags = f->flag & ~BUF_VIEW; // Says how we held it, nothing about the frame
+		rec->crc32 = f->crc32;
+		rec->dev_us = f->time_us;
+	}
+	rec->host_us = m->rx_stamp.real_us;
+	rec->est_us = est_us;
+	if (len) memcpy(rec + 1, buf, len);
+	spsc_commit(&m->sink_ring);
+	m->sink_pushed = true;
+}
+
+// Called on completed valid frames as they come in from parse_frame(), on the ingest thread
+// Link control is handled here, anything that writes out goes to the sink thread
+// f->buf is only valid until this function returns
+static void handle_frame(mel_ctx_t *m, serial_frame_t *f) {
+	mel_status_t *status = &m->status;
+	metrics_t *mt = &m->metrics;
+	uint64_t est_us = 0;
+	metrics_add(&mt->frames[metrics_type(f->type)], 1);
+	metrics_add(&mt->bytes[metrics_type(f->type)], f->sz);
+	if (f->time_us && !(f->flag & CRC_ERROR)) { // Every stamped frame, link control included, is a clock sample
+		clock_est_add(&m->clock, f->time_us, m->rx_stamp.mono_us);
+		est_us = clock_est_map(&m->clock, f->time_us) + (m->rx_stamp.real_us - m->rx_stamp.mono_us);
+		metrics_observe(&mt->link_delay, m->rx_stamp.real_us > est_us ? m->rx_stamp.real_us - est_us : 0);
+	}
+	if (!(f->flag & CRC_ERROR)) atomic_store_explicit(&mt->last_frame_us, m->rx_stamp.real_us, memory_order_relaxed);
+	if (status->link_framing == SF_FRAMING_COBS && !(f->flag & (CRC_ERROR | COBS_FRAMED)) && f->type != FRAME_TYPE_HELLO) {
+		// Only HELLO comes HDLC once the link is COBS. The device restarted, e.g. --boot into the application.
+		status->link_framing = SF_FRAMING_HDLC;
+		sf_decoder_set_opts(&status->decoder, SF_OPT_VIEW);
+		DEV_PRINTF(status, "Link framing: HDLC, the device restarted\r\n");
+	}
+	if ((f->flag & STREAMED) && f->type != FRAME_TYPE_BIN_AUDIO) {
+		metrics_add(&mt->oversize, 1);
+		DEV_PRINTF(status, "Dropped oversize frame type %u (%u bytes)\r\n", f->type, f->sz);
+		return;
+	}
 	switch(f->type) {
-		case FRAME_TYPE_DEBUG_STRING_BMS: debug_bms_frame_handler(f, status); break;
-		case FRAME_TYPE_DEBUG_STRING: debug_frame_handler(f, status); break;
-		case FRAME_TYPE_DATA_STRING: data_string_frame_handler(f, status); break;
-		case FRAME_TYPE_BIN_AUDIO: audio_frame_handler(f, status); break;
-		//case FRAME_TYPE_HELLO: fprintf(stderr,"Got Hello\r\n"); break;
-		case FRAME_TYPE_ACK:  got_ack  = 1; break;
-		case FRAME_TYPE_NACK: got_nack = 1; break;
-		default: MY_PRINTF("ERROR: Unknown frame type %u\r\n", f->type);
+		case FRAME_TYPE_DEBUG_STRING_BMS:
+		case FRAME_TYPE_DEBUG_STRING:
+		case FRAME_TYPE_DATA_STRING:
+			if (f->flag & CRC_ERROR) { // Text and config, nothing is better than a damaged copy. Counted in crc_errors.
+				DEV_PRINTF(status, "Dropped frame type %u (%u bytes), failed its CRC\r\n", f->type, f->sz);
+				break;
+			}
+			// Fall through
+		case FRAME_TYPE_BIN_AUDIO: // Kept when damaged, the sidecar marks it (audio_frame_handler())
+			if (f->flag & STREAMED) { // Pieces already queued by stream_to_sink(), only the time stamp is left
+				sink_push(m, MEL_REC_END, f->type, f->dest, f->sz, f, est_us, NULL, 0);
+				break;
+			}
+			sink_push(m, MEL_REC_FRAME, f->type, f->dest, 0, f, est_us, f->buf, f->sz);
+			break;
+		case FRAME_TYPE_HELLO:
+			if (!(f->flag & CRC_ERROR)) hello_frame_handler(f, status); // A damaged pick would split the framings
+			break;
+		case FRAME_TYPE_ACK:
+		case FRAME_TYPE_NACK:
+			if (f->flag & CRC_ERROR) break; // Not even the type is sure, lost. Resends and timeouts recover.
+			if (f->sz > 0 && f->buf != NULL) { // Windowed programming and hello say more
+				m->ack_len = f->sz < sizeof(m->ack_payload) ? f->sz : sizeof(m->ack_payload);
+				memcpy(m->ack_payload, f->buf, m->ack_len);
+			}
+			if (f->type == FRAME_TYPE_ACK) status->got_ack = 1;
+			else status->got_nack = 1;
+			break;
+		default: DEV_PRINTF(status, "ERROR: Unknown frame type %u\r\n", f->type);
 	}
 	status->frame_count++;
 }
 
+// --binary: the record as is to the files that take its type, instead of the text the handlers write
+static void rec_file_write(mel_status_t *status, const mel_rec_t *rec) {
+	FILE *out[2] = { NULL, NULL };
+	if (rec->type == FRAME_TYPE_DATA_STRING) out[0] = status->data_file;
+	if (rec->type == FRAME_TYPE_DATA_STRING || rec->type == FRAME_TYPE_DEBUG_STRING) out[1] = status->data_and_debug_file;
+	for (unsigned i=0; i<2; i++) {
+		if (out[i] == NULL) continue;
+		if (fwrite(rec, 1, sizeof(*rec) + rec->len, out[i]) != sizeof(*rec) + rec->len) perror("Record fwrite() Error: ");
+		#ifdef ALWAYS_FLUSH_FILE
+		fflush(out[i]);
+		#endif
+	}
+}
+
+// Sink thread side of handle_frame()
+static void sink_frame(mel_status_t *status, mel_rec_t *rec) {
+	serial_frame_t f = {0};
+	f.buf = (uint8_t *)(rec + 1);
+	f.sz = rec->len;
+	f.type = rec->type;
+	f.flag = rec->flags;
+	f.time_us = rec->dev_us;
+	rec->seq = status->rec_seq++;
+
+	// Before the handlers, the debug one trims the newline in place
+	if (status->udp != NULL) {
+		if (binary_flag) udp_out_queue(status->udp, f.type, (uint8_t *)rec, sizeof(*rec), f.buf, f.sz);
+		else if (rec->kind != MEL_REC_END) udp_out_queue(status->udp, f.type, NULL, 0, f.buf, f.sz);
+	}
+	if (status->shm != NULL) shm_out_write(status->shm, rec, f.buf);
+	if (binary_flag) rec_file_write(status, rec);
+	if (rec->kind == MEL_REC_PIECE) {
+		audio_stream_handler(status, 0, rec->type, rec->offset, f.buf, f.sz);
+		return;
+	}
+	status->dev_us = rec->dev_us;
+	status->host_us = rec->host_us;
+	status->delta_us = (int64_t)(status->host_us - status->dev_us);
+	status->est_us = rec->est_us;
+	switch(f.type) {
+		case FRAME_TYPE_DEBUG_STRING_BMS: debug_bms_frame_handler(&f, status); break;
+		case FRAME_TYPE_DEBUG_STRING: debug_frame_handler(&f, status); break;
+		case FRAME_TYPE_DATA_STRING: data_string_frame_handler(&f, status); break;
+		case FRAME_TYPE_BIN_AUDIO: audio_frame_handler(&f, status); break;
+	}
+}
+
 // static void error_frame(serial_frame_t *f, mel_status_t *status) {
 	// fprintf(stderr, "Error %u\r\n", f->err);
 // }
 
+// Device time, host arrival time, their difference and the estimated send time (all us) of the current frame
+static void print_timestamp(FILE *out, mel_status_t *status) {
+	fprintf(out, "%" PRIu64 " %" PRIu64 " %+" PRId64 " %" PRIu64 ": ", status->dev_us, status->host_us, status->delta_us, status->est_us);
+}
+
+// Which device a console line came from, only once there is more than one
+static void print_tag(FILE *out, mel_status_t *status) {
+	if (multi_dev_flag) fprintf(out, "[%s] ", status->name);
+}
+
+static const char *framing_name(uint32_t framing) {
+	return framing == SF_FRAMING_COBS ? "COBS" : "HDLC";
+}
+
+// Encodes in whatever framing this device's H7 link settled on
+static int link_encode(mel_ctx_t *m, const uint8_t *in, uint32_t len_in, uint8_t dest, uint32_t pkt_type) {
+	sf_iovec_t iov = { in, len_in };
+	return sf_encodev_framing(m->status.link_framing, &iov, 1, BUF_SZ, m->enc_buf, dest, pkt_type, NULL);
+}
+
+// Our HELLO to the H7 picks the framing for this link. The H7 also passes on
+// the BMS's reply to a --bms-send-hello, which is about the H7 <-> BMS link.
+static void hello_frame_handler(serial_frame_t *f, mel_status_t *status) {
+	uint32_t framing = sf_hello_select(f->buf, f->sz);
+	if (!status->hello_pending) {
+		DEV_PRINTF(status, "BMS link framing: %s\r\n", framing_name(framing));
+		return;
+	}
+	status->hello_pending = 0;
+	status->link_framing = framing;
+	sf_decoder_set_opts(&status->decoder, SF_OPT_VIEW | (framing == SF_FRAMING_COBS ? SF_OPT_COBS : 0));
+	DEV_PRINTF(status, "Link framing: %s\r\n", framing_name(framing));
+}
+
 // Data length does not include terminating null and we don't want it
-static void send_data_frame(char *data, unsigned sz, uint8_t *buf, unsigned scratch_buf_sz, int fd) {
-	int ret = serial_frame_encode((uint8_t *)data, sz, scratch_buf_sz, buf, DEST_H7, FRAME_TYPE_DATA_STRING);
+static void send_data_frame(mel_ctx_t *m, const char *data, unsigned sz) {
+	int ret = link_encode(m, (const uint8_t *)data, sz, DEST_H7, FRAME_TYPE_DATA_STRING);
 	if (ret < 0) { fprintf(stderr, "ENCODE ERROR\r\n"); return; }
-	my_write_buf(fd, buf, ret);
+	link_send(m, m->enc_buf, ret);
 }
 
 static void debug_bms_frame_handler(serial_frame_t *f, mel_status_t *status) {
+	flockfile(stdout);
+	print_tag(stdout, status);
 	fwrite(f->buf, 1, f->sz, stdout);
+	funlockfile(stdout);
 	status->debug_bytes_written += f->sz;
 }
 
 // Debug strings are always printed to console and optionally to file
 static void debug_frame_handler(serial_frame_t *f, mel_status_t *status) {
-	if (print_timestamps_flag) fprintf(stdout, "%lu: ", (unsigned long)time(NULL));
 	filter_last_newline(f->buf, f->sz); // Only applies to Linux environments, otherwise nop
+	flockfile(stdout); // Other devices print too, keep the line whole
+	print_tag(stdout, status);
+	if (print_timestamps_flag) print_timestamp(stdout, status);
 	fwrite(f->buf, 1, f->sz, stdout);
+	funlockfile(stdout);
 
-	if (status->data_and_debug_file != NULL) {
+	if (status->data_and_debug_file != NULL && !binary_flag) {
 		FILE *file_out = status->data_and_debug_file;
-		if (print_timestamps_flag) fprintf(file_out, "%lu: ", (unsigned long)time(NULL));
+		if (print_timestamps_flag) print_timestamp(file_out, status);
 		fwrite(f->buf, 1, f->sz, file_out);
 		#ifdef ALWAYS_FLUSH_FILE
 		fflush(file_out);
@@ -292,70 +750,619 @@ static void debug_frame_handler(serial_frame_t *f, mel_status_t *status) {
 
 static void data_string_frame_handler(serial_frame_t *f, mel_status_t *status) {
 	if (print_data_stdout_flag) {
-		if (print_timestamps_flag) fprintf(stdout, "%lu: ", (unsigned long)time(NULL));
+		flockfile(stdout);
+		print_tag(stdout, status);
+		if (print_timestamps_flag) print_timestamp(stdout, status);
 		fwrite(f->buf, 1, f->sz, stdout);
+		funlockfile(stdout);
 	}
 
-	if (status->tx_socket_fd > 0) {
-		my_socket_send(status->tx_socket_fd, MASTER_MEL_DEFAULT_UDP_SEND_PORT, f->buf, f->sz);
-	}
-
-	if (status->data_and_debug_file != NULL) {
+	if (status->data_and_debug_file != NULL && !binary_flag) {
 		FILE *file_out = status->data_and_debug_file;
-		if (print_timestamps_flag) fprintf(file_out, "%lu: ", (unsigned long)time(NULL));
+		if (print_timestamps_flag) print_timestamp(file_out, status);
 		fwrite(f->buf, 1, f->sz, file_out);
 		#ifdef ALWAYS_FLUSH_FILE
 		fflush(file_out);
 		#endif
 	}
 
-	if (status->data_file != NULL) { fwrite(f->buf, 1, f->sz, status->data_file); }
+	if (status->data_file != NULL && !binary_flag) { fwrite(f->buf, 1, f->sz, status->data_file); }
 	status->data_bytes_written += f->sz;
 }
 
 static void audio_frame_handler(serial_frame_t *f, mel_status_t *status) {
 	uint32_t ret;
+	bool bad = f->flag & CRC_ERROR;
 	//MY_PRINTF("%s()\r\n", __func__);
-	if (status->audio_file == NULL) return;
-	ret = fwrite(f->buf, 1, f->sz, status->audio_file);
-	if (ret != f->sz) { // Error
-		perror("Audio File fwrite() Error: ");
+	if (bad) { // Written all the same so the file keeps its length, the sidecar says where
+		status->audio_crc_errors++;
+		DEV_PRINTF(status, "Audio frame failed its CRC, written and marked in the sidecar\r\n");
+	}
+	if (f->flag & STREAMED) { // Already written by audio_stream_handler(), now we know when it was sent
+		if (status->audio_wav != NULL) { // A bad CRC leaves the time stamp in doubt too
+			if (bad) audio_sink_stamp(status->audio_wav, 0, 0, 0, true);
+			else audio_sink_stamp(status->audio_wav, status->dev_us, status->host_us, status->est_us, false);
+		}
 		return;
 	}
+	if (status->audio_file == NULL && status->audio_wav == NULL) return;
+	if (status->audio_wav != NULL && bad) {
+		audio_sink_write(status->audio_wav, f->buf, f->sz, 0, 0, 0, 0);
+		audio_sink_stamp(status->audio_wav, 0, 0, 0, true);
+	}
+	else if (status->audio_wav != NULL) audio_sink_write(status->audio_wav, f->buf, f->sz, 0, status->dev_us, status->host_us, status->est_us);
+	if (status->audio_file != NULL) {
+		ret = fwrite(f->buf, 1, f->sz, status->audio_file);
+		if (ret != f->sz) { // Error
+			perror("Audio File fwrite() Error: ");
+			return;
+		}
+	}
 	status->audio_bytes_written += f->sz;
 }
 
-static void send_cmd_boot(int fd, uint8_t *buf) {
+// Oversize frames arrive here in pieces as they are decoded, passed on by sink_frame()
+// Only audio is worth streaming, anything else that big is dropped (see handle_frame())
+static void audio_stream_handler(void *ctx, uint8_t dest, uint32_t type, uint32_t offset, const uint8_t *buf, uint32_t len) {
+	mel_status_t *status = (mel_status_t *)ctx;
+	if (type != FRAME_TYPE_BIN_AUDIO || (status->audio_file == NULL && status->audio_wav == NULL)) return;
+	if (status->audio_wav != NULL) audio_sink_write(status->audio_wav, buf, len, offset, 0, 0, 0); // Time comes with the last piece
+	if (status->audio_file != NULL && fwrite(buf, 1, len, status->audio_file) != len) {
+		perror("Audio File fwrite() Error: ");
+		return;
+	}
+	status->audio_bytes_written += len;
+}
+
+// Decoder stream callback on the ingest thread, queues the piece for audio_stream_handler()
+static void stream_to_sink(void *ctx, uint8_t dest, uint32_t type, uint32_t offset, const uint8_t *buf, uint32_t len) {
+	mel_ctx_t *m = (mel_ctx_t *)ctx;
+	mel_status_t *status = &m->status;
+	if (type != FRAME_TYPE_BIN_AUDIO || (status->audio_file == NULL && status->audio_wav == NULL && status->udp == NULL && status->shm == NULL)) return;
+	sink_push(m, MEL_REC_PIECE, type, dest, offset, NULL, 0, buf, len);
+}
+
+static void send_boot_pkt(mel_ctx_t *m, boot_cmd_packet_t *pkt) {
+	int ret = link_encode(m, (uint8_t *)pkt, sizeof(*pkt), DEST_H7, FRAME_TYPE_BOOTLOADER_BIN);
+	if (ret < 0) { fprintf(stderr, "ENCODE ERROR\r\n"); return; }
+	link_send(m, m->enc_buf, ret);
+}
+
+static void send_cmd_boot(mel_ctx_t *m) {
 	boot_cmd_packet_t pkt = {0};
 	pkt.cmd = boot_cmd_boot;
-	uint8_t *data = (uint8_t *)&pkt;
+	send_boot_pkt(m, &pkt);
+}
 
-	int ret = serial_frame_encode(data, sizeof(pkt), BUF_SZ, buf, DEST_H7, FRAME_TYPE_BOOTLOADER_BIN);
+// Sends frame seq of the image
+static void prog_send(mel_ctx_t *m, uint32_t seq) {
+	const prog_frame_t *fr = &m->prog.frames[seq];
+	uint32_t len = fr->len;
+	bool last = seq + 1 == m->prog.count;
+	bool lz = m->prog.lz && !m->prog.legacy && fr->zlen;
+	boot_cmd_packet_t pkt = {0};
+	sf_iovec_t iov[2] = { { &pkt, sizeof(pkt) }, { &m->prog.image[fr->off], len } }; // Header then data, no staging copy
+	int ret;
+
+	if (lz) {
+		iov[1].buf = &m->prog.z[fr->zoff];
+		iov[1].len = len = fr->zlen;
+	}
+	pkt.arg0 = m->prog.addr + fr->off;
+	if (m->prog.legacy) {
+		pkt.cmd = boot_cmd_program;
+		pkt.arg1 = last; // Indicate last frame of operation
+	}
+	else {
+		pkt.cmd = lz ? boot_cmd_program_lz : boot_cmd_program_win;
+		pkt.arg1 = (last ? BOOT_PROG_LAST : 0) | BOOT_PROG_SESSION(m->prog.session);
+		pkt.arg2 = seq;
+	}
+	ret = link_sendv(m, iov, 2, sizeof(pkt) + len, m->prog.dest, FRAME_TYPE_BOOTLOADER_BIN);
 	if (ret < 0) { fprintf(stderr, "ENCODE ERROR\r\n"); return; }
+	m->prog.sent_us[seq % PROG_SLOTS] = seq < m->prog.sent ? 0 : serial_frame_now_us();
+}
 
-	ret = write(fd, buf, ret);
-	if (ret <= 0) {
-		perror("Serial device write error");
+// Tops the window up
+static void prog_fill(mel_ctx_t *m) {
+	while (m->prog.sent < m->prog.count && m->prog.sent < m->prog.next + m->prog.window) {
+		prog_send(m, m->prog.sent);
+		m->prog.sent++;
+	}
+}
+
+// The F1 doesn't know boot_cmd_program_lz, resend what isn't acknowledged uncompressed.
+// Frames it already has are only acknowledged again.
+static void prog_no_lz(mel_ctx_t *m) {
+	DEV_PRINTF(&m->status, "Bootloader has no compressed programming, sending frames as they are\r\n");
+	m->prog.lz = false;
+	m->prog.zbytes = m->prog.bytes;
+	m->prog.sent = m->prog.next;
+	prog_fill(m);
+}
+
+// Bootloader doesn't know boot_cmd_program_win, nothing was written, start over one frame at a time
+static void prog_fallback(mel_ctx_t *m) {
+	DEV_PRINTF(&m->status, "Bootloader has no windowed programming, one frame at a time\r\n");
+	m->prog.legacy = true;
+	m->prog.window = 1;
+	m->prog.zbytes = m->prog.bytes;
+	m->prog.next = m->prog.sent = 0;
+	m->prog.progress_us = serial_frame_now_us();
+	prog_fill(m);
+}
+
+// Everything a program command allocates, also for dev_close() when a run is cut short
+static void prog_free(mel_ctx_t *m) {
+	free(m->prog.image);
+	free(m->prog.frames);
+	free(m->prog.digest);
+	free(m->prog.ranges);
+	free(m->prog.z);
+	m->prog.image = NULL;
+	m->prog.frames = NULL;
+	m->prog.digest = NULL;
+	m->prog.ranges = NULL;
+	m->prog.z = NULL;
+}
+
+static void prog_end(mel_ctx_t *m) {
+	ev_timer_cancel(&m->loop, m->prog.timer);
+	m->prog.timer = -1;
+	if (m->prog.failed) m->failed = true; // prog is cleared for the next image, the device keeps it
+	prog_free(m);
+}
+
+// Where programming stands, for errors
+static uint32_t prog_addr_at(mel_ctx_t *m, uint32_t seq) {
+	return m->prog.addr + (seq < m->prog.count ? m->prog.frames[seq].off : m->prog.size);
+}
+
+static void on_prog_timeout(void *ctx, uint32_t events) {
+	mel_ctx_t *m = (mel_ctx_t *)ctx;
+	uint64_t now = serial_frame_now_us();
+	uint64_t idle = now - m->prog.progress_us;
+
+	// Older H7 bootloaders ignore commands they don't know. One that listed the windowed one in its hello only lost ACKs, resend.
+	if (m->prog.dest == DEST_H7 && !m->prog.legacy && !m->prog.acked && !(m->boot_cmds & boot_cmd_program_win) && idle >= m->prog.timeout_ms * 1000ull) {
+		prog_fallback(m);
 		return;
 	}
+	if (idle >= (uint64_t)m->prog.timeout_ms * 1000 * PROG_RETRIES) {
+		DEV_PRINTF(&m->status, "Programming FAILED, no answer at 0x%08" PRIx32 "\r\n", prog_addr_at(m, m->prog.next));
+		m->prog.failed = true;
+		cmd_advance(m);
+		return;
+	}
+	if (m->prog.legacy) return; // Old firmware never answers late, a resend could program twice. Only give up.
+	if (now - (m->prog.resend_us > m->prog.progress_us ? m->prog.resend_us : m->prog.progress_us) < m->prog.rto_us) return;
+	m->prog.resend_us = now;
+	m->prog.rto_us = m->prog.rto_us * 2 < m->prog.timeout_ms * 1000 ? m->prog.rto_us * 2 : m->prog.timeout_ms * 1000; // Back off until it moves again
+	for (uint32_t seq = m->prog.next; seq < m->prog.sent; seq++) { // Whatever the last ACK didn't cover
+		uint32_t d = seq - m->prog.next;
+		if (d > 0 && d <= 32 && (m->prog.sack & (1u << (d - 1)))) continue;
+		prog_send(m, seq);
+		m->prog.resent++;
+	}
 }
 
-static void send_cmd_prog(int fd, uint8_t *buf, FILE *bin, uint32_t addr, uint8_t dest, mel_status_t *status) {
-	const int offset = sizeof(boot_cmd_packet_t);
-	static uint8_t file_buf[PROGRAM_CHUNK_SIZE+sizeof(boot_cmd_packet_t)];
-	serial_frame_t f;
-	size_t fread_ret;
-	int ret;
+// Round trip of a frame sent once, srtt and rttvar as in TCP (RFC 6298)
+static void prog_rtt(mel_ctx_t *m, uint32_t seq) {
+	uint64_t sent = m->prog.sent_us[seq % PROG_SLOTS];
+	uint32_t r, err, rto;
+	if (sent == 0) return;
+	m->prog.sent_us[seq % PROG_SLOTS] = 0; // Once, later ACKs still cover it
+	r = serial_frame_now_us() - sent;
+	if (m->prog.srtt_us == 0) {
+		m->prog.srtt_us = r;
+		m->prog.rttvar_us = r / 2;
+	}
+	else {
+		err = r > m->prog.srtt_us ? r - m->prog.srtt_us : m->prog.srtt_us - r;
+		m->prog.rttvar_us += ((int32_t)err - (int32_t)m->prog.rttvar_us) / 4;
+		m->prog.srtt_us += ((int32_t)r - (int32_t)m->prog.srtt_us) / 8;
+	}
+	rto = m->prog.srtt_us + 4 * m->prog.rttvar_us;
+	if (rto < PROG_RTO_MIN_US) rto = PROG_RTO_MIN_US;
+	if (rto > m->prog.timeout_ms * 1000) rto = m->prog.timeout_ms * 1000;
+	m->prog.rto_us = rto;
+}
+
+// Windowed ACK: cumulative next, selective sack above it
+static void prog_acked(mel_ctx_t *m, const boot_prog_ack_t *ack) {
+	uint32_t newest = ack->sack ? ack->next + 32 - __builtin_clz(ack->sack) : ack->next - 1;
+
+	m->prog.acked = true;
+	if (ack->next > m->prog.sent) return; // Not ours
+	// Time the newest frame it covers, the one that made the bootloader answer. next - 1 may have
+	// waited behind a hole.
+	if (newest < m->prog.sent && newest + 1 >= m->prog.next) prog_rtt(m, newest);
+	if (ack->next > m->prog.next) {
+		m->prog.next = ack->next;
+		m->prog.progress_us = serial_frame_now_us();
+	}
+	m->prog.sack = ack->sack;
+	// Frames after next arrived but next didn't: resend it now rather than at the timeout
+	if (ack->sack && m->prog.next < m->prog.sent && m->prog.fast_resent != m->prog.next + 1) {
+		m->prog.fast_resent = m->prog.next + 1;
+		prog_send(m, m->prog.next);
+		m->prog.resent++;
+	}
+}
+
+// Splits [off, off + len) of the image into frames
+static bool prog_add_range(mel_ctx_t *m, uint32_t off, uint32_t len) {
+	while (len) {
+		uint32_t n = len < m->prog.chunk ? len : m->prog.chunk;
+		if (m->prog.count == m->prog.frames_cap) {
+			uint32_t cap = m->prog.frames_cap ? m->prog.frames_cap * 2 : 256;
+			prog_frame_t *p = realloc(m->prog.frames, cap * sizeof(*p));
+			if (p == NULL) {
+				perror("Program frames");
+				return false;
+			}
+			m->prog.frames = p;
+			m->prog.frames_cap = cap;
+		}
+		m->prog.frames[m->prog.count++] = (prog_frame_t){ off, n, 0, 0 };
+		m->prog.bytes += n;
+		off += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool prog_erased(const uint8_t *p, uint32_t n) {
+	while (n--) if (*p++ != 0xFF) return false;
+	return true;
+}
+
+// Frames for what the file has in [lo, hi), flash addresses. Erased flash already reads 0xFF,
+// runs of PROG_SKIP_MIN of it aren't sent.
+static bool prog_add_ranges(mel_ctx_t *m, uint32_t lo, uint32_t hi) {
+	const uint32_t word = m->prog.word;
+
+	for (unsigned i = 0; i < m->prog.range_count; i++) {
+		const fw_range_t *r = &m->prog.ranges[i];
+		uint32_t a = r->addr > lo ? r->addr : lo;
+		uint32_t e = r->addr + r->len < hi ? r->addr + r->len : hi;
+		size_t bytes = m->prog.bytes;
+		uint32_t off, start, end, gap;
+
+		if (a >= e) continue;
+		off = a - m->prog.addr;
+		e -= m->prog.addr;
+		while (off < e) {
+			while (off < e && prog_erased(&m->prog.image[off], word)) off += word;
+			if (off == e) break;
+			start = end = off;
+			for (gap = 0; off < e && gap < PROG_SKIP_MIN; off += word) {
+				if (prog_erased(&m->prog.image[off], word)) gap += word;
+				else {
+					gap = 0;
+					end = off + word;
+				}
+			}
+			if (!prog_add_range(m, start, end - start)) return false;
+		}
+		m->prog.skipped += (e - (a - m->prog.addr)) - (m->prog.bytes - bytes);
+	}
+	return true;
+}
+
+// Compresses each frame on its own, they may be programmed in any order. Frames that don't
+// shrink stay as they are. Returns false if that's all of them.
+static bool prog_compress(mel_ctx_t *m) {
+	size_t used = 0;
+	m->prog.z = malloc(m->prog.bytes);
+	if (m->prog.z == NULL) return false;
+	for (uint32_t i = 0; i < m->prog.count; i++) {
+		prog_frame_t *fr = &m->prog.frames[i];
+		int32_t n = blz_compress(&m->prog.image[fr->off], fr->len, &m->prog.z[used], fr->len - 1);
+		if (n <= 0) continue;
+		fr->zoff = used;
+		fr->zlen = n;
+		used += n;
+		m->prog.zbytes -= fr->len - n;
+	}
+	return m->prog.zbytes < m->prog.bytes;
+}
+
+// Frames are laid out, start sending them
+static void prog_send_start(mel_ctx_t *m) {
+	m->prog.phase = PROG_SEND;
+	m->prog.window = (m->prog.dest == DEST_BMS) ? PROG_WINDOW_BMS : m->program_window;
+	if (m->prog.window > 1 && m->prog.window * m->prog.chunk > PROG_INFLIGHT_MAX)
+		m->prog.window = PROG_INFLIGHT_MAX / m->prog.chunk > 1 ? PROG_INFLIGHT_MAX / m->prog.chunk : 2;
+	if (m->prog.dest == DEST_H7 && m->boot_cmds && !(m->boot_cmds & boot_cmd_program_win)) { // Said so in its hello, no need to find out
+		m->prog.legacy = true;
+		m->prog.window = 1;
+	}
+	m->prog.zbytes = m->prog.bytes;
+	if (!no_compress_flag && !m->prog.legacy && (m->prog.dest == DEST_BMS || (m->boot_cmds & boot_cmd_program_lz))) // The F1 can't say, try it
+		m->prog.lz = prog_compress(m);
+	m->prog.timeout_ms = (m->prog.dest == DEST_BMS) ? PROG_TIMEOUT_BMS_MS : PROG_TIMEOUT_MS;
+	m->prog.session = (uint16_t)(getpid() ^ serial_frame_now_us()) | 1; // Never 0, a fresh bootloader's
+	m->prog.start_us = m->prog.progress_us = serial_frame_now_us();
+	m->prog.rto_us = m->prog.timeout_ms * 1000; // Until there is a round trip
+	ev_timer_cancel(&m->loop, m->prog.timer); // --delta's erase wait
+	m->prog.timer = ev_timer(&m->loop, PROG_TICK_MS, true, on_prog_timeout, m);
+	if (m->prog.chunk != PROGRAM_CHUNK_SIZE)
+		DEV_PRINTF(&m->status, "Programming %zu bytes in %" PRIu32 " frames of %" PRIu32 "\r\n", m->prog.bytes, m->prog.count, m->prog.chunk);
+	if (m->prog.skipped)
+		DEV_PRINTF(&m->status, "Skipping %zu bytes that are already erased (0xFF)\r\n", m->prog.skipped);
+	if (m->prog.lz)
+		DEV_PRINTF(&m->status, "Compressed to %zu bytes, %.0f%%\r\n", m->prog.zbytes, 100.0 * m->prog.zbytes / m->prog.bytes);
+	prog_fill(m);
+}
+
+static int prog_sector(mel_ctx_t *m, uint32_t off) {
+	return (m->prog.addr + off - H7_FLASH_START) / H7_SECTOR_SIZE;
+}
+
+// Bytes of [lo, hi) the file has, flash addresses
+static uint32_t prog_covered(mel_ctx_t *m, uint32_t lo, uint32_t hi) {
+	uint32_t n = 0;
+	for (unsigned i = 0; i < m->prog.range_count; i++) {
+		const fw_range_t *r = &m->prog.ranges[i];
+		uint32_t a = r->addr > lo ? r->addr : lo;
+		uint32_t e = r->addr + r->len < hi ? r->addr + r->len : hi;
+		if (a < e) n += e - a;
+	}
+	return n;
+}
+
+// --delta: digest block i has something from the file, the others are left alone
+static bool prog_block_used(mel_ctx_t *m, uint32_t i) {
+	uint32_t lo = m->prog.addr + i * PROG_DIGEST_BLOCK;
+	return prog_covered(m, lo, lo + PROG_DIGEST_BLOCK) != 0;
+}
+
+static bool prog_digest_request(mel_ctx_t *m);
+static void prog_erase_send(mel_ctx_t *m);
+static bool prog_verify_request(mel_ctx_t *m);
+
+static const char *const prog_phase_name[] = { [PROG_SEND] = "Programming", [PROG_DIGEST] = "Digest", [PROG_ERASE] = "Erase", [PROG_VERIFY] = "Verify" };
+
+// Digest, erase or verify: nothing back, the request or its answer was lost. Asking again gets the same answer.
+static void on_query_timeout(void *ctx, uint32_t events) {
+	mel_ctx_t *m = (mel_ctx_t *)ctx;
+
+	m->prog.timer = -1; // One-shot, already gone
+	if (++m->prog.tries > PROG_RETRIES) {
+		DEV_PRINTF(&m->status, "%s FAILED, no answer\r\n", prog_phase_name[m->prog.phase]);
+		m->prog.failed = true;
+		cmd_advance(m);
+		return;
+	}
+	if (m->prog.phase == PROG_DIGEST) prog_digest_request(m);
+	else if (m->prog.phase == PROG_ERASE) prog_erase_send(m);
+	else prog_verify_request(m);
+}
+
+// (Re)starts the wait for a digest, erase or verify answer
+static void prog_query_timer(mel_ctx_t *m, unsigned ms) {
+	ev_timer_cancel(&m->loop, m->prog.timer);
+	m->prog.timer = ev_timer(&m->loop, ms, false, on_query_timeout, m);
+}
+
+// --delta: erases erase_first to erase_sector - 1
+static void prog_erase_send(mel_ctx_t *m) {
 	boot_cmd_packet_t pkt = {0};
-	pkt.cmd = boot_cmd_program;
-	uint8_t *data = (uint8_t *)&pkt;
-	pkt.arg0 = addr;
+	pkt.cmd = boot_cmd_erase;
+	pkt.arg0 = m->prog.erase_first;
+	pkt.arg1 = m->prog.erase_sector - 1;
+	prog_query_timer(m, (m->prog.erase_sector - m->prog.erase_first) * ERASE_SECTOR_MS);
+	send_boot_pkt(m, &pkt);
+}
 
-	int pad_size;
-	if (dest == DEST_H7)
-		pad_size = 32;
-	else if (dest == DEST_BMS)
-		pad_size = 8;
+// Asks the H7 for the CRC of the next range of the file. Returns false if there are no more.
+static bool prog_verify_request(mel_ctx_t *m) {
+	boot_cmd_packet_t pkt = {0};
+
+	if (m->prog.verify_got == m->prog.range_count) return false;
+	pkt.cmd = boot_cmd_verify;
+	pkt.arg0 = m->prog.ranges[m->prog.verify_got].addr;
+	pkt.arg1 = m->prog.ranges[m->prog.verify_got].len;
+	m->prog.phase = PROG_VERIFY;
+	prog_query_timer(m, PROG_TIMEOUT_MS);
+	send_boot_pkt(m, &pkt);
+	return true;
+}
+
+// Once programmed, checks every range of the file, not just what was sent: erased runs
+// that were skipped and --delta's untouched sectors have to match too.
+// Returns true if programming is over.
+static bool prog_verify_start(mel_ctx_t *m) {
+	if (m->prog.dest != DEST_H7 || no_verify_flag) return true;
+	if (!(m->boot_cmds & boot_cmd_verify)) {
+		DEV_PRINTF(&m->status, "Bootloader can't verify, not checked\r\n");
+		return true;
+	}
+	m->prog.verify_us = serial_frame_now_us();
+	return !prog_verify_request(m);
+}
+
+// A range's CRC came in, compare it with the image and ask for the next.
+// Returns true if programming is over.
+static bool prog_verified(mel_ctx_t *m) {
+	const fw_range_t *r = &m->prog.ranges[m->prog.verify_got];
+	boot_verify_t v;
+	size_t bytes = 0;
+
+	if (m->ack_len == sizeof(boot_prog_ack_t)) return false; // A late one for a resent frame, keep waiting
+	if (m->ack_len >= sizeof(v)) memcpy(&v, m->ack_payload, sizeof(v));
+	if (m->ack_len >= sizeof(v) && v.addr != r->addr) return false; // Second answer to a resent request
+	if (m->ack_len < sizeof(v) || v.len != r->len) {
+		DEV_PRINTF(&m->status, "Verify FAILED, unexpected reply\r\n");
+		m->prog.failed = true;
+		prog_end(m);
+		return true;
+	}
+	if (v.crc != sf_crc32(0, &m->prog.image[r->addr - m->prog.addr], r->len)) {
+		DEV_PRINTF(&m->status, "Verify FAILED, flash differs from the image in 0x%08" PRIx32 " - 0x%08" PRIx32 "\r\n", r->addr, r->addr + r->len);
+		m->prog.failed = true;
+		prog_end(m);
+		return true;
+	}
+	m->prog.verify_got++;
+	m->prog.tries = 0;
+	if (prog_verify_request(m)) return false;
+
+	for (unsigned i = 0; i < m->prog.range_count; i++) bytes += m->prog.ranges[i].len;
+	DEV_PRINTF(&m->status, "Verified %zu bytes in %u range%s, %.0f ms\r\n", bytes, m->prog.range_count,
+		m->prog.range_count == 1 ? "" : "s", (serial_frame_now_us() - m->prog.verify_us) / 1e3);
+	prog_end(m);
+	return true;
+}
+
+// --delta: erases the next run of dirty sectors, or once they all are, programs them.
+// Returns true if programming is over (failed).
+static bool prog_erase_next(mel_ctx_t *m) {
+	int start = m->prog.erase_sector, end;
+
+	while (start <= LAST_SECTOR && !(m->prog.dirty & (1u << start))) start++;
+	if (start <= LAST_SECTOR) {
+		for (end = start; end < LAST_SECTOR && (m->prog.dirty & (1u << (end + 1))); end++);
+		m->prog.phase = PROG_ERASE;
+		m->prog.erase_first = start;
+		m->prog.erase_sector = end + 1;
+		prog_erase_send(m);
+		return false;
+	}
+
+	// All erased, program the image where it meets them
+	for (int s = FIRST_SECTOR; s <= LAST_SECTOR; s++) {
+		uint32_t lo = H7_FLASH_START + s * H7_SECTOR_SIZE;
+		if ((m->prog.dirty & (1u << s)) && !prog_add_ranges(m, lo, lo + H7_SECTOR_SIZE)) {
+			m->prog.failed = true;
+			prog_end(m);
+			return true;
+		}
+	}
+	if (m->prog.count == 0) {
+		DEV_PRINTF(&m->status, "Erased, the image is all 0xFF there, nothing to program\r\n");
+		if (!prog_verify_start(m)) return false;
+		prog_end(m);
+		return true;
+	}
+	prog_send_start(m);
+	return false;
+}
+
+// --delta: the next run of used blocks, BOOT_DIGEST_MAX at most. Returns false if there are no more.
+static bool prog_digest_request(mel_ctx_t *m) {
+	boot_cmd_packet_t pkt = {0};
+	uint32_t first, off, n = 0;
+
+	while (m->prog.digest_got < m->prog.digest_count && !prog_block_used(m, m->prog.digest_got)) m->prog.digest_got++;
+	first = m->prog.digest_got;
+	while (first + n < m->prog.digest_count && n < BOOT_DIGEST_MAX && prog_block_used(m, first + n)) n++;
+	if (n == 0) return false;
+	off = first * PROG_DIGEST_BLOCK;
+	pkt.cmd = boot_cmd_digest;
+	pkt.arg0 = m->prog.addr + off;
+	pkt.arg1 = m->prog.size - off < n * PROG_DIGEST_BLOCK ? m->prog.size - off : n * PROG_DIGEST_BLOCK;
+	pkt.arg2 = PROG_DIGEST_BLOCK;
+	m->prog.digest_req = n;
+	m->prog.phase = PROG_DIGEST;
+	prog_query_timer(m, PROG_TIMEOUT_MS);
+	send_boot_pkt(m, &pkt);
+	return true;
+}
+
+static bool prog_delta_start(mel_ctx_t *m) {
+	if (m->prog.addr < H7_FLASH_START || m->prog.size > H7_FLASH_SIZE || m->prog.addr - H7_FLASH_START > H7_FLASH_SIZE - m->prog.size) {
+		DEV_PRINTF(&m->status, "Abort: --delta needs the image inside the H7 flash\r\n");
+		m->prog.failed = true;
+		prog_end(m);
+		return false;
+	}
+	if (!(m->boot_cmds & boot_cmd_digest)) { // Can't tell what changed
+		DEV_PRINTF(&m->status, "Bootloader has no digests, erasing and programming every sector the image touches\r\n");
+		for (int s = prog_sector(m, 0); s <= prog_sector(m, m->prog.size - 1); s++) {
+			uint32_t lo = H7_FLASH_START + s * H7_SECTOR_SIZE;
+			if (prog_covered(m, lo, lo + H7_SECTOR_SIZE)) m->prog.dirty |= 1u << s;
+		}
+		if ((m->prog.dirty & 1) && !unsafe_flag) {
+			DEV_PRINTF(&m->status, "Abort: the image covers the bootloader sector. Override with --allow-unsafe\r\n");
+			m->prog.failed = true;
+			prog_end(m);
+			return false;
+		}
+		return !prog_erase_next(m);
+	}
+	m->prog.digest_count = (m->prog.size + PROG_DIGEST_BLOCK - 1) / PROG_DIGEST_BLOCK;
+	m->prog.digest = malloc(m->prog.digest_count * sizeof(uint32_t));
+	if (m->prog.digest == NULL) {
+		perror("Digest");
+		m->prog.failed = true;
+		prog_end(m);
+		return false;
+	}
+	return prog_digest_request(m); // Always something, there are ranges
+}
+
+// --delta: digests came in, ask for more or work out which sectors to redo.
+// Returns true if programming is over.
+static bool prog_digested(mel_ctx_t *m) {
+	boot_digest_t d;
+	uint32_t want = m->prog.digest_req;
+	uint32_t differ = 0, used = 0;
+	char list[64];
+	int len = 0;
+
+	if (m->ack_len >= sizeof(d)) memcpy(&d, m->ack_payload, sizeof(d));
+	if (m->ack_len >= sizeof(d) && d.addr != m->prog.addr + m->prog.digest_got * PROG_DIGEST_BLOCK) return false; // Second answer to a resent request
+	if (m->ack_len < sizeof(d) || d.block != PROG_DIGEST_BLOCK || d.count != want || m->ack_len < sizeof(d) + want * sizeof(uint32_t)) {
+		DEV_PRINTF(&m->status, "Digest FAILED, unexpected reply\r\n");
+		m->prog.failed = true;
+		prog_end(m);
+		return true;
+	}
+	memcpy(&m->prog.digest[m->prog.digest_got], &m->ack_payload[sizeof(d)], want * sizeof(uint32_t));
+	m->prog.digest_got += want;
+	m->prog.tries = 0;
+	if (prog_digest_request(m)) return false;
+	ev_timer_cancel(&m->loop, m->prog.timer);
+	m->prog.timer = -1;
+
+	for (uint32_t i = 0; i < m->prog.digest_count; i++) {
+		uint32_t off = i * PROG_DIGEST_BLOCK;
+		uint32_t n = m->prog.size - off < PROG_DIGEST_BLOCK ? m->prog.size - off : PROG_DIGEST_BLOCK;
+		if (!prog_block_used(m, i)) continue; // Never asked for, not the file's
+		used++;
+		if (sf_crc32(0, &m->prog.image[off], n) == m->prog.digest[i]) continue;
+		differ++;
+		m->prog.dirty |= 1u << prog_sector(m, off); // A block may straddle two sectors
+		m->prog.dirty |= 1u << prog_sector(m, off + n - 1);
+	}
+	if (m->prog.dirty == 0) {
+		DEV_PRINTF(&m->status, "Flash already matches the image, nothing to program\r\n");
+		prog_end(m);
+		return true;
+	}
+	if ((m->prog.dirty & 1) && !unsafe_flag) {
+		DEV_PRINTF(&m->status, "Abort: the image differs in the bootloader sector. Override with --allow-unsafe\r\n");
+		m->prog.failed = true;
+		prog_end(m);
+		return true;
+	}
+	for (int s = FIRST_SECTOR; s <= LAST_SECTOR; s++)
+		if (m->prog.dirty & (1u << s)) len += snprintf(&list[len], sizeof(list) - len, " %d", s);
+	DEV_PRINTF(&m->status, "%" PRIu32 " of %" PRIu32 " blocks differ, redoing sectors%s\r\n", differ, used, list);
+	for (int s = FIRST_SECTOR; s <= LAST_SECTOR; s++) {
+		uint32_t lo = H7_FLASH_START + s * H7_SECTOR_SIZE;
+		if ((m->prog.dirty & (1u << s)) && prog_covered(m, lo, lo + H7_SECTOR_SIZE) < H7_SECTOR_SIZE)
+			DEV_PRINTF(&m->status, "Sector %d is only partly in the image, the rest of it is erased too\r\n", s);
+	}
+	return prog_erase_next(m);
+}
+
+// Loads the whole image so any frame can be resent. Returns false if there is nothing to send.
+static bool prog_start(mel_ctx_t *m, FILE *bin, uint32_t addr, uint8_t dest) {
+	const unsigned pad_size = (dest == DEST_BMS) ? 8 : 32;
+	fw_image_t img;
 
 	if (sizeof(boot_cmd_t) != 4) {
 		fprintf(stderr, "Warning, enum size (%zu) is unexpected and I suck, will likely fail, please fix\n", sizeof(boot_cmd_t));
@@ -367,50 +1374,119 @@ static void send_cmd_prog(int fd, uint8_t *buf, FILE *bin, uint32_t addr, uint8_
 
 	if (bin == NULL) {
 		fprintf(stderr, "ABORT: NULL programming file\r\n");
-		return;
+		m->failed = true;
+		return false;
 	}
 
-	do {
-		memset(file_buf, 0xFF, sizeof(file_buf)); // In case we have to pad
-		fread_ret = fread(&file_buf[offset], 1, PROGRAM_CHUNK_SIZE, bin); // Read file
-		if (fread_ret < PROGRAM_CHUNK_SIZE) {
-			pkt.arg1 = 1; // Indicate last frame of operation
-			int mod_check = fread_ret % pad_size;
-			if (mod_check != 0)
-				fread_ret += pad_size - mod_check; // Pad to word size (4 byte)
-		}
-		memcpy(file_buf, data, sizeof(pkt)); // Copy in cmd struct header
-
-		// Create frame from header+data
-		ret = serial_frame_encode(file_buf, sizeof(pkt)+fread_ret, BUF_SZ, buf, dest, FRAME_TYPE_BOOTLOADER_BIN);
-		if (ret < 0) { fprintf(stderr, "ENCODE ERROR\r\n"); return; }
-
-		// Write out the serial port
-		ret = write(fd, buf, ret);
-		if (ret <= 0) {
-			perror("Serial device write error");
-			caught_stop = true;
-			break;
-		}
+	memset(&m->prog, 0, sizeof(m->prog));
+	m->prog.timer = -1;
+	if (fw_image_load(&img, bin, addr, pad_size) < 0) { // Pads to the flash word with erased bytes
+		m->failed = true;
+		return false;
+	}
+	m->prog.image = img.data;
+	m->prog.size = img.size;
+	m->prog.addr = img.base;
+	m->prog.ranges = img.ranges;
+	m->prog.range_count = img.count;
+	m->prog.word = pad_size;
+	if (strcmp(img.format, "bin") != 0) {
+		DEV_PRINTF(&m->status, "Loaded %s, %u range%s:\r\n", img.format, img.count, img.count == 1 ? "" : "s");
+		for (unsigned i = 0; i < img.count; i++)
+			DEV_PRINTF(&m->status, "  0x%08" PRIx32 " - 0x%08" PRIx32 ", %" PRIu32 " bytes\r\n",
+				img.ranges[i].addr, img.ranges[i].addr + img.ranges[i].len, img.ranges[i].len);
+	}
 
-		// Wait for ACK (or something else)
-		while(!got_ack && !got_nack && !caught_stop) { get_frames(fd, buf, &f, status); }
-		if (caught_stop) break;
-		if (got_nack) { fprintf(stderr, "Programming FAILED\r\n"); break; }
-		got_ack = 0;
+	m->prog.dest = dest;
+	m->prog.chunk = (dest == DEST_BMS) ? PROGRAM_CHUNK_SIZE : m->boot_chunk;
+	m->ack_len = 0;
+	if (dest == DEST_H7 && delta_flag) return prog_delta_start(m);
+	if (!prog_add_ranges(m, m->prog.addr, m->prog.addr + m->prog.size)) {
+		m->prog.failed = true;
+		prog_end(m);
+		return false;
+	}
+	if (m->prog.count == 0) {
+		DEV_PRINTF(&m->status, "Nothing to program, the image is all 0xFF\r\n");
+		prog_end(m);
+		return false;
+	}
+	prog_send_start(m);
+	return true;
+}
 
-		// Increment address by bytes written.
-		pkt.arg0 += PROGRAM_CHUNK_SIZE;
-	} while(fread_ret == PROGRAM_CHUNK_SIZE);
-	got_ack = 0;
-	got_nack = 0;
-	return;
+// Handles whatever ACK/NACK came in and keeps the window full
+// Returns true once the image is done or programming failed
+static bool prog_advance(mel_ctx_t *m) {
+	mel_status_t *status = &m->status;
+	boot_prog_ack_t ack;
+	bool have_ack = m->ack_len >= sizeof(ack);
+
+	if (m->prog.failed) {
+		prog_end(m);
+		return true;
+	}
+	if (m->prog.phase != PROG_SEND) { // --delta and verify, one command at a time
+		bool done;
+		if (!status->got_ack && !status->got_nack) return false;
+		if (status->got_nack) {
+			DEV_PRINTF(status, "%s FAILED\r\n", prog_phase_name[m->prog.phase]);
+			m->prog.failed = true;
+			prog_end(m);
+			return true;
+		}
+		status->got_ack = 0;
+		if (m->prog.phase == PROG_ERASE && m->ack_len) { // Erase ACKs are empty, a digest answered twice
+			m->ack_len = 0;
+			return false;
+		}
+		if (m->prog.phase == PROG_ERASE) m->prog.tries = 0;
+		if (m->prog.phase == PROG_VERIFY) done = prog_verified(m);
+		else done = m->prog.phase == PROG_DIGEST ? prog_digested(m) : prog_erase_next(m);
+		m->ack_len = 0;
+		return done;
+	}
+
+	if (have_ack) memcpy(&ack, m->ack_payload, sizeof(ack));
+	m->ack_len = 0;
+	if (status->got_nack) {
+		if (!m->prog.legacy && !have_ack && (m->prog.lz || m->prog.next == 0)) { // A bootloader that doesn't know the command
+			status->got_nack = status->got_ack = 0;
+			if (m->prog.lz) prog_no_lz(m);
+			else prog_fallback(m);
+			return false;
+		}
+		DEV_PRINTF(status, "Programming FAILED at 0x%08" PRIx32 "\r\n", prog_addr_at(m, have_ack ? ack.next : m->prog.next));
+		m->prog.failed = true;
+		prog_end(m);
+		return true;
+	}
+	if (status->got_ack) {
+		status->got_ack = 0;
+		if (m->prog.legacy) {
+			m->prog.next++;
+			m->prog.progress_us = serial_frame_now_us();
+		}
+		else if (have_ack) prog_acked(m, &ack);
+	}
+	if (m->prog.next >= m->prog.count) {
+		uint64_t us = serial_frame_now_us() - m->prog.start_us;
+		DEV_PRINTF(status, "Programmed %zu bytes in %" PRIu32 " frames (%" PRIu32 " resent), %.2f s, %.0f KiB/s\r\n",
+			m->prog.bytes, m->prog.count, m->prog.resent, us / 1e6, us ? m->prog.bytes / 1024.0 / (us / 1e6) : 0);
+		if (m->prog.lz)
+			DEV_PRINTF(status, "Sent %zu bytes compressed, %.0f%% of the image\r\n", m->prog.zbytes, 100.0 * m->prog.zbytes / m->prog.bytes);
+		if (!prog_verify_start(m)) return false;
+		prog_end(m);
+		return true;
+	}
+	prog_fill(m);
+	return false;
 }
 
-static void send_cmd_erase(int fd, uint8_t *buf, int start, int end) {
+// Returns false if the command line asked for something impossible
+static bool send_cmd_erase(mel_ctx_t *m, int start, int end) {
 	boot_cmd_packet_t pkt = {0};
 	pkt.cmd = boot_cmd_erase;
-	uint8_t *data = (uint8_t *)&pkt;
 
 	if (start == 0 && !unsafe_flag) {
 		fprintf(stderr,"WARNING: Ignored request to erase bootloader. Override with --allow-unsafe\r\n");
@@ -420,21 +1496,14 @@ static void send_cmd_erase(int fd, uint8_t *buf, int start, int end) {
 
 	if (start > end) {
 		fprintf(stderr,"ERROR: Start: %u End: %u , start cannot be > end\r\n", start, end);
-		caught_stop = true;
-		return;
+		m->stop = true;
+		return false;
 	}
 
 	pkt.arg0 = start;
 	pkt.arg1 = end;
-
-	int ret = serial_frame_encode(data, sizeof(pkt), BUF_SZ, buf, DEST_H7, FRAME_TYPE_BOOTLOADER_BIN);
-	if (ret < 0) { fprintf(stderr, "ENCODE ERROR\r\n"); return; }
-
-	ret = write(fd, buf, ret);
-	if (ret <= 0) {
-		perror("Serial device write error");
-		return;
-	}
+	send_boot_pkt(m, &pkt);
+	return true;
 }
 
 // HELLO the bootloader cmd.
@@ -450,64 +1519,576 @@ static void send_cmd_erase(int fd, uint8_t *buf, int start, int end) {
 // }
 
 // HELLO the frame. Fix me.
-static void send_cmd_hello_bms(int fd, uint8_t *buf) {
-	int ret = serial_frame_encode(NULL, 0, BUF_SZ, buf, DEST_BMS, FRAME_TYPE_HELLO);
+// Sent empty and HDLC: the H7 fills in what it supports for its BMS link, and an
+// older H7 that forwards it as is won't have the BMS switch to something it can't read.
+static void send_cmd_hello_bms(mel_ctx_t *m) {
+	int ret = serial_frame_encode(NULL, 0, BUF_SZ, m->enc_buf, DEST_BMS, FRAME_TYPE_HELLO);
 	if (ret < 0) { fprintf(stderr, "ENCODE ERROR\r\n"); return; }
-	my_write_buf(fd, buf, ret);
+	link_send(m, m->enc_buf, ret);
 }
 
-static void send_cmd_hello(int fd, uint8_t *buf) {
+static void send_cmd_hello(mel_ctx_t *m) {
 	boot_cmd_packet_t pkt = {0};
 	pkt.cmd = boot_cmd_hello;
-	uint8_t *data = (uint8_t *)&pkt;
+	send_boot_pkt(m, &pkt);
+}
+
+static void on_hello_timeout(void *ctx, uint32_t events) {
+	mel_ctx_t *m = (mel_ctx_t *)ctx;
+	m->hello_timer = -1;
+	m->hello_timed_out = true;
+	if (m->status.hello_pending) {
+		m->status.hello_pending = 0;
+		sf_decoder_set_opts(&m->status.decoder, SF_OPT_VIEW);
+		DEV_PRINTF(&m->status, "No HELLO reply, link framing: %s\r\n", framing_name(m->status.link_framing));
+	}
+	cmd_advance(m);
+}
 
-	int ret = serial_frame_encode(data, sizeof(pkt), BUF_SZ, buf, DEST_H7, FRAME_TYPE_BOOTLOADER_BIN);
+// Offer COBS for the USB link. HELLO always goes out HDLC so a peer that reset
+// since the last one still reads it. The reply comes back HDLC and everything
+// after it in the picked framing, so the decoder takes both from here on.
+// No reply means older firmware, stay HDLC.
+static void send_framing_hello(mel_ctx_t *m) {
+	sf_hello_t hello = { SF_FRAMINGS_SUPPORTED };
+	int ret = serial_frame_encode((uint8_t *)&hello, sizeof(hello), BUF_SZ, m->enc_buf, DEST_H7, FRAME_TYPE_HELLO);
 	if (ret < 0) { fprintf(stderr, "ENCODE ERROR\r\n"); return; }
 
-	ret = write(fd, buf, ret);
-	if (ret <= 0) {
-		perror("Serial device write error");
+	sf_decoder_set_opts(&m->status.decoder, SF_OPT_VIEW | SF_OPT_COBS);
+	m->status.hello_pending = 1;
+	m->hello_timed_out = false;
+	m->hello_timer = ev_timer(&m->loop, HELLO_TIMEOUT_MS, false, on_hello_timeout, m);
+	link_send(m, m->enc_buf, ret);
+}
+
+// The H7 bootloader says what it takes, older ones don't and get PROGRAM_CHUNK_SIZE
+static void hello_info(mel_ctx_t *m, const boot_hello_info_t *info) {
+	uint32_t chunk = info->chunk_max & ~31u; // Whole flash words
+	if (chunk > PROG_INFLIGHT_MAX) chunk = PROG_INFLIGHT_MAX;
+	if (chunk) m->boot_chunk = chunk;
+	m->boot_cmds = info->cmds;
+	DEV_PRINTF(&m->status, "Bootloader takes %" PRIu32 " bytes per program frame\r\n", m->boot_chunk);
+}
+
+// Same order the commands always ran in
+static const int cmd_order[] = {
+	CMD_FRAMING, boot_cmd_hello, boot_cmd_bms_hello, boot_cmd_erase,
+	boot_cmd_program, boot_cmd_bms_prog, boot_cmd_boot,
+};
+
+// Returns 1 if the command now waits on an ACK, 0 if there is nothing to wait for,
+// -1 to abandon the remaining commands
+static int cmd_start(mel_ctx_t *m, int cmd);
+
+// A plain command or its answer was lost, or the answer failed its CRC. Hello and erase
+// are safe to send again. Boot has reset the device whether it answered or not.
+static void on_cmd_timeout(void *ctx, uint32_t events) {
+	mel_ctx_t *m = (mel_ctx_t *)ctx;
+
+	m->cmd_timer = -1; // One-shot, already gone
+	if (m->in_flight != boot_cmd_boot && ++m->cmd_tries <= PROG_RETRIES) {
+		cmd_start(m, m->in_flight);
 		return;
 	}
+	if (m->in_flight != boot_cmd_boot) {
+		DEV_PRINTF(&m->status, "No answer to command 0x%x, giving up on the rest\r\n", m->in_flight);
+		m->command_field = 0;
+		m->failed = true;
+	}
+	m->cmd_timed_out = true;
+	cmd_advance(m);
+}
+
+static int cmd_start(mel_ctx_t *m, int cmd) {
+	unsigned wait_ms = CMD_TIMEOUT_MS;
+	switch (cmd) {
+		case CMD_FRAMING:		send_framing_hello(m);	break;
+		case boot_cmd_hello:	send_cmd_hello(m);		break;
+		case boot_cmd_bms_hello: send_cmd_hello_bms(m);	break;
+		case boot_cmd_erase:
+			if (m->erase_start < 0) {
+				fprintf(stderr, "Abort: Bad or missing erase arg, need --erase_sector_start, optional --erase_sector_end\r\n");
+				return -1;
+			}
+			// Assume if no end is given to erase only a single sector
+			if (m->erase_end < 0) m->erase_end = m->erase_start;
+			if (!send_cmd_erase(m, m->erase_start, m->erase_end)) return -1;
+			wait_ms = (m->erase_end - m->erase_start + 1) * ERASE_SECTOR_MS;
+			break;
+		case boot_cmd_program:	return prog_start(m, m->prog_bin_file, m->program_addr, DEST_H7) ? 1 : 0;
+		case boot_cmd_bms_prog:	return prog_start(m, m->prog_bms_bin_file, m->program_addr, DEST_BMS) ? 1 : 0;
+		case boot_cmd_boot:		send_cmd_boot(m);		break;
+		default: return 0;
+	}
+	if (cmd != CMD_FRAMING) { // That one has its own
+		ev_timer_cancel(&m->loop, m->cmd_timer);
+		m->cmd_timer = ev_timer(&m->loop, wait_ms, false, on_cmd_timeout, m);
+	}
+	return 1;
+}
+
+// True once the command in flight got its answer (ACK and NACK are consumed)
+static bool cmd_finished(mel_ctx_t *m) {
+	mel_status_t *status = &m->status;
+	if (m->cmd_timed_out) { // Whatever we have is all we get
+		m->cmd_timed_out = false;
+		m->cmd_tries = 0;
+		return true;
+	}
+	switch (m->in_flight) {
+		case CMD_FRAMING:
+			if (m->hello_timed_out) break; // Whatever we have is all we get
+			if (status->hello_pending || (!status->got_ack && !status->got_nack)) return false;
+			ev_timer_cancel(&m->loop, m->hello_timer);
+			m->hello_timer = -1;
+			break;
+		case boot_cmd_program:
+		case boot_cmd_bms_prog:
+			if (!prog_advance(m)) return false;
+			break;
+		case boot_cmd_hello:
+			if (!status->got_ack && !status->got_nack) return false;
+			if (status->got_ack && m->ack_len >= sizeof(boot_hello_info_t)) {
+				boot_hello_info_t info;
+				memcpy(&info, m->ack_payload, sizeof(info));
+				hello_info(m, &info);
+			}
+			m->ack_len = 0;
+			break;
+		default:
+			if (!status->got_ack && !status->got_nack) return false;
+			if (status->got_nack) {
+				DEV_PRINTF(status, "Command 0x%x FAILED, NACK\r\n", m->in_flight);
+				m->failed = true;
+			}
+	}
+	ev_timer_cancel(&m->loop, m->cmd_timer);
+	m->cmd_timer = -1;
+	m->cmd_tries = 0;
+	status->got_ack  = 0; // Consume ACK and NACK
+	status->got_nack = 0;
+	return true;
 }
 
-// Process all frames in the buffer and returns when at least one is found
-static void get_frames(int fd, uint8_t *buf, serial_frame_t *f, mel_status_t *status) {
-	bool got_frame = false;
-	while(1) {
-		if (got_frame) break;
-		ssize_t ret = read(fd, buf, BUF_SZ);
-		int decode_ret;
-		bool go = false;
-		int i=0;
+// Commands are over for this device, config input can start once they all are
+static void commands_done(mel_ctx_t *m) {
+	m->cmds_done = true;
+	atomic_fetch_sub(&cmds_pending, 1);
+	wake(main_wake);
+}
 
-		if (caught_stop) break;
+// Moves the command sequence along, call whenever an ACK/NACK may have arrived
+static void cmd_advance(mel_ctx_t *m) {
+	while (!m->cmds_done && !m->stop && !caught_stop) {
+		if (m->in_flight) {
+			if (!cmd_finished(m)) return;
+			m->command_field &= ~m->in_flight; // Mark handled
+			m->in_flight = 0;
+		}
+		int cmd = 0;
+		for (unsigned i=0; i<sizeof(cmd_order)/sizeof(cmd_order[0]); i++) {
+			if (m->command_field & cmd_order[i]) { cmd = cmd_order[i]; break; }
+		}
+		if (cmd == 0) {
+			commands_done(m);
+			return;
+		}
+		int ret = cmd_start(m, cmd);
 		if (ret < 0) {
-			perror("Serial device read error");
-			caught_stop = true;
+			m->command_field = 0;
+			m->failed = true;
+		}
+		else if (ret == 0) m->command_field &= ~cmd;
+		else m->in_flight = cmd;
+	}
+}
+
+static void on_serial(void *ctx, uint32_t events) {
+	mel_ctx_t *m = (mel_ctx_t *)ctx;
+	ssize_t ret;
+	int decode_ret;
+	bool go = false;
+	int i=0;
+
+	if (events & EPOLLOUT) tx_flush(m);
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+
+	ret = read(m->fd, m->rx_buf, BUF_SZ);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR)) return;
+	if (ret <= 0) {
+		if (ret < 0) perror("Serial device read error");
+		else fprintf(stderr, "Serial device %s closed\r\n", m->path);
+		m->stop = true;
+		return;
+	}
+	host_stamp(&m->rx_stamp);
+	metrics_observe(&m->metrics.read_size, ret);
+
+	do {
+		decode_ret = sf_decode(&m->status.decoder, &m->rx_buf[i], ret-i, &m->f);
+		if (decode_ret < 0) {
+			metrics_add(&m->metrics.decode_errors, 1);
+			if (m->f.err == MALFORM) metrics_add(&m->metrics.malformed, 1);
+			DEV_PRINTF(&m->status, "DECODE ERROR\r\n");
+			break;
+		}
+		i += decode_ret;
+		go = parse_frame(m, &m->f);
+	} while (go);
+	if (m->status.decoder.aborted | m->status.decoder.skipped) { // Decoder counts, we keep the totals
+		metrics_add(&m->metrics.aborted, m->status.decoder.aborted);
+		metrics_add(&m->metrics.skipped, m->status.decoder.skipped);
+		m->status.decoder.aborted = m->status.decoder.skipped = 0;
+	}
+	if (m->sink_pushed) { // One wakeup per read, not per frame
+		m->sink_pushed = false;
+		wake(m->sink_wake);
+	}
+
+	cmd_advance(m);
+}
+
+// Main thread posted data frames or closed its input
+static void on_wake(void *ctx, uint32_t events) {
+	mel_ctx_t *m = (mel_ctx_t *)ctx;
+	uint8_t *buf;
+	size_t len, off = 0;
+
+	wake_drain(m->wake);
+	pthread_mutex_lock(&m->inbox_lock);
+	buf = m->inbox;
+	len = m->inbox_len;
+	m->inbox = NULL;
+	m->inbox_len = m->inbox_cap = 0;
+	pthread_mutex_unlock(&m->inbox_lock);
+
+	while (off + sizeof(uint32_t) <= len) {
+		uint32_t sz;
+		memcpy(&sz, &buf[off], sizeof(sz));
+		off += sizeof(sz);
+		send_data_frame(m, (const char *)&buf[off], sz);
+		off += sz;
+	}
+	free(buf);
+	update_interest(m);
+}
+
+// Keep going while there is anything left to do or listen for
+static bool dev_busy(mel_ctx_t *m) {
+	if (m->stop || caught_stop) return false;
+	return !m->cmds_done || atomic_load(&m->backlog) || listen_flag || atomic_load(&inputs_open);
+}
+
+// Runs the handlers for whatever ingest queued, until told to stop and drained
+static void * sink_thread(void *arg) {
+	mel_ctx_t *m = (mel_ctx_t *)arg;
+	uint64_t count;
+	while (1) {
+		bool stop = atomic_load(&m->sink_stop); // Everything queued before the stop gets drained below
+		mel_rec_t *rec;
+		uint32_t len;
+		while ((rec = spsc_peek(&m->sink_ring, &len)) != NULL) {
+			if (metrics_path) {
+				uint64_t start = serial_frame_now_us();
+				sink_frame(&m->status, rec);
+				metrics_observe(&m->metrics.handler[metrics_type(rec->type)], serial_frame_now_us() - start);
+			}
+			else sink_frame(&m->status, rec);
+			spsc_release(&m->sink_ring);
+		}
+		if (m->status.udp != NULL) udp_out_flush(m->status.udp); // Whatever this pass queued, in one burst
+		if (m->status.shm != NULL) shm_out_wake(m->status.shm);
+		if (stop) break;
+		if (read(m->sink_wake, &count, sizeof(count)) < 0 && errno != EINTR) {
+			perror("sink eventfd");
 			break;
 		}
+	}
+	fflush(stdout);
+	return NULL;
+}
+
+// Ingest: serial RX/TX, decode, commands. Never blocks on anything but epoll.
+static void * dev_thread(void *arg) {
+	mel_ctx_t *m = (mel_ctx_t *)arg;
+	bool sink = pthread_create(&m->sink_thread, NULL, sink_thread, m) == 0;
+
+	if (!sink) {
+		perror("sink pthread_create");
+		m->stop = true;
+	}
+	else cmd_advance(m); // Starts the first command
+	while (dev_busy(m)) {
+		if (ev_run_once(&m->loop, -1) < 0) {
+			perror("epoll_wait");
+			break;
+		}
+	}
+	if (sink) { // Let it finish what is queued
+		atomic_store(&m->sink_stop, true);
+		wake(m->sink_wake);
+		pthread_join(m->sink_thread, NULL);
+	}
+
+	if (!m->cmds_done) {
+		m->cmds_done = true;
+		atomic_fetch_sub(&cmds_pending, 1);
+	}
+	atomic_store(&m->running, false);
+	atomic_fetch_sub(&devs_running, 1);
+	wake(main_wake);
+	return NULL;
+}
+
+// Copies a data frame payload to every device still running
+static void post_data_frame(const char *data, unsigned sz) {
+	uint32_t len = sz;
+	for (unsigned i=0; i<dev_count; i++) {
+		mel_ctx_t *m = devs[i];
+		if (!atomic_load(&m->running)) continue;
+
+		pthread_mutex_lock(&m->inbox_lock);
+		if (m->inbox_len + sizeof(len) + sz > m->inbox_cap) {
+			size_t cap = m->inbox_cap ? m->inbox_cap : BUF_SZ;
+			uint8_t *p;
+			while (cap < m->inbox_len + sizeof(len) + sz) cap *= 2;
+			p = realloc(m->inbox, cap);
+			if (p == NULL) {
+				pthread_mutex_unlock(&m->inbox_lock);
+				fprintf(stderr, "%s inbox: out of memory, frame dropped\r\n", m->status.name);
+				continue;
+			}
+			m->inbox = p;
+			m->inbox_cap = cap;
+		}
+		memcpy(&m->inbox[m->inbox_len], &len, sizeof(len));
+		memcpy(&m->inbox[m->inbox_len + sizeof(len)], data, sz);
+		m->inbox_len += sizeof(len) + sz;
+		atomic_fetch_add(&m->backlog, sizeof(len) + sz);
+		pthread_mutex_unlock(&m->inbox_lock);
+		wake(m->wake);
+	}
+}
+
+static void wake_devs(void) {
+	for (unsigned i=0; i<dev_count; i++) wake(devs[i]->wake);
+}
+
+static void on_stdin(void *ctx, uint32_t events);
+static void on_control(void *ctx, uint32_t events);
+
+// Every device is done with its commands, config input can go out now
+static void inputs_start(mel_input_t *in) {
+	in->started = true;
+	if (input_stdin_flag) {
+		in->stdin_open = true;
+		if (ev_add(&in->loop, STDIN_FILENO, EPOLLIN, on_stdin, in) < 0) {
+			if (errno == EPERM) in->stdin_poll = true; // Redirected from a file
+			else { perror("stdin"); in->stdin_open = false; }
+		}
+	}
+	if (in->ctl_fd >= 0 && ev_add(&in->loop, in->ctl_fd, EPOLLIN, on_control, in) < 0) {
+		perror("control socket");
+		close(in->ctl_fd);
+		in->ctl_fd = -1;
+	}
+}
+
+// Stop reading input while any device is behind, it would only queue up
+static void inputs_pause(mel_input_t *in) {
+	bool paused = false;
+	for (unsigned i=0; i<dev_count; i++) {
+		if (atomic_load(&devs[i]->running) && atomic_load(&devs[i]->backlog) >= TX_HIGH_WATER) paused = true;
+	}
+	if (paused == in->paused || !in->started) return;
+	in->paused = paused;
+	if (in->stdin_open && !in->stdin_poll) ev_mod(&in->loop, STDIN_FILENO, paused ? 0 : EPOLLIN);
+	if (in->ctl_fd >= 0) ev_mod(&in->loop, in->ctl_fd, paused ? 0 : EPOLLIN);
+}
+
+static void stdin_close(mel_input_t *in) {
+	if (!in->stdin_poll) ev_del(&in->loop, STDIN_FILENO);
+	in->stdin_open = false;
+	input_stdin_flag = 0;
+}
+
+// Each line of stdin is one data frame, read as it arrives so a slow producer
+// never holds up reception
+static void on_stdin(void *ctx, uint32_t events) {
+	mel_input_t *in = (mel_input_t *)ctx;
+	char *start = in->line_buf, *nl;
+	ssize_t ret = read(STDIN_FILENO, &in->line_buf[in->line_len], sizeof(in->line_buf) - 1 - in->line_len);
+
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EINTR) return;
+		perror("stdin read error");
+		stdin_close(in);
+		return;
+	}
+	if (ret == 0) { // EOF, anything left is a last line without a newline
+		if (in->line_len) post_data_frame(in->line_buf, in->line_len);
+		in->line_len = 0;
+		stdin_close(in);
+		return;
+	}
+	in->line_len += ret;
+
+	// Hack: For terminal input, if last char is a newline, replace with null
+	// This is mostly for JSON testing. Use UDP socket mode if you are doing anything else.
+	// The JSON strings are expected to be null terminated.
+	while ((nl = memchr(start, '\n', &in->line_buf[in->line_len] - start)) != NULL) {
+		*nl = '\0';
+		post_data_frame(start, nl - start + 1);
+		start = nl + 1;
+	}
+	in->line_len = &in->line_buf[in->line_len] - start;
+	memmove(in->line_buf, start, in->line_len);
+
+	// Overlong lines go out in pieces, same as fgets() did
+	if (in->line_len == sizeof(in->line_buf) - 1) {
+		post_data_frame(in->line_buf, in->line_len);
+		in->line_len = 0;
+	}
+}
+
+// Each datagram on the control socket is sent on as one data frame, as is
+static void on_control(void *ctx, uint32_t events) {
+	mel_input_t *in = (mel_input_t *)ctx;
+	char buf[MY_STDIN_BUF_SZ];
+	ssize_t ret = recv(in->ctl_fd, buf, sizeof(buf), 0);
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EINTR) perror("control socket recv");
+		return;
+	}
+	if (ret > 0) post_data_frame(buf, ret);
+}
+
+static void on_main_wake(void *ctx, uint32_t events) {
+	wake_drain(main_wake);
+}
+
+// Rewrites the --metrics-file, from the main thread's timer and once more at exit
+static void write_metrics(void) {
+	metrics_dev_t out[MEL_MAX_DEVS];
+	unsigned n = 0;
+	for (unsigned i=0; i<dev_count; i++) {
+		if (devs[i] == NULL) continue;
+		out[n].name = devs[i]->status.name;
+		out[n].m = &devs[i]->metrics;
+		out[n].ring = &devs[i]->sink_ring;
+		n++;
+	}
+	metrics_write_file(metrics_path, out, n);
+}
+
+static void on_metrics_timer(void *ctx, uint32_t events) {
+	write_metrics();
+}
+
+// Per-device output files get the device name appended once there is more than one
+static const char * dev_file_path(char *out, size_t sz, const char *path, mel_ctx_t *m) {
+	if (!multi_dev_flag) return path;
+	snprintf(out, sz, "%s.%s", path, m->status.name);
+	return out;
+}
+
+// Opens the port and everything else a device owns, ready for dev_thread()
+// On failure wake is left at -1, the caller still owns m and frees it with dev_close()
+static mel_ctx_t * dev_open(const char *path) {
+	mel_ctx_t *m = calloc(1, sizeof(*m));
+	const char *slash = strrchr(path, '/');
+	if (m == NULL) { perror("device context"); return NULL; }
+
+	m->path = path;
+	m->fd = -1;
+	m->wake = -1;
+	m->sink_wake = -1;
+	m->hello_timer = -1;
+	m->cmd_timer = -1;
+	m->prog.timer = -1;
+	m->boot_chunk = PROGRAM_CHUNK_SIZE;
+	m->status.name = slash ? slash + 1 : path;
+	m->status.link_framing = SF_FRAMING_HDLC;
+	pthread_mutex_init(&m->inbox_lock, NULL);
+	sf_decoder_init(&m->status.decoder, m->frame_buf, sizeof(m->frame_buf));
+	sf_decoder_set_opts(&m->status.decoder, SF_OPT_VIEW); // No malloc/free per frame
+	sf_decoder_set_stream(&m->status.decoder, stream_to_sink, m);
+	if (ev_init(&m->loop) < 0) return m;
+	if (spsc_init(&m->sink_ring, SINK_RING_SZ) < 0 || (m->sink_wake = eventfd(0, EFD_CLOEXEC)) < 0) {
+		perror("sink ring");
+		return m;
+	}
+
+	m->fd = open_port(path);
+	if (m->fd < 0) return m;
+	set_mf_attr(m->fd);
+	fcntl(m->fd, F_SETFL, O_NONBLOCK);
+	if (ev_add(&m->loop, m->fd, EPOLLIN, on_serial, m) < 0) {
+		perror("epoll serial device");
+		return m;
+	}
 
-		do {
-			decode_ret = serial_frame_decode(&buf[i], ret-i, f);
-			if (decode_ret < 0) { fprintf(stderr,"DECODE ERROR\r\n"); break; }
-			i += decode_ret;
-			go = parse_frame(f, status);
-			if (go) got_frame = true;
-		} while (go);
+	m->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m->wake < 0 || ev_add(&m->loop, m->wake, EPOLLIN, on_wake, m) < 0) {
+		perror("device eventfd");
+		return m;
+	}
+	return m;
+}
+
+static void dev_close(mel_ctx_t *m) {
+	if (m->f.buf != NULL && !(m->f.flag & BUF_VIEW))
+		free(m->f.buf); // Leftover from unfinished frame
+	ev_close(&m->loop);
+	if (m->fd >= 0) close(m->fd);
+	if (m->wake >= 0) close(m->wake);
+	if (m->sink_wake >= 0) close(m->sink_wake);
+	spsc_free(&m->sink_ring);
+	if (m->status.udp != NULL) {
+		udp_out_close(m->status.udp);
+		free(m->status.udp);
+	}
+	if (m->status.shm != NULL) {
+		shm_out_close(m->status.shm);
+		free(m->status.shm);
 	}
-	return;
+	COND_FCLOSE(m->status.audio_file);
+	if (m->status.audio_wav != NULL) {
+		audio_sink_close(m->status.audio_wav);
+		free(m->status.audio_wav);
+	}
+	COND_FCLOSE(m->status.data_file);
+	COND_FCLOSE(m->status.data_and_debug_file);
+	prog_free(m); // Cut short
+	COND_FCLOSE(m->prog_bin_file);
+	COND_FCLOSE(m->prog_bms_bin_file);
+	pthread_mutex_destroy(&m->inbox_lock);
+	free(m->tx_buf);
+	free(m->inbox);
+	free(m);
 }
 
 int main(int argc, char **argv) {
-	static uint8_t buf[BUF_SZ];	// Main RX buffer
-	static char stdin_buf[MY_STDIN_BUF_SZ]; // For reading STDIN to send as data packets
+	static mel_input_t in;
+	static const char *dev_paths[MEL_MAX_DEVS];
 	struct sigaction act;
-	int fd = -1;
-
-	FILE *prog_bin_file = NULL;
-	FILE *prog_bms_bin_file = NULL;
+	int ctl_fd = -1;
+	static udp_dest_t udp_dests[UDP_MAX_DESTS];
+	unsigned udp_dest_count = 0;
+	mel_status_t total = {0};
+	unsigned threads = 0;
+	int exit_code = 1;	// Until the devices run, a bail out is an error
+
+	const char *prog_bin_path = NULL;
+	const char *prog_bms_bin_path = NULL;
+	const char *data_path = NULL, *both_path = NULL, *audio_path = NULL;
+	const char *audio_wav_path = NULL;
+	const char *shm_name = NULL;
+	unsigned shm_mb = SHM_DEFAULT_MB;
+	audio_conf_t audio_conf = { AUDIO_DEFAULT_RATE, AUDIO_DEFAULT_CHANNELS, AUDIO_DEFAULT_BITS, 0 };
+	unsigned audio_rotate_sec = 0, audio_rotate_mb = 0;
 	uint32_t program_addr = APPLICATION_START_ADDR;
+	unsigned program_window = PROG_WINDOW_DEFAULT;
 
 	int erase_start	= -1;
 	int erase_end 	= -1;
@@ -518,8 +2099,8 @@ int main(int argc, char **argv) {
 	unsafe_flag = 1;
 #endif
 
-	mel_status_t status	= {0};
-	serial_frame_t f 	= {0};
+	if (ev_init(&in.loop) < 0) return 1;
+	in.ctl_fd = -1;
 
 #ifdef DEFAULT_VERBOSE
 	verbose_flag = 1;
@@ -529,17 +2110,21 @@ int main(int argc, char **argv) {
 	while (1)
     {
 		int c;
-		int ret;
 		static struct option long_options[] =
 		{
 			/* These options set a flag. */
 			{"verbose", no_argument, &verbose_flag, 1}, // moot, default on
 			{"listen",  no_argument, &listen_flag, 1},
 			{"print-timestamps", no_argument, &print_timestamps_flag, 1},
+			{"cobs", no_argument, &cobs_flag, 1},
+			{"binary", no_argument, &binary_flag, 1},
 			{"print-data-stdout", no_argument, &print_data_stdout_flag, 1},
 			{"data-debug-file", required_argument, 0, BOTH_FILE_OPT},
 			{"send-data",  no_argument, &input_stdin_flag, 1},
 			{"allow-unsafe", no_argument, &unsafe_flag, 1},
+			{"delta", no_argument, &delta_flag, 1},
+			{"no-compress", no_argument, &no_compress_flag, 1},
+			{"no-verify", no_argument, &no_verify_flag, 1},
 			{"send-hello", no_argument,	0, HELLO_OPT},
 			{"bms-send-hello", no_argument,	0, BMS_HELLO_OPT},
 			{"boot", no_argument, 0, 'b'},
@@ -549,9 +2134,22 @@ int main(int argc, char **argv) {
 			{"erase-sector-end", required_argument,	0, ERASE_END_OPT},
 			{"data-file", required_argument, 0, DATA_FILE_OPT},
 			{"audio-file", required_argument, 0, 'u'},
+			{"audio-wav", required_argument, 0, AUDIO_WAV_OPT},
+			{"audio-rate", required_argument, 0, AUDIO_RATE_OPT},
+			{"audio-bits", required_argument, 0, AUDIO_BITS_OPT},
+			{"audio-channels", required_argument, 0, AUDIO_CHANNELS_OPT},
+			{"audio-rotate-sec", required_argument, 0, AUDIO_ROTATE_SEC_OPT},
+			{"audio-rotate-mb", required_argument, 0, AUDIO_ROTATE_MB_OPT},
 			{"program-addr", required_argument, 0, 'a'},
+			{"program-window", required_argument, 0, PROG_WINDOW_OPT},
 			{"dev", required_argument, 0, 'd'},
 			{"udp", no_argument, 0, UDP_OPT},
+			{"udp-dest", required_argument, 0, UDP_DEST_OPT},
+			{"shm", required_argument, 0, SHM_OPT},
+			{"shm-mb", required_argument, 0, SHM_MB_OPT},
+			{"metrics-file", required_argument, 0, METRICS_FILE_OPT},
+			{"metrics-sec", required_argument, 0, METRICS_SEC_OPT},
+			{"control", optional_argument, 0, CONTROL_OPT},
 			{0, 0, 0, 0}
 		};
 		/* getopt_long stores the option index here. */
@@ -574,8 +2172,51 @@ int main(int argc, char **argv) {
 				MY_PRINTF("\n");
 				break;
 
-			case UDP_OPT:
-				status.tx_socket_fd = my_socket();
+			case UDP_OPT: // The local consumer it always was: data strings to localhost
+			case UDP_DEST_OPT: {
+				char spec[32];
+				if (c == UDP_OPT) snprintf(spec, sizeof(spec), "127.0.0.1:%u/data", MASTER_MEL_DEFAULT_UDP_SEND_PORT);
+				if (udp_dest_count == UDP_MAX_DESTS) {
+					fprintf(stderr, "Abort: At most %u UDP destinations\r\n", UDP_MAX_DESTS);
+					goto out;
+				}
+				if (udp_dest_parse(&udp_dests[udp_dest_count], c == UDP_OPT ? spec : optarg) < 0) goto out;
+				udp_dest_count++;
+				break;
+			}
+
+			case SHM_OPT:
+				shm_name = optarg;
+				break;
+
+			case SHM_MB_OPT:
+				shm_mb = strtoul(optarg, NULL, 10);
+				break;
+
+			case PROG_WINDOW_OPT:
+				program_window = strtoul(optarg, NULL, 10);
+				if (program_window < 1 || program_window > BOOT_PROG_WINDOW_MAX) {
+					fprintf(stderr, "Abort: --program-window is 1 to %u frames\r\n", BOOT_PROG_WINDOW_MAX);
+					goto out;
+				}
+				break;
+
+			case METRICS_FILE_OPT:
+				metrics_path = optarg;
+				break;
+
+			case METRICS_SEC_OPT:
+				metrics_sec = strtoul(optarg, NULL, 10);
+				if (metrics_sec == 0) {
+					fprintf(stderr, "Abort: --metrics-sec must be at least 1\r\n");
+					goto out;
+				}
+				break;
+
+			case CONTROL_OPT:
+				if (ctl_fd < 0) ctl_fd = my_socket();
+				if (ctl_fd < 0) goto out;
+				if (my_bind_socket(ctl_fd, optarg ? atoi(optarg) : MASTER_MEL_DEFAULT_UDP_LISTEN_PORT) < 0) goto out;
 				break;
 
 			case BMS_HELLO_OPT:
@@ -597,11 +2238,7 @@ int main(int argc, char **argv) {
 				break;
 
 			case BMS_PROG_OPT:
-				prog_bms_bin_file = fopen(optarg, "r");
-				if (prog_bms_bin_file == NULL) {
-					perror("BMS Bin file error");
-					goto out;
-				}
+				prog_bms_bin_path = optarg;
 				if (command_field & boot_cmd_program) {
 					printf("Abort: BMS prog and H7 program mutually exclusive\r\n");
 					goto out;
@@ -610,16 +2247,12 @@ int main(int argc, char **argv) {
 				break;
 
 			case 'p':
-				prog_bin_file = fopen(optarg, "r");
-				if (prog_bin_file == NULL) {
-					perror("Bin file error");
-					goto out;
-				}
+				prog_bin_path = optarg;
 				if (command_field & boot_cmd_bms_prog) {
 					printf("Abort: BMS prog and H7 program mutually exclusive\r\n");
 					goto out;
 				}
-				command_field = command_field | boot_cmd_program;
+				command_field = command_field | boot_cmd_program | boot_cmd_hello; // Hello first, for the chunk size
 				break;
 
 			case 'a':
@@ -627,24 +2260,47 @@ int main(int argc, char **argv) {
 				break;
 
 			case 'd':
-				fd = open_port(optarg);
-				if (fd < 0) goto out;
-				set_mf_attr(fd);
+				if (dev_count == MEL_MAX_DEVS) {
+					fprintf(stderr, "Abort: At most %u devices\r\n", MEL_MAX_DEVS);
+					goto out;
+				}
+				dev_paths[dev_count++] = optarg;
 				break;
 
 			case DATA_FILE_OPT:
-				ret = set_data_file(optarg, &status);
-				if (ret < 0) goto out;
+				data_path = optarg;
 				break;
 
 			case BOTH_FILE_OPT:
-				ret = set_both_file(optarg, &status);
-				if (ret < 0) goto out;
+				both_path = optarg;
 				break;
 
 			case 'u':
-				ret = set_audio_file(optarg, &status);
-				if (ret < 0) goto out;
+				audio_path = optarg;
+				break;
+
+			case AUDIO_WAV_OPT:
+				audio_wav_path = optarg;
+				break;
+
+			case AUDIO_RATE_OPT:
+				audio_conf.rate = strtoul(optarg, NULL, 10);
+				break;
+
+			case AUDIO_BITS_OPT:
+				audio_conf.bits = strtoul(optarg, NULL, 10);
+				break;
+
+			case AUDIO_CHANNELS_OPT:
+				audio_conf.channels = strtoul(optarg, NULL, 10);
+				break;
+
+			case AUDIO_ROTATE_SEC_OPT:
+				audio_rotate_sec = strtoul(optarg, NULL, 10);
+				break;
+
+			case AUDIO_ROTATE_MB_OPT:
+				audio_rotate_mb = strtoul(optarg, NULL, 10);
 				break;
 
 			case 'b':
@@ -660,151 +2316,177 @@ int main(int argc, char **argv) {
 		}
     }
 
-	/* Print any remaining command line arguments (not options). */
-	if (optind < argc)
-	{
-		MY_PRINTF("non-option ARGV-elements: ");
-		while (optind < argc)
-			MY_PRINTF("%s ", argv[optind++]);
-		putchar('\n');
-		goto out;
+	// Anything else is more devices, `--dev /dev/ttyACM*` expands to that
+	while (optind < argc) {
+		if (dev_count == MEL_MAX_DEVS) {
+			fprintf(stderr, "Abort: At most %u devices\r\n", MEL_MAX_DEVS);
+			goto out;
+		}
+		dev_paths[dev_count++] = argv[optind++];
 	}
 
-	if (fd < 0) {
+	if (dev_count == 0) {
 		fprintf(stderr, "Abort: No serial device given, example: --dev=/dev/ttyS4\r\n");
 		goto out;
 	}
-
-	// Handle args done
-
-	// Catch ctrl-C to exit cleanly
-	act.sa_handler = intHandler;
-	sigaction(SIGINT, &act, NULL);
-
-	// Handle any requested commands
-	while(command_field && !caught_stop) {
-		if (command_field & boot_cmd_hello) {
-			send_cmd_hello(fd, buf);			// Send cmd
-			// Wait for ACK and print and debug frames
-			while(!got_ack && !got_nack && !caught_stop) {
-				get_frames(fd, buf, &f, &status);
+	multi_dev_flag = dev_count > 1;
+
+	// Rotate on whichever limit comes first
+	if (audio_rotate_sec)
+		audio_conf.rotate_bytes = (uint64_t)audio_rotate_sec * audio_conf.rate * audio_conf.channels * ((audio_conf.bits + 7) / 8);
+	if (audio_rotate_mb && (audio_conf.rotate_bytes == 0 || (uint64_t)audio_rotate_mb * 1024 * 1024 < audio_conf.rotate_bytes))
+		audio_conf.rotate_bytes = (uint64_t)audio_rotate_mb * 1024 * 1024;
+
+	// Each device gets its own port, decoder, files and programming file handles
+	for (unsigned i=0; i<dev_count; i++) {
+		char path_buf[4096];
+		mel_ctx_t *m = dev_open(dev_paths[i]);
+		if (m == NULL) goto out;
+		devs[i] = m;
+		if (m->wake < 0) goto out; // dev_open() already said why
+		m->status.dev = i;
+
+		if (data_path && set_data_file(dev_file_path(path_buf, sizeof(path_buf), data_path, m), &m->status) < 0) goto out;
+		if (both_path && set_both_file(dev_file_path(path_buf, sizeof(path_buf), both_path, m), &m->status) < 0) goto out;
+		if (audio_path && set_audio_file(dev_file_path(path_buf, sizeof(path_buf), audio_path, m), &m->status) < 0) goto out;
+		if (audio_wav_path) {
+			m->status.audio_wav = malloc(sizeof(audio_sink_t));
+			if (m->status.audio_wav == NULL) goto out;
+			if (audio_sink_init(m->status.audio_wav, dev_file_path(path_buf, sizeof(path_buf), audio_wav_path, m), m->status.name, &audio_conf) < 0) {
+				free(m->status.audio_wav);
+				m->status.audio_wav = NULL;
+				goto out;
 			}
-			got_ack  = 0; // Consume ACK and NACK
-			got_nack = 0;
-			command_field &= ~boot_cmd_hello;	// Mark handled
 		}
-
-		if (command_field & boot_cmd_bms_hello) {
-			//send_cmd_bms_hello(fd, buf);		// Send cmd
-			send_cmd_hello_bms(fd, buf);
-			// Wait for ACK and print and debug frames
-			while(!got_ack && !got_nack && !caught_stop) {
-				get_frames(fd, buf, &f, &status);
-			}
-			got_ack  = 0; // Consume ACK and NACK
-			got_nack = 0;
-			command_field &= ~boot_cmd_bms_hello;	// Mark handled
+		if (udp_dest_count) {
+			m->status.udp = malloc(sizeof(udp_out_t));
+			if (m->status.udp == NULL) goto out;
+			if (udp_out_open(m->status.udp, udp_dests, udp_dest_count) < 0) goto out;
 		}
-
-		if (command_field & boot_cmd_erase) {
-			if (erase_start < 0) {
-				fprintf(stderr, "Abort: Bad or missing erase arg, need --erase_sector_start, optional --erase_sector_end\r\n");
-				break;
+		if (shm_name) {
+			m->status.shm = malloc(sizeof(shm_out_t));
+			if (m->status.shm == NULL) goto out;
+			if (shm_out_open(m->status.shm, dev_file_path(path_buf, sizeof(path_buf), shm_name, m), shm_mb) < 0) {
+				free(m->status.shm);
+				m->status.shm = NULL;
+				goto out;
 			}
-			// Assume if no end is given to erase only a single sector
-			if (erase_end < 0) erase_end = erase_start;
-
-			send_cmd_erase(fd, buf, erase_start, erase_end);
-			while(!got_ack && !got_nack && !caught_stop) {
-				get_frames(fd, buf, &f, &status);
-			}
-			got_ack  = 0; // Consume ACK and NACK
-			got_nack = 0;
-			command_field &= ~boot_cmd_erase;
 		}
 
-		if (command_field & boot_cmd_program) {
-			send_cmd_prog(fd, buf, prog_bin_file, program_addr, DEST_H7, &status);
-			command_field &= ~boot_cmd_program;
+		if (prog_bin_path && (m->prog_bin_file = fopen(prog_bin_path, "r")) == NULL) {
+			perror("Bin file error");
+			goto out;
 		}
-
-		if (command_field & boot_cmd_bms_prog) {
-			send_cmd_prog(fd, buf, prog_bms_bin_file, program_addr, DEST_BMS, &status);
-			command_field &= ~boot_cmd_bms_prog;
+		if (prog_bms_bin_path && (m->prog_bms_bin_file = fopen(prog_bms_bin_path, "r")) == NULL) {
+			perror("BMS Bin file error");
+			goto out;
 		}
+		m->command_field = command_field | (cobs_flag ? CMD_FRAMING : 0); // Link framing first, everything after uses it
+		m->erase_start = erase_start;
+		m->erase_end = erase_end;
+		m->program_addr = program_addr;
+		m->program_window = program_window;
+	}
 
-		if (command_field & boot_cmd_boot) {
-			send_cmd_boot(fd, buf);
-			while(!got_ack && !got_nack && !caught_stop) {
-				get_frames(fd, buf, &f, &status);
-			}
-			got_ack  = 0; // Consume ACK and NACK
-			got_nack = 0;
-			command_field &= ~boot_cmd_boot;
-		}
+	// Handle args done
+
+	// A thread and event loop per device, this one handles stdin and the control socket
+	main_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (main_wake < 0 || ev_add(&in.loop, main_wake, EPOLLIN, on_main_wake, NULL) < 0) {
+		perror("eventfd");
+		goto out;
+	}
+	if (metrics_path && ev_timer(&in.loop, metrics_sec * 1000, true, on_metrics_timer, NULL) < 0) {
+		perror("metrics timer");
+		goto out;
 	}
 
-	// Send any data from stdint
-	while(input_stdin_flag && !caught_stop) {
-		char *ret = fgets(stdin_buf, MY_STDIN_BUF_SZ, stdin);
-		if (ret == NULL) {
-			input_stdin_flag=0;
+	// Catch ctrl-C (and systemd's stop) to exit cleanly, main_wake gets the loop to notice
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = intHandler;
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	in.ctl_fd = ctl_fd;
+	ctl_fd = -1; // in owns it now
+	atomic_store(&inputs_open, input_stdin_flag || in.ctl_fd >= 0);
+	atomic_store(&cmds_pending, dev_count);
+	exit_code = 0;
+	for (unsigned i=0; i<dev_count; i++) {
+		atomic_store(&devs[i]->running, true);
+		atomic_fetch_add(&devs_running, 1);
+		if (pthread_create(&devs[i]->thread, NULL, dev_thread, devs[i]) != 0) {
+			perror("pthread_create");
+			atomic_store(&devs[i]->running, false);
+			atomic_fetch_sub(&devs_running, 1);
+			atomic_fetch_sub(&cmds_pending, 1);
+			caught_stop = true;
 			break;
 		}
-		int in_len = strnlen(stdin_buf, MY_STDIN_BUF_SZ);
-
-		// Hack: For terminal input, if last char is a newline, replace with null
-		// This is mostly for JSON testing. Use UDP socket mode if you are doing anything else.
-		// The JSON strings are expected to be null terminated.
-		if (stdin_buf[in_len-1] == '\n')
-			stdin_buf[in_len-1] = '\0';
-
-		send_data_frame(stdin_buf, in_len, buf, BUF_SZ, fd);
+		threads++;
 	}
 
-	// Main RX loop
-	while(listen_flag && !caught_stop) {
-		ssize_t ret = read(fd, buf, BUF_SZ);
-		int decode_ret;
-		bool go = false;
-		int i=0;
-
-		if (caught_stop) break;
-		if (ret < 0 ) {
-			perror("Serial device read error");
+	while (!caught_stop && atomic_load(&devs_running) > 0) {
+		bool poll_stdin;
+		if (!in.started && atomic_load(&cmds_pending) == 0) inputs_start(&in);
+		inputs_pause(&in);
+		poll_stdin = in.stdin_open && in.stdin_poll && !in.paused;
+		if (ev_run_once(&in.loop, poll_stdin ? 0 : -1) < 0) {
+			perror("epoll_wait");
 			break;
 		}
-
-		do {
-			decode_ret = serial_frame_decode(&buf[i], ret-i, &f);
-			if (decode_ret < 0) { fprintf(stderr,"DECODE ERROR\r\n"); break; }
-			i += decode_ret;
-			go = parse_frame(&f, &status);
-		} while (go);
+		if (poll_stdin) on_stdin(&in, EPOLLIN);
+		if (in.started && !in.stdin_open && in.ctl_fd < 0 && atomic_load(&inputs_open)) {
+			atomic_store(&inputs_open, false); // Nothing more to send, devices can finish up
+			wake_devs();
+		}
 	}
-
-	// uint8_t test_buf[1024];
-	// int test_ret = serial_frame_encode(NULL, 0, sizeof(test_buf), test_buf, DEST_H7, FRAME_TYPE_BOOTLOADER_BIN);
-	// MY_PRINTF("TEST BUFFER SIZE: %d\r\n", test_ret);
-	// write(fd, test_buf, test_ret);
-	// sleep(1);
+	caught_stop = true;
+	wake_devs();
+	for (unsigned i=0; i<threads; i++) pthread_join(devs[i]->thread, NULL);
+	if (metrics_path) write_metrics(); // Final counts
 
 out:
-	MY_PRINTF("\r\nDone!\r\n");
-	MY_PRINTF("Got %u frames\r\n", status.frame_count);
-	MY_PRINTF("%u debug bytes\r\n", status.debug_bytes_written);
-	MY_PRINTF("%u data bytes\r\n", status.data_bytes_written);
-	MY_PRINTF("%u audio bytes\r\n", status.audio_bytes_written);
-
-	if (f.buf != NULL)
-		free(f.buf); // Leftover from unfinished frame
-
-	if (fd >= 0) close(fd);
-	if (status.tx_socket_fd > 0) close(status.tx_socket_fd);
-	COND_FCLOSE(status.audio_file);
-	COND_FCLOSE(status.data_file);
-	COND_FCLOSE(status.data_and_debug_file);
-	COND_FCLOSE(prog_bin_file);
+	for (unsigned i=0; i<dev_count; i++) {
+		mel_status_t *status;
+		if (devs[i] == NULL) continue;
+		status = &devs[i]->status;
+		if (multi_dev_flag) {
+			DEV_PRINTF(status, "%u frames, %u debug, %u data, %u audio bytes, %u audio CRC errors\r\n",
+				status->frame_count, status->debug_bytes_written, status->data_bytes_written, status->audio_bytes_written, status->audio_crc_errors);
+		}
+		if (status->udp != NULL) {
+			DEV_PRINTF(status, "UDP %" PRIu64 " datagrams sent, %" PRIu64 " failed\r\n", status->udp->sent, status->udp->errors);
+		}
+		if (status->shm != NULL && status->shm->hdr != NULL) {
+			DEV_PRINTF(status, "shm %s: %" PRIu64 " records, %" PRIu64 " too big\r\n", status->shm->name,
+				atomic_load(&status->shm->hdr->records), atomic_load(&status->shm->hdr->drops));
+		}
+		if (devs[i]->clock.valid) {
+			DEV_PRINTF(status, "Clock offset %.0f us, drift %+.2f ppm, %u resets\r\n",
+				devs[i]->clock.offset_us, devs[i]->clock.skew * 1e6, devs[i]->clock.resets);
+		}
+		DEV_PRINTF(status, "Sink ring high water %zu of %zu bytes, %u frames dropped\r\n",
+			atomic_load(&devs[i]->sink_ring.high_water), devs[i]->sink_ring.size, atomic_load(&devs[i]->sink_ring.drops));
+		total.frame_count += status->frame_count;
+		total.debug_bytes_written += status->debug_bytes_written;
+		total.data_bytes_written += status->data_bytes_written;
+		total.audio_bytes_written += status->audio_bytes_written;
+		total.audio_crc_errors += status->audio_crc_errors;
+		if (devs[i]->failed || !devs[i]->cmds_done) exit_code = 1; // Scripts check, e.g. a verify mismatch
+		dev_close(devs[i]);
+	}
 
-	return 0;
+	MY_PRINTF("\r\nDone!\r\n");
+	MY_PRINTF("Got %u frames\r\n", total.frame_count);
+	MY_PRINTF("%u debug bytes\r\n", total.debug_bytes_written);
+	MY_PRINTF("%u data bytes\r\n", total.data_bytes_written);
+	MY_PRINTF("%u audio bytes\r\n", total.audio_bytes_written);
+	if (total.audio_crc_errors) MY_PRINTF("%u audio frames failed their CRC\r\n", total.audio_crc_errors);
+
+	ev_close(&in.loop);
+	if (main_wake >= 0) close(main_wake);
+	if (ctl_fd >= 0) close(ctl_fd);
+	if (in.ctl_fd >= 0) close(in.ctl_fd);
+
+	return exit_code;
 }
@@ -10,4 +10,17 @@ enum {
 	DATA_FILE_OPT		=133,
 	BOTH_FILE_OPT		=134,
 	UDP_OPT				=135,
+	CONTROL_OPT			=136,
+	AUDIO_WAV_OPT		=137,
+	AUDIO_RATE_OPT		=138,
+	AUDIO_BITS_OPT		=139,
+	AUDIO_CHANNELS_OPT	=140,
+	AUDIO_ROTATE_SEC_OPT=141,
+	AUDIO_ROTATE_MB_OPT	=142,
+	UDP_DEST_OPT		=143,
+	SHM_OPT				=144,
+	SHM_MB_OPT			=145,
+	METRICS_FILE_OPT	=146,
+	METRICS_SEC_OPT		=147,
+	PROG_WINDOW_OPT		=148,
 };
@@ -0,0 +1,136 @@
+/*
+mel_cat: prints or extracts master_mel binary records (--binary, mel_record.h)
+
+	mel_cat capture.bin                     one line per record
+	mel_cat --type 1 --payload data.bin     just the data strings, as the text file would have them (not the damaged ones)
+	mel_cat --index capture.bin             file offset of every record, for seeking
+	mel_cat --udp 61393                     records arriving on a UDP port
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "serial_frame.h"
+#include "mel_record.h"
+
+#include "my_socket.c"
+
+static uint32_t types = 0xFFFFFFFFu;	// Bit per FRAME_TYPE_* to show
+static int payload_flag;
+static int index_flag;
+
+static const char *kind_name[] = { "frame", "piece", "end", "pad" };
+static uint64_t damaged;	// CRC_ERROR records left out of --payload
+
+static void show(const mel_rec_t *hdr, const uint8_t *buf, uint32_t have, uint64_t pos) {
+	if (hdr->kind == MEL_REC_PAD || hdr->type >= 32 || !(types & (1u << hdr->type))) return;
+	if (payload_flag) {
+		// A streamed frame's pieces come before the END record that says whether it passed, those go out as they are
+		if (hdr->flags & CRC_ERROR) damaged++;
+		else fwrite(buf, 1, have, stdout);
+		return;
+	}
+	if (index_flag) printf("@%" PRIu64 " ", pos);
+	printf("%" PRIu32 " dev %u type %u %s dest %u len %" PRIu32 " off %" PRIu32 " crc %08" PRIx32 " flags %02x%s dev_us %" PRIu64 " host_us %" PRIu64 " est_us %" PRIu64,
+		hdr->seq, hdr->dev, hdr->type, kind_name[hdr->kind], hdr->dest, hdr->len, hdr->offset, hdr->crc32,
+		hdr->flags, hdr->flags & CRC_ERROR ? " CRC_ERROR" : "", hdr->dev_us, hdr->host_us, hdr->est_us);
+	if (hdr->kind == MEL_REC_FRAME && hdr->type != FRAME_TYPE_BIN_AUDIO) {
+		while (have && (buf[have-1] == '\0' || buf[have-1] == '\n')) have--;
+		printf(": %.*s", (int)have, (const char *)buf);
+	}
+	printf("\n");
+}
+
+static int cat_file(const char *path, uint8_t *buf, uint32_t cap) {
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+	uint64_t skipped = 0, count = 0;
+	uint64_t pos = 0; // Counted from what was read, ftell() has nothing to say on a pipe
+	mel_rec_t hdr;
+	int ret;
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (1) {
+		uint64_t was_skipped = skipped;
+		if ((ret = mel_rec_read(f, &hdr, buf, cap, &skipped)) <= 0) break;
+		pos += skipped - was_skipped; // Damaged bytes came before this record
+		show(&hdr, buf, hdr.len < cap ? hdr.len : cap, pos);
+		pos += sizeof(hdr) + hdr.len;
+		count++;
+	}
+	if (ret < 0) fprintf(stderr, "%s: cut off after %" PRIu64 " records\n", path, count);
+	if (skipped) fprintf(stderr, "%s: skipped %" PRIu64 " damaged bytes\n", path, skipped);
+	if (damaged) fprintf(stderr, "%s: left out %" PRIu64 " records that failed their CRC\n", path, damaged);
+	damaged = 0;
+	if (f != stdin) fclose(f);
+	return 0;
+}
+
+static int cat_udp(uint16_t port, uint8_t *buf, uint32_t cap) {
+	int fd = my_socket();
+	if (fd < 0 || my_bind_socket(fd, port) < 0) return -1;
+	while (1) {
+		mel_rec_t hdr;
+		const uint8_t *payload;
+		ssize_t n = recv(fd, buf, cap, 0);
+		if (n < 0) {
+			perror("recv");
+			return -1;
+		}
+		payload = mel_rec_parse(buf, n, &hdr);
+		if (payload == NULL) {
+			fprintf(stderr, "Not a record (%zd bytes), is master_mel running with --binary?\n", n);
+			continue;
+		}
+		show(&hdr, payload, hdr.len, 0);
+		fflush(stdout);
+	}
+}
+
+int main(int argc, char **argv) {
+	static uint8_t buf[FRAME_MAX_SIZE + sizeof(mel_rec_t)];
+	int udp_port = 0;
+	int ret = 0;
+
+	while (1) {
+		static struct option long_options[] = {
+			{"type", required_argument, 0, 't'},
+			{"payload", no_argument, &payload_flag, 1},
+			{"index", no_argument, &index_flag, 1},
+			{"udp", required_argument, 0, 'u'},
+			{0, 0, 0, 0}
+		};
+		int c = getopt_long(argc, argv, "t:u:", long_options, NULL);
+		if (c == -1) break;
+		switch (c) {
+			case 0: break;
+			case 't': {
+				unsigned long t = strtoul(optarg, NULL, 10);
+				if (t >= 32) {
+					fprintf(stderr, "--type is a frame type number\n");
+					return 1;
+				}
+				if (types == 0xFFFFFFFFu) types = 0;
+				types |= 1u << t;
+				break;
+			}
+			case 'u': udp_port = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [--type N]... [--payload] [--index] (--udp PORT | FILE...)\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (udp_port) return cat_udp(udp_port, buf, sizeof(buf)) < 0;
+	if (optind == argc) return cat_file("-", buf, sizeof(buf)) < 0;
+	for (int i=optind; i<argc; i++) {
+		if (cat_file(argv[i], buf, sizeof(buf)) < 0) ret = 1;
+	}
+	return ret;
+}
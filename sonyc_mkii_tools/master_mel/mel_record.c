@@ -0,0 +1,42 @@
+/*
+Binary record reader, see mel_record.h for the format
+*/
+
+#include <string.h>
+
+#include "mel_record.h"
+
+int mel_rec_valid(const mel_rec_t *hdr) {
+	return hdr->magic == MEL_REC_MAGIC && hdr->version == MEL_REC_VERSION && hdr->kind <= MEL_REC_PAD
+		&& hdr->len <= MEL_REC_MAX_LEN;
+}
+
+int mel_rec_read(FILE *f, mel_rec_t *hdr, uint8_t *buf, uint32_t cap, uint64_t *skipped) {
+	uint8_t *h = (uint8_t *)hdr;
+	size_t got = fread(hdr, 1, sizeof(*hdr), f);
+	uint32_t keep;
+
+	if (got == 0) return 0;
+	if (got < sizeof(*hdr)) return -1;
+	while (!mel_rec_valid(hdr)) { // Slide a byte at a time until a header checks out
+		int c = fgetc(f);
+		if (c == EOF) return -1;
+		memmove(h, h + 1, sizeof(*hdr) - 1);
+		h[sizeof(*hdr) - 1] = c;
+		(*skipped)++;
+	}
+
+	keep = hdr->len < cap ? hdr->len : cap;
+	if (fread(buf, 1, keep, f) != keep) return -1;
+	for (uint32_t i=keep; i<hdr->len; i++) {
+		if (fgetc(f) == EOF) return -1;
+	}
+	return 1;
+}
+
+const uint8_t * mel_rec_parse(const uint8_t *buf, size_t len, mel_rec_t *hdr) {
+	if (len < sizeof(*hdr)) return NULL;
+	memcpy(hdr, buf, sizeof(*hdr));
+	if (!mel_rec_valid(hdr) || hdr->len > len - sizeof(*hdr)) return NULL;
+	return buf + sizeof(*hdr);
+}
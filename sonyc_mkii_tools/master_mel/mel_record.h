@@ -0,0 +1,52 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Binary record master_mel writes with --binary (files, UDP) and always into
+// the --shm ring: this header, then len payload bytes. Little endian, no
+// padding, offsets are fixed for readers in other languages (mkiiread/records.py).
+// Files are just records back to back, a record can be skipped without parsing
+// the payload, and the magic lets a reader find the next one after damage.
+
+#define MEL_REC_MAGIC	0x4C4D		// "ML"
+#define MEL_REC_VERSION	2			// 2: est_us
+#define MEL_REC_MAX_LEN	(1u << 24)	// Nothing master_mel writes comes near, a longer record is damage
+
+enum {
+	MEL_REC_FRAME,		// A whole frame
+	MEL_REC_PIECE,		// Part of a frame too big to decode whole, at offset
+	MEL_REC_END,		// Closes a streamed frame: no payload, offset is its total size, times and CRC are the frame's
+	MEL_REC_PAD,		// --shm only: filler before the end of the ring
+};
+
+typedef struct {
+	uint16_t magic;		// MEL_REC_MAGIC
+	uint8_t version;	// MEL_REC_VERSION
+	uint8_t kind;		// MEL_REC_*
+	uint8_t type;		// FRAME_TYPE_*
+	uint8_t dest;		// Frame destination (DEST_*)
+	uint8_t dev;		// Source device, the order it was given in on the command line
+	uint8_t flags;		// Decoder frame_flag_t
+	uint32_t len;		// Payload bytes
+	uint32_t seq;		// Per device record count, across all types. Filtered or lost records leave gaps.
+	uint32_t offset;	// MEL_REC_PIECE: position in the frame. MEL_REC_END: frame size.
+	uint32_t crc32;		// As received, 0 on pieces
+	uint64_t dev_us;	// Device timestamp, 0 on pieces
+	uint64_t host_us;	// Host arrival, wall clock: when the read() that finished it returned
+	uint64_t est_us;	// When it was sent, dev_us mapped to wall clock (clock_est.h). 0 on pieces or before an estimate.
+} mel_rec_t;
+
+_Static_assert(sizeof(mel_rec_t) == 48, "record header layout is fixed");
+
+// Checks magic, version and that the rest is plausible
+int mel_rec_valid(const mel_rec_t *hdr);
+
+// Next record from a stream, pipes included. Payload goes to buf, anything past
+// cap is skipped. Damaged bytes before the record are passed over and counted in
+// *skipped. Returns 1, 0 at end of file, -1 if the file ends mid record.
+int mel_rec_read(FILE *f, mel_rec_t *hdr, uint8_t *buf, uint32_t cap, uint64_t *skipped);
+
+// A record held in memory, e.g. a UDP datagram. Returns the payload, NULL if
+// the buffer doesn't hold a valid record.
+const uint8_t * mel_rec_parse(const uint8_t *buf, size_t len, mel_rec_t *hdr);
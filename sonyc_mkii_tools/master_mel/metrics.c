@@ -0,0 +1,161 @@
+/*
+Prometheus text exposition of the per-device counters, see metrics.h
+
+Meant for node_exporter's textfile collector or anything else that scrapes a
+file. Families are written once each with every device under them, as the
+format wants. Times go out in seconds, histogram bounds are powers of 2.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "metrics.h"
+#include "serial_frame.h"
+
+static const char *type_names[METRICS_TYPES + 1] = {
+	[FRAME_TYPE_DEBUG_STRING] = "debug",
+	[FRAME_TYPE_DATA_STRING] = "data",
+	[FRAME_TYPE_BOOTLOADER_BIN] = "bootloader",
+	[FRAME_TYPE_H7_PROTOBUF] = "h7_protobuf",
+	[FRAME_TYPE_BASE_PROTOBUF] = "base_protobuf",
+	[FRAME_TYPE_F1_PROTOBUF] = "f1_protobuf",
+	[FRAME_TYPE_BIN_AUDIO] = "audio",
+	[FRAME_TYPE_ACK] = "ack",
+	[FRAME_TYPE_NACK] = "nack",
+	[FRAME_TYPE_HELLO] = "hello",
+	[FRAME_TYPE_DEBUG_STRING_BMS] = "bms",
+	[FRAME_TYPE_BMS_STATS_v7] = "bms_stats",
+	[METRICS_TYPES] = "other",
+};
+
+static const char *type_name(unsigned t, char *buf, size_t sz) {
+	if (type_names[t]) return type_names[t];
+	snprintf(buf, sz, "%u", t);
+	return buf;
+}
+
+static uint64_t load(const _Atomic uint64_t *c) {
+	return atomic_load_explicit((_Atomic uint64_t *)c, memory_order_relaxed);
+}
+
+static void family(FILE *f, const char *name, const char *type, const char *help) {
+	fprintf(f, "# HELP master_mel_%s %s\n# TYPE master_mel_%s %s\n", name, help, name, type);
+}
+
+// One sample per device of the uint64_t at off in metrics_t
+static void per_dev(FILE *f, const char *name, const char *type, const char *help,
+		const metrics_dev_t *devs, unsigned count, size_t off) {
+	family(f, name, type, help);
+	for (unsigned i=0; i<count; i++)
+		fprintf(f, "master_mel_%s{dev=\"%s\"} %llu\n", name, devs[i].name,
+			(unsigned long long)load((const _Atomic uint64_t *)((const uint8_t *)devs[i].m + off)));
+}
+
+// Same for the per type arrays, types never seen are left out
+static void per_type(FILE *f, const char *name, const char *help,
+		const metrics_dev_t *devs, unsigned count, size_t off) {
+	char buf[12];
+	family(f, name, "counter", help);
+	for (unsigned i=0; i<count; i++) {
+		const _Atomic uint64_t *c = (const _Atomic uint64_t *)((const uint8_t *)devs[i].m + off);
+		for (unsigned t=0; t<=METRICS_TYPES; t++) {
+			uint64_t v = load(&c[t]);
+			if (v) fprintf(f, "master_mel_%s{dev=\"%s\",type=\"%s\"} %llu\n", name, devs[i].name,
+				type_name(t, buf, sizeof(buf)), (unsigned long long)v);
+		}
+	}
+}
+
+// Buckets are kept apart and summed here, scale turns the unit into the exported one
+static void hist(FILE *f, const char *name, const char *labels, const metrics_hist_t *h, double scale) {
+	uint64_t cum = 0;
+	for (unsigned i=0; i<METRICS_BUCKETS; i++) {
+		cum += load(&h->bucket[i]);
+		if (i < METRICS_BUCKETS - 1)
+			fprintf(f, "master_mel_%s_bucket{%s,le=\"%.9g\"} %llu\n", name, labels, (double)(1ull << i) * scale, (unsigned long long)cum);
+		else
+			fprintf(f, "master_mel_%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)cum);
+	}
+	fprintf(f, "master_mel_%s_sum{%s} %.9g\n", name, labels, (double)load(&h->sum) * scale);
+	fprintf(f, "master_mel_%s_count{%s} %llu\n", name, labels, (unsigned long long)load(&h->count));
+}
+
+static void write_all(FILE *f, const metrics_dev_t *devs, unsigned count) {
+	char labels[128], buf[12];
+
+	per_type(f, "frames_total", "Frames decoded, CRC failures included", devs, count, offsetof(metrics_t, frames));
+	per_type(f, "frame_bytes_total", "Frame payload bytes decoded", devs, count, offsetof(metrics_t, bytes));
+	per_dev(f, "crc_errors_total", "counter", "Frames that failed their CRC", devs, count, offsetof(metrics_t, crc_errors));
+	per_dev(f, "decode_errors_total", "counter", "Decoder errors, the rest of that read was dropped", devs, count, offsetof(metrics_t, decode_errors));
+	per_dev(f, "malformed_frames_total", "counter", "Frames too short for their header (MALFORM), counted in decode errors too", devs, count, offsetof(metrics_t, malformed));
+	per_dev(f, "aborted_frames_total", "counter", "Partial frames dropped to resync", devs, count, offsetof(metrics_t, aborted));
+	per_dev(f, "skipped_bytes_total", "counter", "Bytes outside any frame", devs, count, offsetof(metrics_t, skipped));
+	per_dev(f, "oversize_frames_total", "counter", "Non-audio frames too big to decode, dropped", devs, count, offsetof(metrics_t, oversize));
+
+	family(f, "last_frame_timestamp_seconds", "gauge", "Arrival of the last good frame, Unix time");
+	for (unsigned i=0; i<count; i++)
+		fprintf(f, "master_mel_last_frame_timestamp_seconds{dev=\"%s\"} %.6f\n", devs[i].name, load(&devs[i].m->last_frame_us) * 1e-6);
+
+	family(f, "sink_queue_bytes", "gauge", "Bytes waiting in the sink ring");
+	for (unsigned i=0; i<count; i++) {
+		size_t tail = atomic_load(&devs[i].ring->tail); // First, it can only catch up with head
+		size_t head = atomic_load(&devs[i].ring->head);
+		fprintf(f, "master_mel_sink_queue_bytes{dev=\"%s\"} %zu\n", devs[i].name, head - tail);
+	}
+	family(f, "sink_queue_high_water_bytes", "gauge", "Most bytes ever waiting in the sink ring");
+	for (unsigned i=0; i<count; i++)
+		fprintf(f, "master_mel_sink_queue_high_water_bytes{dev=\"%s\"} %zu\n", devs[i].name, atomic_load(&devs[i].ring->high_water));
+	family(f, "sink_queue_size_bytes", "gauge", "Sink ring size");
+	for (unsigned i=0; i<count; i++)
+		fprintf(f, "master_mel_sink_queue_size_bytes{dev=\"%s\"} %zu\n", devs[i].name, devs[i].ring->size);
+	family(f, "sink_dropped_total", "counter", "Frames dropped because the sink ring was full");
+	for (unsigned i=0; i<count; i++)
+		fprintf(f, "master_mel_sink_dropped_total{dev=\"%s\"} %u\n", devs[i].name, atomic_load(&devs[i].ring->drops));
+
+	family(f, "read_size_bytes", "histogram", "Bytes per serial read");
+	for (unsigned i=0; i<count; i++) {
+		snprintf(labels, sizeof(labels), "dev=\"%s\"", devs[i].name);
+		hist(f, "read_size_bytes", labels, &devs[i].m->read_size, 1);
+	}
+	family(f, "link_delay_seconds", "histogram", "Frame arrival minus estimated send time, the link delay above its minimum");
+	for (unsigned i=0; i<count; i++) {
+		snprintf(labels, sizeof(labels), "dev=\"%s\"", devs[i].name);
+		hist(f, "link_delay_seconds", labels, &devs[i].m->link_delay, 1e-6);
+	}
+	family(f, "handler_seconds", "histogram", "Sink thread time per record, by frame type");
+	for (unsigned i=0; i<count; i++) {
+		for (unsigned t=0; t<=METRICS_TYPES; t++) {
+			if (load(&devs[i].m->handler[t].count) == 0) continue;
+			snprintf(labels, sizeof(labels), "dev=\"%s\",type=\"%s\"", devs[i].name, type_name(t, buf, sizeof(buf)));
+			hist(f, "handler_seconds", labels, &devs[i].m->handler[t], 1e-6);
+		}
+	}
+}
+
+int metrics_write_file(const char *path, const metrics_dev_t *devs, unsigned count) {
+	char tmp[4096];
+	FILE *f;
+	int err;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return -1;
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		fprintf(stderr, "metrics %s: %s\r\n", tmp, strerror(errno));
+		return -1;
+	}
+	write_all(f, devs, count);
+	err = ferror(f);
+	if (fclose(f) != 0 || err) {
+		fprintf(stderr, "metrics %s: write failed\r\n", tmp);
+		remove(tmp);
+		return -1;
+	}
+	if (rename(tmp, path) < 0) {
+		fprintf(stderr, "metrics %s: %s\r\n", path, strerror(errno));
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
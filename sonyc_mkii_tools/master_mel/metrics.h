@@ -0,0 +1,63 @@
+#pragma once
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "spsc_ring.h"
+
+// Live counters for one device, exported as a Prometheus text file (--metrics-file).
+// Each field has a single writer thread, so an update is a relaxed load and
+// store, no locked instruction on the ingest path. The main thread reads them
+// whole, though not all from the same instant.
+
+#define METRICS_TYPES		16	// Frame types counted one by one, the rest go in the last slot
+#define METRICS_BUCKETS		24	// Histogram bounds 1, 2, 4 .. 2^22, then +Inf
+
+typedef struct {
+	_Atomic uint64_t bucket[METRICS_BUCKETS];	// Values up to 2^i, not cumulative
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;
+} metrics_hist_t;
+
+typedef struct {
+	// Ingest thread
+	_Atomic uint64_t frames[METRICS_TYPES + 1];	// By frame type, CRC failures included
+	_Atomic uint64_t bytes[METRICS_TYPES + 1];	// Payload
+	_Atomic uint64_t crc_errors;
+	_Atomic uint64_t decode_errors;		// sf_decode() failed, rest of the read dropped
+	_Atomic uint64_t malformed;			// Of those, frames too short to hold the header
+	_Atomic uint64_t aborted;			// Partial frames tossed to resync
+	_Atomic uint64_t skipped;			// Bytes between frames
+	_Atomic uint64_t oversize;			// Too big to decode whole and not audio, dropped
+	_Atomic uint64_t last_frame_us;		// Wall clock arrival of the last good frame
+	metrics_hist_t read_size;			// Bytes per read()
+	metrics_hist_t link_delay;			// us, arrival - estimated send time: delay above the link's minimum
+
+	// Sink thread, only timed with --metrics-file
+	metrics_hist_t handler[METRICS_TYPES + 1];	// us per record in sink_frame(), by frame type
+} metrics_t;
+
+// One device in the file
+typedef struct {
+	const char *name;
+	const metrics_t *m;
+	const spsc_ring_t *ring;	// Sink queue
+} metrics_dev_t;
+
+static inline void metrics_add(_Atomic uint64_t *c, uint64_t n) {
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline unsigned metrics_type(uint32_t type) {
+	return type < METRICS_TYPES ? type : METRICS_TYPES;
+}
+
+static inline void metrics_observe(metrics_hist_t *h, uint64_t v) {
+	unsigned i = v <= 1 ? 0 : 64 - __builtin_clzll(v - 1); // Smallest power of 2 >= v
+	metrics_add(&h->bucket[i < METRICS_BUCKETS ? i : METRICS_BUCKETS - 1], 1);
+	metrics_add(&h->count, 1);
+	metrics_add(&h->sum, v);
+}
+
+// Writes every device to path, through a temporary file and rename() so a
+// collector never reads half of it. Returns 0 or -1.
+int metrics_write_file(const char *path, const metrics_dev_t *devs, unsigned count);
@@ -16,8 +16,7 @@ static int my_socket(void) {
 	return fd;
 }
 
-static int my_bind_socket(int fd, short int port) __attribute__ ((unused));
-static int my_bind_socket(int fd, short int port) {
+static int my_bind_socket(int fd, uint16_t port) {
 	struct sockaddr_in myaddr;
 	memset((char *)&myaddr, 0, sizeof(myaddr));
 	myaddr.sin_family = AF_INET;
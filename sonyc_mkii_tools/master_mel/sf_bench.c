@@ -0,0 +1,353 @@
+/*
+Host side micro-benchmark for the frame codecs
+
+Build with 'make bench', runs ./sf_bench (HDLC style serial_frame.c),
+./sf_bench --cobs (the same codec in its COBS framing) and ./sf_bench_esp3
+(esp3_sf.c, same source built with -DBENCH_ESP3).
+Numbers are wall clock on an otherwise idle machine, take them as relative.
+
+Corpora are generated, not read from disk: N frames of a given payload size
+with a given density of bytes the codec has to treat specially (FLAG/ESC for
+HDLC, SYNC for ESP3). Decode is fed in fixed size chunks to exercise frames
+split across reads the way USB and UART deliver them.
+
+ESP3 also decodes a noisy corpus: every frame comes after a false SYNC or a
+header with a broken CRC8, and every frame still has to be found.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "serial_frame.h"
+
+#define DEFAULT_CRC_SIZE	(128*1024)
+#define DEFAULT_MIN_MS		100			// Run each case at least this long
+#define CORPUS_PAYLOAD		(1024*1024)	// Approx payload bytes per corpus
+#define CORPUS_MIN_FRAMES	16
+#define CORPUS_MAX_FRAMES	4096
+#define NOISE_MAX			ESP3_NOISE_SZ	// Junk before each frame, most a noisy corpus adds
+
+// USB FS CDC tops out around 1 MB/s in practice, this is the budget to beat
+#define LINE_RATE_BYTES_PER_SEC (1000*1000)
+
+#ifdef BENCH_ESP3
+#define CODEC_NAME		"esp3"
+#define SPECIAL_BYTE	0x55		// ESP3 SYNC, forces a header check on resync
+#define MAX_PAYLOAD		(0xFFFF - 1)
+#define ESP3_NOISE_SZ	6			// SYNC LEN(2) OPT_LEN TYPE CRC8H
+#else
+#define CODEC_NAME		"hdlc"
+#define SPECIAL_BYTE	0x7E		// FLAG, always escaped
+#define MAX_PAYLOAD		(FRAME_MAX_SIZE - SF_FRAME_OVERHEAD)
+#define ESP3_NOISE_SZ	0
+#endif
+
+typedef struct {
+	unsigned payload_sz;	// Per frame
+	unsigned nframes;
+	uint8_t *wire;			// Encoded frames back to back
+	size_t wire_sz;
+	uint8_t *payload;		// Raw payloads back to back, for encode
+	bool noisy;				// Junk in front of every frame (ESP3)
+} corpus_t;
+
+static const unsigned default_sizes[] = { 16, 256, 2048, 32768 };
+static const unsigned densities[] = { 0, 1, 100 };	// Percent special bytes
+static const unsigned chunks[] = { 1, 64, 2048 };	// 64 = USB FS packet, 2048 = H7 USB RX buffer
+
+static unsigned crc_size = DEFAULT_CRC_SIZE;
+static unsigned only_size = 0;
+static unsigned min_ms = DEFAULT_MIN_MS;
+static uint64_t n_allocs = 0;
+static const char *codec_name = CODEC_NAME;
+static uint8_t special_byte = SPECIAL_BYTE;
+
+#ifndef BENCH_ESP3
+static uint32_t framing = SF_FRAMING_HDLC;
+#define ENCODED_MAX(n)	(framing == SF_FRAMING_COBS ? SF_COBS_ENCODED_MAX(n) : SF_ENCODED_MAX(n))
+static int encode(const uint8_t *in, uint32_t len_in, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type) {
+	sf_iovec_t iov = { in, len_in };
+	return sf_encodev_framing(framing, &iov, 1, buf_max, buf, dest, pkt_type, NULL);
+}
+#else
+#define ENCODED_MAX(n)	SF_ENCODED_MAX(n)
+#define encode			serial_frame_encode
+#endif
+
+void * serial_frame_malloc(size_t size) {
+	n_allocs++;
+	return malloc(size);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report_frames(const char *op, const corpus_t *c, unsigned density, unsigned chunk,
+		uint64_t bytes, uint64_t frames, uint64_t allocs, uint64_t ns) {
+	char chunk_str[16] = "-";
+	double mbps = (double)bytes / ((double)ns / 1e9) / 1e6;
+	if (chunk) snprintf(chunk_str, sizeof(chunk_str), "%u", chunk);
+	printf("%-4s %-11s %6u %4u%% %6s %10.1f MB/s %10.0f ns/frame %6.2f allocs/frame\n",
+		codec_name, op, c->payload_sz, density, chunk_str, mbps,
+		(double)ns / frames, (double)allocs / frames);
+}
+
+#ifndef BENCH_ESP3
+static void report(const char *name, uint64_t bytes, uint64_t iters, uint64_t ns) {
+	double mbps = (double)bytes / ((double)ns / 1e9) / 1e6;
+	printf("%-32s %10.1f MB/s %12.0f ns/op %8.3f%% CPU at line rate\n",
+		name, mbps, (double)ns / iters, 100.0 * LINE_RATE_BYTES_PER_SEC / (mbps * 1e6));
+}
+
+// Known answer first, a wrong-but-fast CRC is worthless
+static bool crc_self_test(void) {
+	const uint8_t check[] = "123456789";
+	uint32_t crc = sf_crc32(0, check, 9);
+	if (crc != 0xCBF43926) {
+		fprintf(stderr, "CRC32 self test FAILED: got 0x%.8X expected 0xCBF43926\n", crc);
+		return false;
+	}
+	return true;
+}
+
+static void bench_crc32(void) {
+	uint8_t *buf = malloc(crc_size);
+	uint64_t start, elapsed, iters = 0;
+	volatile uint32_t sink = 0;
+	if (buf == NULL) return;
+	for (unsigned i=0; i<crc_size; i++) buf[i] = rand();
+
+	start = now_ns();
+	do {
+		sink ^= sf_crc32(0, buf, crc_size);
+		iters++;
+		elapsed = now_ns() - start;
+	} while (elapsed < min_ms * 1000000ULL);
+
+	printf("CRC buffer %u bytes\n", crc_size);
+	report("crc32", (uint64_t)crc_size * iters, iters, elapsed);
+	free(buf);
+}
+#endif
+
+static uint8_t random_plain_byte(void) {
+	uint8_t x;
+	do { x = rand(); } while (x == special_byte || x == 0x7D); // 0x7D is HDLC ESC
+	return x;
+}
+
+#ifdef BENCH_ESP3
+// Something that looks like a frame start in front of the frame at wire,
+// alternating a lone SYNC and a copy of its header with the CRC8 broken.
+// The decoder has to slide back to the real SYNC (header_resync()) both times.
+static unsigned esp3_noise(uint8_t *out, const uint8_t *wire, unsigned k) {
+	if (k % 2 == 0) {
+		out[0] = 0x55;
+		return 1;
+	}
+	memcpy(out, wire, ESP3_NOISE_SZ);
+	out[ESP3_NOISE_SZ - 1] ^= 0xA5;
+	return ESP3_NOISE_SZ;
+}
+#endif
+
+static bool corpus_make(corpus_t *c, unsigned payload_sz, unsigned density, bool noisy) {
+	unsigned n = CORPUS_PAYLOAD / payload_sz;
+	if (n < CORPUS_MIN_FRAMES) n = CORPUS_MIN_FRAMES;
+	if (n > CORPUS_MAX_FRAMES) n = CORPUS_MAX_FRAMES;
+
+	memset(c, 0, sizeof(*c));
+	c->payload_sz = payload_sz;
+	c->nframes = n;
+	c->noisy = noisy;
+	c->payload = malloc((size_t)n * payload_sz);
+	c->wire = malloc((size_t)n * (ENCODED_MAX(payload_sz) + NOISE_MAX));
+	if (c->payload == NULL || c->wire == NULL) return false;
+
+	for (size_t i=0; i<(size_t)n * payload_sz; i++)
+		c->payload[i] = (unsigned)(rand() % 100) < density ? special_byte : random_plain_byte();
+
+	for (unsigned k=0; k<n; k++) {
+		uint8_t *at = &c->wire[c->wire_sz + (noisy ? NOISE_MAX : 0)]; // Encoded past the noise, moved down after
+		int ret = encode(&c->payload[(size_t)k * payload_sz], payload_sz,
+			ENCODED_MAX(payload_sz), at, DEST_H7, FRAME_TYPE_BIN_AUDIO);
+		if (ret < 0) return false;
+#ifdef BENCH_ESP3
+		if (noisy) {
+			uint8_t junk[NOISE_MAX];
+			unsigned junk_sz = esp3_noise(junk, at, k);
+			memmove(&c->wire[c->wire_sz + junk_sz], at, ret);
+			memcpy(&c->wire[c->wire_sz], junk, junk_sz);
+			c->wire_sz += junk_sz;
+		}
+#endif
+		c->wire_sz += ret;
+	}
+	return true;
+}
+
+static void corpus_free(corpus_t *c) {
+	free(c->payload);
+	free(c->wire);
+}
+
+static void bench_encode(const corpus_t *c, unsigned density) {
+	uint32_t out_max = ENCODED_MAX(c->payload_sz);
+	uint8_t *out = malloc(out_max);
+	uint64_t start, elapsed, frames = 0, allocs;
+	if (out == NULL) return;
+
+	allocs = n_allocs;
+	start = now_ns();
+	do {
+		for (unsigned k=0; k<c->nframes; k++)
+			encode(&c->payload[(size_t)k * c->payload_sz], c->payload_sz, out_max, out, DEST_H7, FRAME_TYPE_BIN_AUDIO);
+		frames += c->nframes;
+		elapsed = now_ns() - start;
+	} while (elapsed < min_ms * 1000000ULL);
+
+	report_frames("encode", c, density, 0, frames * c->payload_sz, frames, n_allocs - allocs, elapsed);
+	printf("%-4s %-11s %6u %4u%% %6s %10.1f %% wire overhead\n", codec_name, "wire", c->payload_sz, density, "-",
+		100.0 * ((double)c->wire_sz / ((double)c->nframes * c->payload_sz) - 1));
+	free(out);
+}
+
+// One pass over the corpus, returns frames found or -1 on a decode failure
+static int64_t decode_pass(sf_decoder_t *d, const corpus_t *c, unsigned chunk) {
+	int64_t found = 0;
+	for (size_t pos=0; pos<c->wire_sz; pos+=chunk) {
+		uint32_t len = c->wire_sz - pos < chunk ? c->wire_sz - pos : chunk;
+		uint32_t i = 0;
+		serial_frame_t f;
+		while (i < len) {
+			int ret = sf_decode(d, &c->wire[pos + i], len - i, &f);
+			if (ret < 0) return -1;
+			if (!(f.flag & FRAME_FOUND)) break;
+			if (f.flag & CRC_ERROR) return -1;
+			if (f.sz != c->payload_sz) return -1;
+			if (!(f.flag & BUF_VIEW)) free(f.buf);
+			i += ret;
+			found++;
+		}
+	}
+	return found;
+}
+
+static bool bench_decode(const corpus_t *c, unsigned density, unsigned chunk, bool view) {
+	uint32_t buf_sz = ENCODED_MAX(c->payload_sz) + 16; // Decoder needs room for the meta data too
+	uint8_t *buf = malloc(buf_sz);
+	const char *op = c->noisy ? "decode-noisy" : view ? "decode-view" : "decode";
+	uint64_t start, elapsed, frames = 0, allocs;
+	sf_decoder_t d;
+	int64_t found;
+	if (buf == NULL) return false;
+
+	sf_decoder_init(&d, buf, buf_sz);
+#ifndef BENCH_ESP3
+	sf_decoder_set_opts(&d, (view ? SF_OPT_VIEW : 0) | (framing == SF_FRAMING_COBS ? SF_OPT_COBS : 0));
+#else
+	if (view) sf_decoder_set_opts(&d, SF_OPT_VIEW);
+#endif
+
+	allocs = n_allocs;
+	start = now_ns();
+	do {
+		found = decode_pass(&d, c, chunk);
+		if (found != c->nframes) {
+			fprintf(stderr, "%s %s FAILED: size %u density %u%% chunk %u: %lld/%u frames\n",
+				codec_name, op, c->payload_sz, density, chunk, (long long)found, c->nframes);
+			free(buf);
+			return false;
+		}
+		frames += found;
+		elapsed = now_ns() - start;
+	} while (elapsed < min_ms * 1000000ULL);
+
+	report_frames(op, c, density, chunk, frames * c->payload_sz, frames, n_allocs - allocs, elapsed);
+	free(buf);
+	return true;
+}
+
+static bool bench_corpora(void) {
+	const unsigned *sizes = default_sizes;
+	unsigned nsizes = sizeof(default_sizes)/sizeof(default_sizes[0]);
+	bool ok = true;
+
+	if (only_size) { sizes = &only_size; nsizes = 1; }
+
+	printf("codec, op, payload size, %% special bytes, decode chunk size, payload throughput\n");
+	for (unsigned s=0; s<nsizes; s++) {
+		if (sizes[s] > MAX_PAYLOAD) {
+			printf("%-4s skipping size %u, codec max is %u\n", codec_name, sizes[s], (unsigned)MAX_PAYLOAD);
+			continue;
+		}
+		for (unsigned e=0; e<sizeof(densities)/sizeof(densities[0]); e++) {
+			corpus_t c;
+			if (!corpus_make(&c, sizes[s], densities[e], false)) {
+				fprintf(stderr, "Could not build corpus for size %u\n", sizes[s]);
+				corpus_free(&c);
+				return false;
+			}
+			bench_encode(&c, densities[e]);
+			for (unsigned k=0; k<sizeof(chunks)/sizeof(chunks[0]); k++)
+				ok &= bench_decode(&c, densities[e], chunks[k], true);
+			ok &= bench_decode(&c, densities[e], chunks[sizeof(chunks)/sizeof(chunks[0]) - 1], false);
+			corpus_free(&c);
+#ifdef BENCH_ESP3
+			if (!corpus_make(&c, sizes[s], densities[e], true)) {
+				fprintf(stderr, "Could not build noisy corpus for size %u\n", sizes[s]);
+				corpus_free(&c);
+				return false;
+			}
+			for (unsigned k=0; k<sizeof(chunks)/sizeof(chunks[0]); k++)
+				ok &= bench_decode(&c, densities[e], chunks[k], true);
+			corpus_free(&c);
+#endif
+		}
+	}
+	return ok;
+}
+
+static void usage(const char *me) {
+	fprintf(stderr, "Usage: %s [--size payload_bytes] [--crc-size bytes] [--min-ms ms] [--cobs]\n", me);
+}
+
+int main(int argc, char **argv) {
+	static struct option long_options[] = {
+		{"size",     required_argument, 0, 's'},
+		{"crc-size", required_argument, 0, 'c'},
+		{"min-ms",   required_argument, 0, 'm'},
+		{"cobs",     no_argument,       0, 'o'},
+		{0, 0, 0, 0}
+	};
+
+	while (1) {
+		int c = getopt_long(argc, argv, "s:c:m:", long_options, NULL);
+		if (c == -1) break;
+		switch (c) {
+			case 's': only_size = strtoul(optarg, NULL, 0); break;
+			case 'c': crc_size = strtoul(optarg, NULL, 0); break;
+			case 'm': min_ms = strtoul(optarg, NULL, 0); break;
+#ifndef BENCH_ESP3
+			case 'o': framing = SF_FRAMING_COBS; codec_name = "cobs"; special_byte = 0x00; break;
+#endif
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (crc_size == 0) { usage(argv[0]); return 1; }
+
+	srand(1);
+#ifndef BENCH_ESP3
+	if (!crc_self_test()) return 1;
+	bench_crc32();
+#endif
+	return bench_corpora() ? 0 : 1;
+}
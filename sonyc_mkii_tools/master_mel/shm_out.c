@@ -0,0 +1,144 @@
+/*
+Shared memory output stage for master_mel
+
+One writer (the device's sink thread), any number of readers in other
+processes, none of which the writer knows about or waits for. head and tail
+are free running byte positions. Before the writer reuses bytes it moves
+tail past the records they hold, then fences, then writes, then publishes
+head with release. A reader copies or parses a record, fences, and reloads
+tail: if tail has passed the record, it was overwritten while being read.
+Readers block with FUTEX_WAIT on the futex word, the writer bumps it and
+wakes them once per sink pass rather than per record.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_out.h"
+
+#define SHM_RECSZ(len) (((size_t)sizeof(mel_rec_t) + (len) + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1))
+
+_Static_assert(offsetof(shm_hdr_t, head) == 64, "readers hard code the header layout");
+_Static_assert(sizeof(shm_hdr_t) <= SHM_HDR_SZ, "header must fit before the data");
+
+int shm_out_open(shm_out_t *s, const char *name, unsigned size_mb) {
+	size_t size = 1024*1024;
+	struct timespec ts;
+	int fd;
+
+	memset(s, 0, sizeof(*s));
+	snprintf(s->name, sizeof(s->name), "%s%s", name[0] == '/' ? "" : "/", name);
+	while (size < (size_t)size_mb * 1024 * 1024) size <<= 1;
+
+	fd = shm_open(s->name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "shm %s: %s\r\n", s->name, strerror(errno));
+		return -1;
+	}
+	s->map_size = SHM_HDR_SZ + size;
+	if (ftruncate(fd, s->map_size) < 0) {
+		fprintf(stderr, "shm %s: %s\r\n", s->name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	s->hdr = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // The mapping keeps it
+	if (s->hdr == MAP_FAILED) {
+		fprintf(stderr, "shm %s: %s\r\n", s->name, strerror(errno));
+		s->hdr = NULL;
+		return -1;
+	}
+	s->data = (uint8_t *)s->hdr + SHM_HDR_SZ;
+
+	// A reader still mapped from a previous run sees the epoch change and starts over
+	clock_gettime(CLOCK_REALTIME, &ts);
+	s->hdr->magic = 0;
+	atomic_thread_fence(memory_order_release);
+	s->hdr->version = SHM_VERSION;
+	s->hdr->hdr_size = SHM_HDR_SZ;
+	s->hdr->align = SHM_ALIGN;
+	s->hdr->size = size;
+	s->hdr->epoch = (uint32_t)(ts.tv_sec ^ ts.tv_nsec ^ getpid());
+	atomic_store(&s->hdr->tail, 0);
+	atomic_store(&s->hdr->head, 0);
+	atomic_store(&s->hdr->records, 0);
+	atomic_store(&s->hdr->drops, 0);
+	atomic_store(&s->hdr->writer_pid, (uint32_t)getpid());
+	atomic_thread_fence(memory_order_release);
+	s->hdr->magic = SHM_MAGIC;
+	return 0;
+}
+
+void shm_out_close(shm_out_t *s) {
+	if (s->hdr == NULL) return;
+	shm_out_wake(s);
+	atomic_store(&s->hdr->writer_pid, 0);
+	syscall(SYS_futex, &s->hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0); // Let blocked readers see it
+	munmap(s->hdr, s->map_size);
+	s->hdr = NULL;
+}
+
+// Moves tail past every record that ends up overlapped by bytes up to end
+static void make_room(shm_out_t *s, uint64_t end) {
+	uint64_t size = s->hdr->size;
+	if (end - s->tail <= size) return;
+	while (end - s->tail > size) {
+		size_t pos = s->tail & (size - 1);
+		const mel_rec_t *old = (const mel_rec_t *)&s->data[pos];
+		if (size - pos < sizeof(*old)) s->tail += size - pos; // Unused tail end
+		else s->tail += SHM_RECSZ(old->len);
+	}
+	atomic_store_explicit(&s->hdr->tail, s->tail, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release); // Readers see the new tail before any overwritten byte
+}
+
+void shm_out_write(shm_out_t *s, const mel_rec_t *hdr, const uint8_t *buf) {
+	uint64_t size = s->hdr->size;
+	size_t need = SHM_RECSZ(hdr->len);
+	size_t pos = s->head & (size - 1);
+	size_t skip = (size - pos < need) ? size - pos : 0; // Filler to the end first
+	mel_rec_t *rec;
+
+	if (need > size / 4) { // Would evict most of what readers haven't got to yet
+		atomic_fetch_add_explicit(&s->hdr->drops, 1, memory_order_relaxed);
+		return;
+	}
+	make_room(s, s->head + skip + need);
+	if (skip) {
+		if (skip >= sizeof(*rec)) {
+			rec = (mel_rec_t *)&s->data[pos];
+			memset(rec, 0, sizeof(*rec));
+			rec->magic = MEL_REC_MAGIC;
+			rec->version = MEL_REC_VERSION;
+			rec->kind = MEL_REC_PAD;
+			rec->len = skip - sizeof(*rec);
+		}
+		s->head += skip;
+		pos = 0;
+	}
+
+	rec = (mel_rec_t *)&s->data[pos];
+	*rec = *hdr;
+	if (hdr->len) memcpy(rec + 1, buf, hdr->len);
+	s->head += need;
+	atomic_store_explicit(&s->hdr->head, s->head, memory_order_release);
+	atomic_fetch_add_explicit(&s->hdr->records, 1, memory_order_relaxed);
+	s->published = 1;
+}
+
+void shm_out_wake(shm_out_t *s) {
+	if (!s->published) return;
+	s->published = 0;
+	atomic_fetch_add_explicit(&s->hdr->futex, 1, memory_order_release);
+	syscall(SYS_futex, &s->hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
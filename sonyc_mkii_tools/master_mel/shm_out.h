@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "mel_record.h"
+
+// Shared memory frame ring for consumers on the same host, /dev/shm/<name>.
+// Records are mel_rec_t headers and payload, 8 byte aligned. Fewer bytes than
+// a header before the end of the data are left unused, more get a MEL_REC_PAD
+// record, either way the next record is at the start.
+// The writer never waits. A reader that falls behind finds its records
+// overwritten, sees that from tail and the record sequence numbers, and
+// counts what it missed. mkiiread/shm.py is the Python reader.
+
+#define SHM_MAGIC		0x4853454Du	// "MESH" little endian
+#define SHM_VERSION		3			// 2: mel_rec_t records, 3: mel_rec_t v2
+#define SHM_HDR_SZ		4096		// Data starts a page in
+#define SHM_ALIGN		8
+#define SHM_DEFAULT_MB	8
+
+// Region header. Offsets are fixed, readers in other languages use them.
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t hdr_size;			// SHM_HDR_SZ
+	uint32_t align;				// SHM_ALIGN, records are mel_rec_t
+	uint64_t size;				// Data bytes, a power of 2
+	uint32_t epoch;				// New every time a writer sets the region up, readers start over when it changes
+	uint32_t reserved0;
+	uint8_t pad0[32];
+
+	// Writer updated, own cache line. Free running byte positions, masked into the data on use.
+	_Atomic uint64_t head;		// Records below this are complete
+	_Atomic uint64_t tail;		// Oldest record not overwritten yet, moved before the bytes are reused
+	_Atomic uint32_t futex;		// Bumped after a batch is published, FUTEX_WAIT on it
+	_Atomic uint32_t writer_pid;	// 0 once the writer has closed
+	_Atomic uint64_t records;
+	_Atomic uint64_t drops;		// Frames too big for the ring
+} shm_hdr_t;
+
+typedef struct {
+	char name[64];
+	shm_hdr_t *hdr;
+	uint8_t *data;
+	size_t map_size;
+	uint64_t head;				// Writer's copy
+	uint64_t tail;
+	int published;				// Since the last wake
+} shm_out_t;
+
+// Creates or takes over /dev/shm/<name>, size_mb rounded up to a power of 2. Returns 0 or -1.
+int shm_out_open(shm_out_t *s, const char *name, unsigned size_mb);
+
+// Leaves the region in place so readers can drain it, the next writer reuses it
+void shm_out_close(shm_out_t *s);
+
+// Appends and publishes a record of hdr->len payload bytes, overwriting the oldest if there isn't room
+void shm_out_write(shm_out_t *s, const mel_rec_t *hdr, const uint8_t *buf);
+
+// Wakes readers if anything was published since the last call
+void shm_out_wake(shm_out_t *s);
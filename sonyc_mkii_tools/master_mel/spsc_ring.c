@@ -0,0 +1,89 @@
+/*
+Single producer / single consumer record ring for master_mel
+
+Each record is an 8 byte header (length, or SPSC_WRAP for the filler before
+the end of the buffer) then the data, padded to 8 bytes. head and tail are
+free running byte counts, masked into the buffer on use. The producer only
+writes head and the consumer only writes tail, release/acquire on those is
+all the synchronisation there is.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc_ring.h"
+
+#define SPSC_HDR	8
+#define SPSC_WRAP	0xFFFFFFFFu
+#define SPSC_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+int spsc_init(spsc_ring_t *r, size_t size) {
+	size_t sz = 64;
+	while (sz < size) sz <<= 1;
+	memset(r, 0, sizeof(*r));
+	r->buf = malloc(sz);
+	if (r->buf == NULL) return -1;
+	r->size = sz;
+	return 0;
+}
+
+void spsc_free(spsc_ring_t *r) {
+	free(r->buf);
+	r->buf = NULL;
+}
+
+void * spsc_reserve(spsc_ring_t *r, uint32_t len) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	size_t pos = head & (r->size - 1);
+	size_t need = SPSC_ALIGN(SPSC_HDR + (size_t)len);
+	size_t skip = (r->size - pos < need) ? r->size - pos : 0; // Filler to the end first
+	size_t used = head - tail + skip + need;
+
+	if (len == SPSC_WRAP || used > r->size) {
+		atomic_fetch_add_explicit(&r->drops, 1, memory_order_relaxed);
+		return NULL;
+	}
+	if (used > atomic_load_explicit(&r->high_water, memory_order_relaxed))
+		atomic_store_explicit(&r->high_water, used, memory_order_relaxed);
+
+	if (skip) {
+		uint32_t wrap = SPSC_WRAP;
+		memcpy(&r->buf[pos], &wrap, sizeof(wrap));
+		pos = 0;
+	}
+	memcpy(&r->buf[pos], &len, sizeof(len));
+	r->pending = skip + need;
+	return &r->buf[pos + SPSC_HDR];
+}
+
+void spsc_commit(spsc_ring_t *r) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	atomic_store_explicit(&r->head, head + r->pending, memory_order_release);
+	r->pending = 0;
+}
+
+void * spsc_peek(spsc_ring_t *r, uint32_t *len) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	size_t pos = tail & (r->size - 1);
+	uint32_t rec_len;
+
+	if (tail == head) return NULL;
+	memcpy(&rec_len, &r->buf[pos], sizeof(rec_len));
+	if (rec_len == SPSC_WRAP) { // Filler, the record is at the front
+		tail += r->size - pos;
+		atomic_store_explicit(&r->tail, tail, memory_order_release);
+		pos = 0;
+		memcpy(&rec_len, &r->buf[0], sizeof(rec_len));
+	}
+	*len = rec_len;
+	return &r->buf[pos + SPSC_HDR];
+}
+
+void spsc_release(spsc_ring_t *r) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t rec_len;
+	memcpy(&rec_len, &r->buf[tail & (r->size - 1)], sizeof(rec_len));
+	atomic_store_explicit(&r->tail, tail + SPSC_ALIGN(SPSC_HDR + (size_t)rec_len), memory_order_release);
+}
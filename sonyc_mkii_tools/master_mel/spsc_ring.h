@@ -0,0 +1,31 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Lock-free single producer / single consumer ring of variable size records.
+// Records are contiguous in memory, one that would straddle the end starts over
+// at the front instead.
+
+typedef struct {
+	uint8_t *buf;
+	size_t size;				// Power of 2
+	atomic_size_t head;			// Producer position, only ever grows
+	atomic_size_t tail;			// Consumer position, only ever grows
+	size_t pending;				// Producer: bytes reserved, not committed yet
+	atomic_size_t high_water;	// Most bytes ever in use
+	atomic_uint drops;			// Records refused because the ring was full
+} spsc_ring_t;
+
+// size is rounded up to a power of 2. Returns 0 or -1.
+int spsc_init(spsc_ring_t *r, size_t size);
+void spsc_free(spsc_ring_t *r);
+
+// Producer: room for len bytes, NULL (and a drop counted) if full. Nothing is
+// visible to the consumer until spsc_commit().
+void * spsc_reserve(spsc_ring_t *r, uint32_t len);
+void spsc_commit(spsc_ring_t *r);
+
+// Consumer: oldest record and its length, NULL if empty. Valid until spsc_release().
+void * spsc_peek(spsc_ring_t *r, uint32_t *len);
+void spsc_release(spsc_ring_t *r);
@@ -0,0 +1,184 @@
+/*
+UDP output stage for master_mel
+
+Sockets are connected once at start, so the kernel doesn't look up a route
+and build an address per datagram, and a whole burst goes out with one
+sendmmsg() per destination. A connected UDP socket also reports
+ECONNREFUSED when nobody listens, that only counts as an error and the
+rest of the burst still goes.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include "serial_frame.h"
+#include "udp_out.h"
+
+static const struct {
+	const char *name;
+	uint32_t types;
+} type_names[] = {
+	{ "debug",	1u << FRAME_TYPE_DEBUG_STRING },
+	{ "data",	1u << FRAME_TYPE_DATA_STRING },
+	{ "audio",	1u << FRAME_TYPE_BIN_AUDIO },
+	{ "bms",	1u << FRAME_TYPE_DEBUG_STRING_BMS },
+	{ "all",	0xFFFFFFFFu },
+};
+
+// "data,debug" or frame type numbers, "3,11"
+static int parse_types(const char *s, uint32_t *types) {
+	char list[64], *tok, *save;
+	snprintf(list, sizeof(list), "%s", s);
+	*types = 0;
+	for (tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		char *end;
+		unsigned long n = strtoul(tok, &end, 10);
+		unsigned i;
+		if (*end == '\0' && end != tok && n < 32) { *types |= 1u << n; continue; }
+		for (i=0; i<sizeof(type_names)/sizeof(type_names[0]); i++) {
+			if (strcmp(tok, type_names[i].name) == 0) { *types |= type_names[i].types; break; }
+		}
+		if (i == sizeof(type_names)/sizeof(type_names[0])) return -1;
+	}
+	return *types ? 0 : -1;
+}
+
+int udp_dest_parse(udp_dest_t *d, const char *spec) {
+	char host[64];
+	const char *colon = strrchr(spec, ':');
+	const char *slash = strchr(spec, '/');
+	struct addrinfo hints = {0}, *res;
+	unsigned long port;
+	int ret;
+
+	memset(d, 0, sizeof(*d));
+	snprintf(d->spec, sizeof(d->spec), "%s", spec);
+	if (colon == NULL || (slash && slash < colon) || (size_t)(colon - spec) >= sizeof(host)) {
+		fprintf(stderr, "UDP destination %s: expected host:port[/types]\r\n", spec);
+		return -1;
+	}
+	memcpy(host, spec, colon - spec);
+	host[colon - spec] = '\0';
+	port = strtoul(colon + 1, NULL, 10);
+	if (port == 0 || port > 65535) {
+		fprintf(stderr, "UDP destination %s: bad port\r\n", spec);
+		return -1;
+	}
+
+	d->types = 1u << FRAME_TYPE_DATA_STRING;
+	if (slash && parse_types(slash + 1, &d->types) < 0) {
+		fprintf(stderr, "UDP destination %s: types are debug, data, audio, bms, all or frame type numbers\r\n", spec);
+		return -1;
+	}
+
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	ret = getaddrinfo(host, NULL, &hints, &res);
+	if (ret != 0) {
+		fprintf(stderr, "UDP destination %s: %s\r\n", spec, gai_strerror(ret));
+		return -1;
+	}
+	memcpy(&d->addr, res->ai_addr, sizeof(d->addr));
+	d->addr.sin_port = htons(port);
+	freeaddrinfo(res);
+	return 0;
+}
+
+int udp_out_open(udp_out_t *u, const udp_dest_t *dest, unsigned dest_count) {
+	memset(u, 0, sizeof(*u));
+	u->dest = dest;
+	u->dest_count = dest_count;
+	for (unsigned i=0; i<UDP_MAX_DESTS; i++) u->fd[i] = -1;
+
+	for (unsigned i=0; i<dest_count; i++) {
+		int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			perror("cannot create socket");
+			return -1;
+		}
+		u->fd[i] = fd;
+		if (IN_MULTICAST(ntohl(dest[i].addr.sin_addr.s_addr))) {
+			unsigned char ttl = 1; // Stay on the local network
+			setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+		}
+		if (connect(fd, (const struct sockaddr *)&dest[i].addr, sizeof(dest[i].addr)) < 0) {
+			fprintf(stderr, "UDP destination %s: %s\r\n", dest[i].spec, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void udp_out_close(udp_out_t *u) {
+	udp_out_flush(u);
+	for (unsigned i=0; i<UDP_MAX_DESTS; i++) {
+		if (u->fd[i] >= 0) close(u->fd[i]);
+		u->fd[i] = -1;
+	}
+}
+
+// One sendmmsg() per destination, more only if the kernel takes part of a burst
+static void flush_dest(udp_out_t *u, unsigned d) {
+	unsigned off = 0;
+	while (off < u->msg_count[d]) {
+		int ret = sendmmsg(u->fd[d], &u->msg[d][off], u->msg_count[d] - off, 0);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			u->errors++; // This one didn't go (ECONNREFUSED, ENOBUFS...), try the rest
+			off++;
+			continue;
+		}
+		u->sent += ret;
+		off += ret;
+	}
+	u->msg_count[d] = 0;
+}
+
+void udp_out_flush(udp_out_t *u) {
+	for (unsigned d=0; d<u->dest_count; d++) {
+		if (u->msg_count[d]) flush_dest(u, d);
+	}
+	u->used = 0;
+	u->iov_count = 0;
+}
+
+void udp_out_queue(udp_out_t *u, uint32_t type, const uint8_t *hdr, uint32_t hdr_len, const uint8_t *buf, uint32_t len) {
+	uint32_t bit = type < 32 ? 1u << type : 0;
+	bool wanted = false;
+	struct iovec *iov;
+
+	for (unsigned d=0; d<u->dest_count; d++) {
+		if (u->dest[d].types & bit) wanted = true;
+	}
+	if (!wanted) return;
+
+	len += hdr_len;
+	if (len > UDP_BATCH_BYTES) { // Can't be batched, and too big for a datagram anyway
+		u->errors++;
+		return;
+	}
+	if (u->iov_count == UDP_BATCH || u->used + len > UDP_BATCH_BYTES) udp_out_flush(u);
+
+	iov = &u->iov[u->iov_count++];
+	iov->iov_base = &u->buf[u->used];
+	iov->iov_len = len;
+	if (hdr_len) memcpy(iov->iov_base, hdr, hdr_len);
+	if (len > hdr_len) memcpy((uint8_t *)iov->iov_base + hdr_len, buf, len - hdr_len);
+	u->used += len;
+
+	for (unsigned d=0; d<u->dest_count; d++) {
+		struct mmsghdr *msg;
+		if (!(u->dest[d].types & bit)) continue;
+		msg = &u->msg[d][u->msg_count[d]++];
+		memset(msg, 0, sizeof(*msg));
+		msg->msg_hdr.msg_iov = iov;
+		msg->msg_hdr.msg_iovlen = 1;
+	}
+}
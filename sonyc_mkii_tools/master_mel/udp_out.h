@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Frame fan-out to UDP consumers. One connected socket per destination,
+// datagrams are queued and go out in bursts with sendmmsg().
+// Include with _GNU_SOURCE defined, struct mmsghdr needs it.
+
+#define UDP_MAX_DESTS	8
+#define UDP_BATCH		64				// Datagrams per sendmmsg()
+#define UDP_BATCH_BYTES	(64*1024)		// Payload copies held for one burst
+
+// A consumer, parsed from host:port[/type,type...]
+typedef struct {
+	struct sockaddr_in addr;
+	uint32_t types;			// Bit per FRAME_TYPE_*
+	char spec[64];			// As given, for messages
+} udp_dest_t;
+
+typedef struct {
+	const udp_dest_t *dest;
+	unsigned dest_count;
+	int fd[UDP_MAX_DESTS];
+
+	// Payloads are copied once, every destination's messages point at the same copy
+	uint8_t buf[UDP_BATCH_BYTES];
+	size_t used;
+	struct iovec iov[UDP_BATCH];
+	unsigned iov_count;
+	struct mmsghdr msg[UDP_MAX_DESTS][UDP_BATCH];
+	unsigned msg_count[UDP_MAX_DESTS];
+
+	uint64_t sent;
+	uint64_t errors;		// Datagrams a destination didn't take (nobody listening, buffer full...)
+} udp_out_t;
+
+// Returns 0 or -1 with a message. Types default to data strings only.
+int udp_dest_parse(udp_dest_t *d, const char *spec);
+
+// Opens and connects a socket per destination. Returns 0 or -1.
+int udp_out_open(udp_out_t *u, const udp_dest_t *dest, unsigned dest_count);
+void udp_out_close(udp_out_t *u);
+
+// Queues a frame for every destination that takes its type. The datagram is
+// hdr (NULL for none) then buf, both are copied.
+void udp_out_queue(udp_out_t *u, uint32_t type, const uint8_t *hdr, uint32_t hdr_len, const uint8_t *buf, uint32_t len);
+
+// Sends everything queued
+void udp_out_flush(udp_out_t *u);
@@ -0,0 +1,129 @@
+'''Read master_mel binary records (``master_mel --binary``), from files or UDP.
+
+Every record is a fixed 48 byte header (master_mel/mel_record.h) then the
+payload, so captures can be indexed, seeked and filtered by frame type
+without parsing the payload.
+
+    for rec in read_file('data.bin', types={DATA}):
+        print(rec.seq, rec.dev_us, rec.text)
+'''
+import struct
+import logging
+import collections
+
+log = logging.getLogger(__name__)
+
+MAGIC = 0x4C4D
+VERSION = 2
+MAX_LEN = 1 << 24
+
+# magic, version, kind, type, dest, dev, flags, len, seq, offset, crc32, dev_us, host_us, est_us
+HEADER = struct.Struct('<HBBBBBBIIIIQQQ')
+
+FRAME, PIECE, END, PAD = 0, 1, 2, 3
+
+# Frame types, Inc/serial_frame.h
+DEBUG, DATA, AUDIO, BMS = 0, 1, 6, 10
+TYPE_NAMES = {DEBUG: 'debug', DATA: 'data', AUDIO: 'audio', BMS: 'bms'}
+
+
+class Record(collections.namedtuple('Record', 'kind type dest dev flags seq offset crc32 dev_us host_us est_us payload')):
+    __slots__ = ()
+
+    @property
+    def type_name(self):
+        return TYPE_NAMES.get(self.type, str(self.type))
+
+    @property
+    def text(self):
+        '''Payload of a string frame, without the trailing nul and newline'''
+        return bytes(self.payload).rstrip(b'\0\n').decode(errors='replace')
+
+
+def unpack(buf, offset=0):
+    '''Record at buf[offset:], payload is a view into buf. None if there isn't a valid one.'''
+    if len(buf) - offset < HEADER.size:
+        return None
+    magic, version, kind, type_, dest, dev, flags, length, seq, off, crc, dev_us, host_us, est_us = HEADER.unpack_from(buf, offset)
+    if magic != MAGIC or version != VERSION or kind > PAD or length > MAX_LEN:
+        return None
+    start = offset + HEADER.size
+    if start + length > len(buf):
+        return None
+    return Record(kind, type_, dest, dev, flags, seq, off, crc, dev_us, host_us, est_us, memoryview(buf)[start:start + length])
+
+
+def iter_records(buf, types=None, skip_bad=True):
+    '''Records in a buffer (e.g. an mmap'd capture), payloads are views. Damaged bytes are skipped.'''
+    pos, end = 0, len(buf)
+    while pos + HEADER.size <= end:
+        rec = unpack(buf, pos)
+        if rec is None:
+            if not skip_bad:
+                raise ValueError('no record at offset {}'.format(pos))
+            nxt = bytes(buf[pos + 1:pos + 1 + 65536]).find(struct.pack('<H', MAGIC))
+            log.warning('damaged record at offset %d', pos)
+            pos = pos + 1 + nxt if nxt >= 0 else pos + 65536
+            continue
+        pos += HEADER.size + len(rec.payload)
+        if rec.kind != PAD and (not types or rec.type in types):
+            yield rec
+
+
+def read_file(path, types=None):
+    '''Records in a capture file. The file is mapped, not read in.'''
+    import mmap
+    with open(path, 'rb') as f:
+        if not f.seek(0, 2):
+            return
+        with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as m:
+            for rec in iter_records(m, types):
+                out = rec._replace(payload=bytes(rec.payload))
+                rec.payload.release()  # or the map can't close
+                yield out
+
+
+def index(path):
+    '''(file offset, type, seq, dev_us) of every record, to seek into a capture'''
+    import mmap
+    out = []
+    with open(path, 'rb') as f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as m:
+        pos = 0
+        while True:
+            rec = unpack(m, pos)
+            if rec is None:
+                break
+            out.append((pos, rec.type, rec.seq, rec.dev_us))
+            pos += HEADER.size + len(rec.payload)
+            rec.payload.release()
+    return out
+
+
+def read_udp(host='127.0.0.1', port=61393, types=None):
+    '''Records from datagrams, one each'''
+    import socket
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+        s.bind((host, port))
+        while True:
+            rec = unpack(s.recv(65536))
+            if rec is None:
+                log.info('datagram is not a record, is master_mel running with --binary?')
+            elif not types or rec.type in types:
+                yield rec
+
+
+def reassemble(records):
+    '''Joins streamed audio pieces back into whole frames. The END record brings the time stamps.'''
+    parts = {}
+    for rec in records:
+        if rec.kind == PIECE:
+            if rec.offset == 0:
+                parts[rec.dev] = bytearray()
+            if rec.dev in parts:
+                parts[rec.dev] += rec.payload
+        elif rec.kind == END:
+            data = parts.pop(rec.dev, None)
+            if data is not None and len(data) == rec.offset:
+                yield rec._replace(kind=FRAME, offset=0, payload=memoryview(data))
+        else:
+            yield rec
@@ -0,0 +1,182 @@
+'''Read frames from master_mel's shared memory ring (``master_mel --shm NAME``).
+
+The ring is written by master_mel only, it never waits for readers. If a
+reader falls behind, its records get overwritten and ``ShmReader.overruns``
+counts how many it lost. Payloads are memoryviews into the mapping, no
+copies, and are only valid until the next record is read.
+
+    with ShmReader('mel') as r:
+        for rec in r:
+            print(rec.type_name, rec.dev_us, bytes(rec.payload))
+'''
+import os
+import mmap
+import time
+import struct
+import ctypes
+import logging
+import platform
+from . import records
+from .records import Record, FRAME, PIECE, END, PAD
+
+log = logging.getLogger(__name__)
+
+MAGIC = 0x4853454D
+VERSION = 3
+
+# Layout of shm_hdr_t in master_mel/shm_out.h, records are mel_rec_t (records.py)
+HDR = struct.Struct('<IIIIQI')  # magic, version, hdr_size, align, size, epoch
+OFF_EPOCH = 24
+OFF_HEAD, OFF_TAIL, OFF_FUTEX, OFF_PID, OFF_RECORDS, OFF_DROPS = 64, 72, 80, 84, 88, 96
+REC = records.HEADER
+
+# FUTEX_WAIT on the published counter, plain polling where the syscall number isn't known
+SYS_FUTEX = {'x86_64': 202, 'aarch64': 98, 'armv7l': 240, 'armv6l': 240, 'i686': 240}.get(platform.machine())
+FUTEX_WAIT = 0
+
+
+class timespec(ctypes.Structure):
+    _fields_ = [('tv_sec', ctypes.c_long), ('tv_nsec', ctypes.c_long)]
+
+
+class ShmReader:
+    def __init__(self, name='mel', oldest=False, poll=0.05):
+        '''oldest: start from the oldest record still in the ring rather than the next new one'''
+        path = os.path.join('/dev/shm', name.lstrip('/'))
+        with open(path, 'r+b') as f:
+            self.map = mmap.mmap(f.fileno(), 0, mmap.MAP_SHARED, mmap.PROT_READ | mmap.PROT_WRITE)
+        self.view = memoryview(self.map)
+        self.name = name
+        self.oldest = oldest
+        self.poll = poll
+        self.overruns = 0   # records lost because the writer lapped us
+        self.torn = 0       # records overwritten while the caller had them
+        self.epoch = None
+        self._futex = self._futex_word = None
+        if SYS_FUTEX is not None:
+            self._libc = ctypes.CDLL(None, use_errno=True)
+            self._futex_word = ctypes.c_uint32.from_buffer(self.map, OFF_FUTEX)
+            self._futex = ctypes.addressof(self._futex_word)
+        self._attach()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *a):
+        self.close()
+
+    def close(self):
+        self._futex = self._futex_word = None  # holds an export of the map
+        self.view.release()
+        try:
+            self.map.close()
+        except BufferError:  # a caller still holds a payload view
+            pass
+
+    def _u64(self, off):
+        return struct.unpack_from('<Q', self.map, off)[0]
+
+    def _u32(self, off):
+        return struct.unpack_from('<I', self.map, off)[0]
+
+    def _attach(self):
+        magic, version, hdr_size, align, size, epoch = HDR.unpack_from(self.map, 0)
+        if magic != MAGIC or version != VERSION:
+            raise ValueError('{}: not a master_mel ring (magic {:#x} version {})'.format(self.name, magic, version))
+        self.hdr_size, self.align, self.size, self.epoch = hdr_size, align, size, epoch
+        self.mask = size - 1
+        self.pos = self._u64(OFF_TAIL if self.oldest else OFF_HEAD)
+        self.seq = None
+
+    @property
+    def writer_alive(self):
+        return self._u32(OFF_PID) != 0
+
+    @property
+    def stats(self):
+        return {'records': self._u64(OFF_RECORDS), 'drops': self._u64(OFF_DROPS),
+                'overruns': self.overruns, 'torn': self.torn}
+
+    def _lapped(self):
+        return self._u64(OFF_TAIL) > self.pos
+
+    def _resync(self):
+        if self._u32(OFF_EPOCH) != self.epoch or self._u32(0) != MAGIC:  # writer restarted
+            log.info('%s: writer restarted', self.name)
+            self.oldest = True
+            self._attach()
+        head = self._u64(OFF_HEAD)
+        if self._lapped():
+            self.pos = self._u64(OFF_TAIL)  # lost records show as a seq gap on the next one
+        return head > self.pos
+
+    def wait(self, timeout=1.0):
+        '''Block until the writer publishes, or timeout seconds'''
+        seen = self._u32(OFF_FUTEX)
+        if self._u64(OFF_HEAD) != self.pos:
+            return
+        if self._futex is None:
+            time.sleep(self.poll)
+            return
+        ts = timespec(int(timeout), int((timeout % 1) * 1e9))
+        self._libc.syscall(SYS_FUTEX, ctypes.c_void_p(self._futex), FUTEX_WAIT, ctypes.c_uint32(seen),
+                           ctypes.byref(ts), None, 0)
+
+    def read(self):
+        '''Next record or None if there isn't one yet'''
+        while True:
+            if not self._resync():
+                return None
+            left = self.size - (self.pos & self.mask)
+            if left < REC.size:  # too little for a record before the end, the next one is at the start
+                self.pos += left
+                continue
+            off = self.hdr_size + (self.pos & self.mask)
+            _, _, kind, type_, dest, dev, flags, length, seq, offset, crc, dev_us, host_us, est_us = REC.unpack_from(self.map, off)
+            total = (REC.size + length + self.align - 1) & ~(self.align - 1)
+            if self._lapped():  # header was overwritten while we read it
+                continue
+            if kind == PAD:
+                self.pos += total
+                continue
+            if self.seq is not None and seq != self.seq:
+                self.overruns += (seq - self.seq) & 0xFFFFFFFF
+            self.seq = (seq + 1) & 0xFFFFFFFF
+            start = off + REC.size
+            rec = Record(kind, type_, dest, dev, flags, seq, offset, crc, dev_us, host_us, est_us, self.view[start:start + length])
+            self.pos += total
+            return rec
+
+    def valid(self, rec):
+        '''True if rec's payload hasn't been overwritten since it was read'''
+        return self._u64(OFF_TAIL) <= self.pos - ((REC.size + len(rec.payload) + self.align - 1) & ~(self.align - 1))
+
+    def __iter__(self):
+        '''Records forever, blocking between them. Stops when the writer exits.'''
+        while True:
+            rec = self.read()
+            if rec is None:
+                if not self.writer_alive:
+                    return
+                self.wait()
+                continue
+            yield rec
+            if not self.valid(rec):
+                self.torn += 1
+
+
+def cli(name='mel', types=None, oldest=False):
+    '''Print records as they arrive, e.g. python -m fire mkiiread.shm cli --name=mel'''
+    types = set(types.split(',') if isinstance(types, str) else types or ())
+    with ShmReader(name, oldest=oldest) as r:
+        try:
+            for rec in r:
+                if types and rec.type_name not in types:
+                    continue
+                if rec.type == records.AUDIO or rec.kind != FRAME:
+                    print(rec.type_name, rec.kind, rec.offset, rec.dev_us, len(rec.payload))
+                else:
+                    print(rec.type_name, rec.dev_us, rec.text)
+        except KeyboardInterrupt:
+            pass
+        print('---', r.stats)
@@ -1,6 +1,9 @@
 #pragma once
+#include "serial_frame.h"
 
 void printf_frame(const char * restrict fmt, ...) __attribute__ ((format (printf, 1, 2)));
 
 void send_button_frame(void);
-void do_uart_rx(uint8_t *read_buf, int sz);
\ No newline at end of file
+int h7_encodev(const sf_iovec_t *iov, uint32_t iovcnt, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type, uint32_t *needed);
+void do_uart_rx(uint8_t *read_buf, int sz);
+void h7_link_reset(void);
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include "bms_serial.h"
 #include "serial_frame.h"
 #include "bootloader.h"
+#include "boot_lz.h"
 
 // TODO: Duped with main.c
 #define HELLO_STRING "SONYC Mel BMS Compiled " __DATE__ " " __TIME__ "\r\n"
@@ -51,27 +52,73 @@ static HAL_StatusTypeDef erase_storage_flash(void) {
 
 // END FLASH OPERATIONS --- MOVE ME
 
-static void send_ack_reply(void) {
+// Frames are views into this buffer, no heap use on the RX path
+static uint8_t h7_frame_buf[FRAME_MAX_SIZE];
+static sf_decoder_t h7_decoder;
+
+// Framing picked by the last HELLO from the H7, HDLC until then
+static uint32_t h7_framing = SF_FRAMING_HDLC;
+
+// The H7 went down or restarted, it speaks HDLC until it sends a HELLO again
+void h7_link_reset(void) {
+	h7_framing = SF_FRAMING_HDLC;
+	sf_decoder_set_opts(&h7_decoder, SF_OPT_VIEW);
+}
+
+// Everything sent to the H7 goes through here
+int h7_encodev(const sf_iovec_t *iov, uint32_t iovcnt, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type, uint32_t *needed) {
+	return sf_encodev_framing(h7_framing, iov, iovcnt, buf_max, buf, dest, pkt_type, needed);
+}
+
+static void send_empty_frame(uint8_t dest, uint32_t type) {
 	uint8_t buf[FRAME_MIN_SIZE*2];
 	int ret;
-	ret = serial_frame_encode(NULL, 0, sizeof(buf), buf, DEST_BASE, FRAME_TYPE_ACK);
-	bms_transmit(buf, ret);
+	ret = h7_encodev(NULL, 0, sizeof(buf), buf, dest, type, NULL);
+	if (ret > 0) bms_transmit(buf, ret);
+}
+
+static void send_ack_reply(void) {
+	send_empty_frame(DEST_BASE, FRAME_TYPE_ACK);
 }
 
 // Error condition
 // Additional info in debug string, if any
 static void send_nack_reply(void) {
-	uint8_t buf[FRAME_MIN_SIZE*2];
-	int ret;
-	ret = serial_frame_encode(NULL, 0, sizeof(buf), buf, DEST_BASE, FRAME_TYPE_NACK);
-	bms_transmit(buf, ret);
+	send_empty_frame(DEST_BASE, FRAME_TYPE_NACK);
 }
 
+// HELLO payload lists the framings the H7 speaks. Reply with our pick in
+// HDLC (all it can count on) then switch, the rest of the reply uses it.
 static void hello_frame_handler(serial_frame_t *f, mel_status_t *status) {
+	sf_hello_t hello = { sf_hello_select(f->buf, f->sz) };
+	sf_iovec_t iov = { &hello, sizeof(hello) };
+	uint8_t buf[SF_ENCODED_MAX(sizeof(hello))];
+	int ret;
+
+	ret = sf_encodev(&iov, 1, sizeof(buf), buf, DEST_BASE, FRAME_TYPE_HELLO, NULL);
+	if (ret > 0) bms_transmit(buf, ret);
+	h7_framing = hello.framings;
+	sf_decoder_set_opts(&h7_decoder, SF_OPT_VIEW | (h7_framing == SF_FRAMING_COBS ? SF_OPT_COBS : 0));
+
 	printf_frame(HELLO_STRING);
 	send_ack_reply();
 }
 
+// Storage is erased before the first program frame after reset
+static bool erase_once(int bin_len) {
+	static int is_erased=0;
+	uint32_t now;
+	if (is_erased) return true;
+	now = HAL_GetTick();
+	if (erase_storage_flash() != HAL_OK) {
+		printf_frame("Erase FAILED\r\n");
+		return false;
+	}
+	printf_frame("Erase operation took %lu ms... programming %d bytes...\r\n", HAL_GetTick()-now, bin_len);
+	is_erased=1;
+	return true;
+}
+
 // Assumes Data is padded to % 8 bytes (e.g. 1 FLASH word)
 #define FLASH_WORD_SIZE 8 // bytes, a double-word in this case
 static void prog_helper(boot_cmd_packet_t *p, serial_frame_t *f) {
@@ -80,7 +127,6 @@ static void prog_helper(boot_cmd_packet_t *p, serial_frame_t *f) {
 	uint64_t *data = (uint64_t *)(&f->buf[offset]);
 	uint32_t addr = p->arg0;
 	int bin_len = f->sz - offset;
-	static int is_erased=0;
 	uint32_t now;
 
 	// There is a bug or something... not sure if this is safe...
@@ -92,18 +138,9 @@ static void prog_helper(boot_cmd_packet_t *p, serial_frame_t *f) {
 		// return;
 	// }
 
-	if (!is_erased) {
-		now = HAL_GetTick();
-		ret = erase_storage_flash();
-		if (ret == HAL_OK) {
-			printf_frame("Erase operation took %lu ms... programming %d bytes...\r\n", HAL_GetTick()-now, bin_len);
-		}
-		else {
-			printf_frame("Erase FAILED\r\n");
-			send_nack_reply();
-			return;
-		}
-		is_erased=1;
+	if (!erase_once(bin_len)) {
+		send_nack_reply();
+		return;
 	}
 
 	now = HAL_GetTick();
@@ -125,6 +162,93 @@ out:
 	HAL_FLASH_Lock();
 }
 
+// boot_cmd_program_win, see bootloader.h. The UART takes one frame per exchange,
+// so each is answered on its own, but duplicates are still never rewritten.
+static struct {
+	uint32_t session;
+	uint32_t next;			// Every seq below is programmed
+	uint32_t sack;			// Bit i: next + 1 + i is programmed
+} prog_win;
+
+static void send_prog_win_reply(uint32_t type, uint32_t next) {
+	boot_prog_ack_t ack = { next, prog_win.sack };
+	sf_iovec_t iov = { &ack, sizeof(ack) };
+	uint8_t buf[SF_ENCODED_MAX(sizeof(ack))];
+	int ret = h7_encodev(&iov, 1, sizeof(buf), buf, DEST_BASE, type, NULL);
+	if (ret > 0) bms_transmit(buf, ret);
+}
+
+static blz_decoder_t prog_lz; // boot_cmd_program_lz, decodes straight into flash
+
+// blz_put_t, ctx is the frame's address
+static int prog_lz_put(void *ctx, uint32_t off, const uint8_t *word) {
+	uint32_t addr = *(uint32_t *)ctx + off;
+	uint64_t v;
+	memcpy(&v, word, sizeof(v));
+	return HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, addr, v) == HAL_OK ? 0 : -1;
+}
+
+// boot_cmd_program_win and boot_cmd_program_lz, only the data differs
+static void prog_win_helper(boot_cmd_packet_t *p, serial_frame_t *f) {
+	const int offset = sizeof(*p);
+	uint64_t *data = (uint64_t *)(&f->buf[offset]);
+	uint32_t addr = p->arg0;
+	uint32_t seq = p->arg2;
+	uint32_t d;
+	int bin_len = f->sz - offset;
+
+	if (BOOT_PROG_GET_SESSION(p->arg1) != prog_win.session) {
+		memset(&prog_win, 0, sizeof(prog_win));
+		prog_win.session = BOOT_PROG_GET_SESSION(p->arg1);
+	}
+
+	d = seq - prog_win.next;
+	if (seq < prog_win.next || d >= BOOT_PROG_WINDOW_MAX || (d > 0 && (prog_win.sack & (1u << (d - 1))))) {
+		send_prog_win_reply(FRAME_TYPE_ACK, prog_win.next); // Done already or too far ahead, say where we are
+		return;
+	}
+	if (p->cmd == boot_cmd_program_win && (bin_len > 1024 || bin_len % FLASH_WORD_SIZE != 0)) {
+		printf_frame("Binary is sized %d but must be padded to mod 8, at most 1024\r\n", bin_len);
+		send_prog_win_reply(FRAME_TYPE_NACK, seq);
+		return;
+	}
+	if (!erase_once(bin_len)) {
+		send_prog_win_reply(FRAME_TYPE_NACK, seq);
+		return;
+	}
+
+	HAL_FLASH_Unlock();
+	if (p->cmd == boot_cmd_program_lz) { // Decodes to at most 1024 bytes too
+		int32_t ret = blz_decode(&prog_lz, (const uint8_t *)data, bin_len, FLASH_WORD_SIZE, 1024, prog_lz_put, &addr);
+		if (ret < 0) {
+			HAL_FLASH_Lock();
+			printf_frame(ret == BLZ_ERR_PUT ? "Program failed :(\r\n" : "Bad compressed frame\r\n");
+			send_prog_win_reply(FRAME_TYPE_NACK, seq);
+			return;
+		}
+	}
+	else for (; bin_len; bin_len -= FLASH_WORD_SIZE, addr += FLASH_WORD_SIZE, data++) {
+		if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, addr, *data) != HAL_OK) {
+			HAL_FLASH_Lock();
+			printf_frame("Program failed :(\r\n");
+			send_prog_win_reply(FRAME_TYPE_NACK, seq);
+			return;
+		}
+	}
+	HAL_FLASH_Lock();
+
+	if (d == 0) { // Slide past it and anything after it that already came
+		prog_win.next++;
+		while (prog_win.sack & 1) {
+			prog_win.sack >>= 1;
+			prog_win.next++;
+		}
+		prog_win.sack >>= 1;
+	}
+	else prog_win.sack |= 1u << (d - 1);
+	send_prog_win_reply(FRAME_TYPE_ACK, prog_win.next);
+}
+
 static void boot_frame_handler(serial_frame_t *f, mel_status_t *status) {
 	boot_cmd_packet_t pkt;
 	memcpy(&pkt, f->buf, sizeof(pkt));
@@ -132,6 +256,8 @@ static void boot_frame_handler(serial_frame_t *f, mel_status_t *status) {
 		// case boot_cmd_hello: 	send_hello_reply(); 	break;
 		// case boot_cmd_erase: 	erase_helper(&pkt); 	break;
 		case boot_cmd_program:		prog_helper(&pkt, f); 	break;
+		case boot_cmd_program_win:	prog_win_helper(&pkt, f); break;
+		case boot_cmd_program_lz:	prog_win_helper(&pkt, f); break;
 		// case boot_cmd_boot:		boot_helper();			break;
 		default: printf_frame("Ignoring cmd %d\r\n", pkt.cmd); send_nack_reply();
 	}
@@ -140,6 +266,9 @@ static void boot_frame_handler(serial_frame_t *f, mel_status_t *status) {
 }
 
 static void handle_frame(serial_frame_t *f, mel_status_t *status) {
+	// Only HELLO comes HDLC once the link is COBS. Anything else means the H7 restarted
+	// without us seeing it, e.g. booting from the bootloader into the application.
+	if (h7_framing == SF_FRAMING_COBS && f->type != FRAME_TYPE_HELLO && !(f->flag & COBS_FRAMED)) h7_link_reset();
 	if (f->dest != DEST_BMS) goto out;
 	else switch(f->type) {
 		case FRAME_TYPE_HELLO: hello_frame_handler(f, status); break;
@@ -157,13 +286,9 @@ static bool parse_frame(serial_frame_t *f, mel_status_t *status) {
 	if (f->err == NO_FRAME) return false;
 	//if (f->err) printf("Frame Error %d\r\n", f->err);
 
-	if (flag & CRC_ERROR) {
-		// TODO
-	}
-
 	if (flag & FRAME_FOUND) {
-		handle_frame(f, status);
-		if (f->buf)
+		if (!(flag & CRC_ERROR)) handle_frame(f, status); // Dropped like a lost frame, its args and data can't be trusted
+		if (f->buf && !(flag & BUF_VIEW))
 			free(f->buf);
 		f->buf = NULL;
 		f->sz = 0;
@@ -177,8 +302,13 @@ void do_uart_rx(uint8_t *read_buf, int sz) {
 	int i=0;
 	int decode_ret;
 	bool go = false;
+
+	if (h7_decoder.out == NULL) {
+		sf_decoder_init(&h7_decoder, h7_frame_buf, sizeof(h7_frame_buf));
+		sf_decoder_set_opts(&h7_decoder, SF_OPT_VIEW | (h7_framing == SF_FRAMING_COBS ? SF_OPT_COBS : 0));
+	}
 	do {
-		decode_ret = serial_frame_decode(&read_buf[i], sz-i, &f);
+		decode_ret = sf_decode(&h7_decoder, &read_buf[i], sz-i, &f);
 		if (decode_ret < 0) { break; }
 		i += decode_ret;
 		go = parse_frame(&f, NULL);
@@ -186,7 +316,8 @@ void do_uart_rx(uint8_t *read_buf, int sz) {
 }
 
 void printf_frame(const char * restrict fmt, ...) {
-	size_t needed, needed_frame;
+	size_t needed;
+	uint32_t needed_frame;
 	int ret;
 	char *debug_string_buf=NULL, *debug_send_buf=NULL;
 	va_list argptr;
@@ -198,14 +329,20 @@ void printf_frame(const char * restrict fmt, ...) {
 	if (debug_string_buf == NULL) goto out;
 	vsnprintf(debug_string_buf, needed, fmt, argptr);
 
-	needed_frame = serial_frame_encode_count((uint8_t *)debug_string_buf, needed, DEST_BASE, FRAME_TYPE_DEBUG_STRING_BMS);
+	// Text rarely needs escaping (and COBS never grows it much), so guess close to
+	// the raw size and only re-encode (once, with the size asked for) if that was too small
+	sf_iovec_t iov = { debug_string_buf, needed };
+	needed_frame = needed + SF_FRAME_OVERHEAD + 2 + 8;
 	debug_send_buf = (char *)malloc(needed_frame);
 	if (debug_send_buf == NULL) goto out;
-	ret = serial_frame_encode((uint8_t *)debug_string_buf, needed, needed_frame, (uint8_t *)debug_send_buf, DEST_BASE, FRAME_TYPE_DEBUG_STRING_BMS);
-
-#ifdef _DEBUG
-	if (ret != needed_frame) __BKPT(); // Sanity check
-#endif
+	ret = h7_encodev(&iov, 1, needed_frame, (uint8_t *)debug_send_buf, DEST_BASE, FRAME_TYPE_DEBUG_STRING_BMS, &needed_frame);
+	if (ret < 0 && needed_frame > 0) {
+		free(debug_send_buf);
+		debug_send_buf = (char *)malloc(needed_frame);
+		if (debug_send_buf == NULL) goto out;
+		ret = h7_encodev(&iov, 1, needed_frame, (uint8_t *)debug_send_buf, DEST_BASE, FRAME_TYPE_DEBUG_STRING_BMS, NULL);
+	}
+	if (ret < 0) goto out;
 
 	//write(STDOUT_FILENO, debug_send_buf, ret);
 	bms_transmit((uint8_t *)debug_send_buf, ret);
@@ -218,18 +355,5 @@ out:
 }
 
 void send_button_frame(void) {
-	size_t needed_frame;
-	uint8_t *buf;
-	int ret;
-
-	needed_frame = serial_frame_encode_count(NULL, 0, DEST_H7, FRAME_TYPE_BOOTLOADER_BIN);
-	buf = (uint8_t *)malloc(needed_frame);
-	if (buf == NULL) return;
-	ret = serial_frame_encode(NULL, 0, needed_frame, buf, DEST_H7, FRAME_TYPE_BOOTLOADER_BIN);
-#ifdef _DEBUG
-	if (ret != needed_frame) __BKPT();
-#endif
-	bms_transmit(buf, ret);
-
-	free(buf);
+	send_empty_frame(DEST_H7, FRAME_TYPE_BOOTLOADER_BIN);
 }
\ No newline at end of file
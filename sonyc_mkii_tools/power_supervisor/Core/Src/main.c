@@ -178,6 +178,7 @@ static void set_1v8(int go) {
 	else {
 		set_pin_analog(PORT, PIN);
 		is_1v8_on = false;
+		h7_link_reset(); // Back to HDLC, it comes up without our COBS
 	}
 }
 
@@ -211,6 +212,7 @@ static void set_1v8_rf(int go) {
 static void set_h7_reset(int go) {
 	GPIO_TypeDef *PORT = 	nH7_RESET_GPIO_Port; // make sure I match
 	uint16_t PIN = 			nH7_RESET_Pin;		 // make sure I match
+	if (go == H7_OFF) h7_link_reset();
 	if (go)
 		set_pin_input_pulldown(PORT, PIN);
 	else
@@ -257,6 +259,11 @@ uint32_t get_rtc_tick(void) {
 	return tick;
 }
 
+// Frame timestamps, only RTC_MS_PER_TICK resolution but same clock as the hour stats
+uint64_t serial_frame_now_us(void) {
+	return (uint64_t)tick * RTC_MS_PER_TICK * 1000;
+}
+
 // Pair of functions to only unlock if they were initially unlocked
 // In other words, nestable
 static uint32_t lock_irq(void) {
@@ -605,50 +612,54 @@ static void print_hour_stats(uint32_t hour) {
 }
 
 // Dump collected data to framed binary format
-// should be 24 x 4 x 4 + 4 + 16 + 4 + 4 = 412 bytes round up to 512
-#define COPY_BATT(xxx) memcpy(&buf[len], batt->xxx, sizeof(batt->xxx)); len += sizeof(batt->xxx)
-#define COPT_BATT_LIT(xxx) memcpy(&buf[len], &batt->xxx, sizeof(batt->xxx)); len += sizeof(batt->xxx)
-//int serial_frame_encode_count(const uint8_t *in, uint32_t len_in, uint8_t dest, uint32_t pkt_type) {
+// should be 24 x 4 x 4 + 4 + 16 + 4 + 4 = 412 bytes
+// Fields are framed straight out of the battery struct, no staging copy
 static void send_hour_stats(void) {
 	if (!get_1v8()) return; // Abort send if H7 isn't actually up
-	static uint8_t buf[512]; // CHECK ME IF YOU TOUCH ANYTHING -- THIS MUST BE BIG ENOUGH
 	uint8_t *encoded_buf = NULL;
-	uint32_t encoded_buf_len;
-	int len = 0;
+	uint32_t encoded_buf_len, payload_len = 0;
+	int len;
 	battery_t *batt = get_battery();
 
-	// Copy out the binary data
 	batt->ver = BMS_DATA_FORMAT_VER;
-	COPT_BATT_LIT(ver);
-	COPT_BATT_LIT(hour_idx);
-	COPY_BATT(cells);
-	COPT_BATT_LIT(tot);
-	COPY_BATT(power_in_24);
-	COPY_BATT(power_out_24);
-	COPY_BATT(solar_volt_24);
-	COPY_BATT(temperature_24);
-
-	// Encode to serial frame
-	encoded_buf_len = serial_frame_encode_count(buf, len, DEST_H7, FRAME_TYPE_BMS_STATS_v7);
+	const sf_iovec_t iov[] = {
+		{ &batt->ver,			sizeof(batt->ver) },
+		{ &batt->hour_idx,		sizeof(batt->hour_idx) },
+		{ batt->cells,			sizeof(batt->cells) },
+		{ &batt->tot,			sizeof(batt->tot) },
+		{ batt->power_in_24,	sizeof(batt->power_in_24) },
+		{ batt->power_out_24,	sizeof(batt->power_out_24) },
+		{ batt->solar_volt_24,	sizeof(batt->solar_volt_24) },
+		{ batt->temperature_24,	sizeof(batt->temperature_24) },
+	};
+	const uint32_t iovcnt = sizeof(iov)/sizeof(iov[0]);
+	for (uint32_t i=0; i<iovcnt; i++) payload_len += iov[i].len;
+
+	// Encode to serial frame, first guess allows for a few escaped bytes
+	encoded_buf_len = payload_len + SF_FRAME_OVERHEAD + 2 + 16;
 	encoded_buf = (uint8_t *) malloc(encoded_buf_len);
-
-	if (encoded_buf == NULL) {
-		debug_printf("%s(): could not malloc() encode buffer, aborting\r\n", __func__);
-		return;
+	if (encoded_buf == NULL) goto nomem;
+	len = h7_encodev(iov, iovcnt, encoded_buf_len, encoded_buf, DEST_H7, FRAME_TYPE_BMS_STATS_v7, &encoded_buf_len);
+	if (len < 0 && encoded_buf_len > 0) { // Re-encode once with the exact size
+		free(encoded_buf);
+		encoded_buf = (uint8_t *) malloc(encoded_buf_len);
+		if (encoded_buf == NULL) goto nomem;
+		len = h7_encodev(iov, iovcnt, encoded_buf_len, encoded_buf, DEST_H7, FRAME_TYPE_BMS_STATS_v7, NULL);
 	}
-
-	len = serial_frame_encode(buf, len, encoded_buf_len, encoded_buf, DEST_H7, FRAME_TYPE_BMS_STATS_v7);
-	if (len < 0 || len != encoded_buf_len) {  // sanity check
-		debug_printf("%s(): serial_frame_encode() error returned %d\r\n", __func__, len);
+	if (len < 0) {
+		debug_printf("%s(): h7_encodev() error returned %d\r\n", __func__, len);
 		goto out;
 	}
 
 	debug_printf("Sending %d bytes to H7...\r\n", len);
 	uint32_t now = HAL_GetTick();
-	bms_transmit(encoded_buf, encoded_buf_len);
+	bms_transmit(encoded_buf, len);
 	debug_printf("Stats sent to H7 in %lu ms\r\n", HAL_GetTick()-now);
 out:
 	free(encoded_buf);
+	return;
+nomem:
+	debug_printf("%s(): could not malloc() encode buffer, aborting\r\n", __func__);
 }
 
 static void do_hour_update(uint32_t my_hour) {
@@ -4,3 +4,6 @@ cp ../SamComms/h7boot/Core/Src/serial_frame.c Core/Src/serial_frame.c
 cp ../SamComms/h7boot/Core/Inc/serial_frame.h Core/Inc/serial_frame.h
 
 cp ../SamComms/h7boot/Core/Inc/bootloader.h Core/Inc/bootloader.h
+
+cp ../SamComms/h7boot/Core/Src/boot_lz.c Core/Src/boot_lz.c
+cp ../SamComms/h7boot/Core/Inc/boot_lz.h Core/Inc/boot_lz.h
@@ -28,25 +28,23 @@ u16DataLen u8OptionLen
 
 #include "serial_frame.h"
 
-#ifndef FRAME_MAX_SIZE
-#define FRAME_MAX_SIZE 2048 // Only used for decoding. Host end should set larger for audio etc.
-#endif
-
 #define htons(x) __builtin_bswap16(x)
 
 // Toggle the 5th bit (starting from 0)
 //enum { FLAG_FLAG=0x7E, FLAG_ESC=0x7D, TOGGLE_BIT=0x20 };
 enum { ESP3_SYNC=0x55 };
 
+// SYNC LEN(2) OPT_LEN TYPE CRC8H
+#define ESP3_HEADER_SIZE 6
+
+// SYNC_ON collects the header, DATAX collects data + optional data + CRC8D
 typedef enum {
-	START=0, SYNC_ON, HEADER_CHECK, DATAX, DATAY, CRCD, DONE
+	START=0, SYNC_ON, HEADER_CHECK, DATAX, DONE
 } frame_state_t;
 
-static uint8_t out[FRAME_MAX_SIZE];	// Working buffer
-static uint32_t in_idx;				// index into INPUT buffer
-static uint32_t out_idx;			// index into OUT buffer
-static frame_state_t state;	// State of decoding, preserved over calls
-static unsigned data_count;
+// Default context for the legacy serial_frame_decode() API
+static uint8_t default_out[FRAME_MAX_SIZE];
+static sf_decoder_t default_decoder = { .out = default_out, .out_max = FRAME_MAX_SIZE, .state = START };
 
 static const uint8_t u8CRC8Table[256] = {
 	0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
@@ -85,10 +83,26 @@ static const uint8_t u8CRC8Table[256] = {
 
 #define proccrc8(u8CRC, u8Data) (u8CRC8Table[u8CRC ^ u8Data])
 
+// crc8_slice[k][x] is u8CRC8Table applied k+1 times, i.e. x followed by k zero bytes
+static uint8_t crc8_slice[4][256];
+
+// Runs before main() so decoders in other threads never see a half built table
+__attribute__ ((constructor)) static void crc8_init_tables(void) {
+	for (unsigned i=0; i<256; i++) {
+		crc8_slice[0][i] = u8CRC8Table[i];
+		for (unsigned t=1; t<4; t++)
+			crc8_slice[t][i] = u8CRC8Table[crc8_slice[t-1][i]];
+	}
+}
+
+// Slicing-by-4, the four lookups are independent so they overlap in the pipeline
 static uint8_t compute_crc8(const uint8_t *buf, unsigned len) {
 	uint8_t u8CRC = 0;
-	for (int i = 0 ; i < len ; i++)
-		u8CRC = proccrc8(u8CRC, buf[i]);
+	for (; len >= 4; len -= 4, buf += 4)
+		u8CRC = crc8_slice[3][u8CRC ^ buf[0]] ^ crc8_slice[2][buf[1]] ^
+				crc8_slice[1][buf[2]] ^ crc8_slice[0][buf[3]];
+	while (len--)
+		u8CRC = proccrc8(u8CRC, *buf++);
 	return u8CRC;
 }
 
@@ -98,12 +112,55 @@ static bool check_crc8(uint8_t *buf, unsigned len, uint8_t pkt_crc) {
 	return (my_crc == pkt_crc);
 }
 
+// Sets up a decoder context with a caller owned working buffer
+// Skewed so the payload (after the 6 byte header) is 8-byte aligned
+void sf_decoder_init(sf_decoder_t *d, uint8_t *buf, uint32_t buf_sz) {
+	uint32_t skew = (2 - (uintptr_t)buf) & 7;
+	memset(d, 0, sizeof(sf_decoder_t));
+	if (buf_sz > skew + 8) {
+		buf += skew;
+		buf_sz -= skew;
+	}
+	d->out = buf;
+	d->out_max = buf_sz;
+	d->state = START;
+}
+
+void sf_decoder_set_opts(sf_decoder_t *d, uint32_t opts) {
+	d->opts = opts;
+}
+
+// Not implemented for ESP3, frames that don't fit the working buffer are still dropped
+void sf_decoder_set_stream(sf_decoder_t *d, sf_stream_cb_t cb, void *ctx) {
+	d->stream_cb = cb;
+	d->stream_ctx = ctx;
+}
+
 // Resets frame processing state
-void serial_frame_reset(void) { out_idx = 0; state = START; data_count = 0; }
+void sf_decoder_reset(sf_decoder_t *d) { d->out_idx = 0; d->state = START; d->data_count = 0; }
+
+void serial_frame_reset(void) { sf_decoder_reset(&default_decoder); }
+
+int serial_frame_decode(const uint8_t *in, uint32_t len_in, serial_frame_t *frame) {
+	return sf_decode(&default_decoder, in, len_in, frame);
+}
+
+// Header failed its CRC (or can't be real), slide to the next SYNC already
+// buffered instead of dropping those bytes, a real frame may start there
+static void header_resync(sf_decoder_t *d) {
+	uint8_t *sync = (uint8_t *)memchr(&d->out[1], ESP3_SYNC, d->out_idx - 1);
+	if (sync == NULL) {
+		sf_decoder_reset(d);
+		return;
+	}
+	d->out_idx -= sync - d->out;
+	memmove(d->out, sync, d->out_idx);
+	d->state = SYNC_ON;
+}
 
 // Call on input serial stream
 // Returns: -1 on error, 0 on non-event, else index of *next* byte in input buffer
-int serial_frame_decode(const uint8_t *in, uint32_t len_in, serial_frame_t *frame) {
+int sf_decode(sf_decoder_t *d, const uint8_t *in, uint32_t len_in, serial_frame_t *frame) {
 	frame_err_t err = NO_ERR;
 	frame_flag_t flag = NONE_FLAG;
 	int ret = 0;
@@ -114,98 +171,128 @@ int serial_frame_decode(const uint8_t *in, uint32_t len_in, serial_frame_t *fram
 		goto out;
 	}
 
-	if (in == NULL || frame == NULL) {
+	if (d == NULL || d->out == NULL || in == NULL || frame == NULL) {
 		err = BAD_PARM;
 		ret = -1;
 		goto out;
 	}
 
 	// Reset input buffer stats
-	in_idx = 0;
-
-	uint16_t data_len=0;
-	uint8_t type=0;
-	//uint8_t opt_len=1;
-	uint8_t dest;
-	uint8_t crcd;
-
-	// One byte at a time
-	while(state != DONE) {
-
-		if (in_idx >= len_in) goto out;
-
-		// Find the SYNC byte
-		if (state == START && in[in_idx] == ESP3_SYNC) {
-			state = SYNC_ON;
-			out[out_idx++] = ESP3_SYNC; // Copy the SYNC byte to keep offsets consistent with the spec
-		}
-		else if (state == SYNC_ON) {
-			out[out_idx++] = in[in_idx];
-			if (out_idx == 6) state = HEADER_CHECK;
-		}
-		else if (state == HEADER_CHECK) {
-			uint8_t crc8_header;
-			bool crc_check_ret;
-			crc8_header = out[5];
-			crc_check_ret = check_crc8( &out[1], 4, crc8_header );
-			if (!crc_check_ret) serial_frame_reset();
-			else {
-				data_len = (out[1]<<8) | out[2];
-				type = out[4];
-				if (data_len == 0) state = DATAY;
-				else state = DATAX;
+	d->in_idx = 0;
+
+	uint8_t *out = d->out;
+	// Header is already validated if we are past HEADER_CHECK, recover it
+	uint32_t data_len = (out[1]<<8) | out[2];
+	uint32_t opt_len = out[3];
+	uint8_t type = out[4];
+	uint32_t frame_len = ESP3_HEADER_SIZE + data_len + opt_len + 1;
+	uint8_t dest = 0;
+
+	// Copies as much as each state can take in one go
+	while(d->state != DONE) {
+		const uint8_t *src = &in[d->in_idx];
+		uint32_t avail = len_in - d->in_idx;
+		uint32_t n;
+
+		if (d->state == HEADER_CHECK) { // Needs no input
+			if (!check_crc8(&out[1], 4, out[5])) {
+				header_resync(d);
+				continue;
 			}
+			data_len = (out[1]<<8) | out[2];
+			opt_len = out[3];
+			type = out[4];
+			frame_len = ESP3_HEADER_SIZE + data_len + opt_len + 1;
+			if (frame_len > d->out_max) header_resync(d); // Won't fit, treat as a false SYNC
+			else d->state = DATAX;
+			continue;
 		}
-		else if (state == DATAX) {
-			out[out_idx++] = in[in_idx];
-			data_count++;
-			if (data_count == data_len)
-				state = DATAY;
-		}
-		else if (state == DATAY) {
-			out[out_idx++] = in[in_idx];
-			dest = in[in_idx];
-			state = CRCD;
-		}
-		else if (state == CRCD) {
-			out[out_idx++] = in[in_idx];
-			crcd = in[in_idx];
-			state = DONE;
+
+		if (avail == 0) break;
+
+		switch (d->state) {
+			case START: { // Find the SYNC byte
+				const uint8_t *sync = (const uint8_t *)memchr(src, ESP3_SYNC, avail);
+				if (sync == NULL) {
+					d->in_idx = len_in;
+					break;
+				}
+				d->in_idx += sync - src + 1;
+				out[0] = ESP3_SYNC; // Copy the SYNC byte to keep offsets consistent with the spec
+				d->out_idx = 1;
+				d->state = SYNC_ON;
+				break;
+			}
+			case SYNC_ON:
+				n = ESP3_HEADER_SIZE - d->out_idx;
+				if (n > avail) n = avail;
+				memcpy(&out[d->out_idx], src, n);
+				d->out_idx += n;
+				d->in_idx += n;
+				if (d->out_idx == ESP3_HEADER_SIZE) d->state = HEADER_CHECK;
+				break;
+			case DATAX: // Length is known, take the rest of the frame in bulk
+				n = frame_len - d->out_idx;
+				if (n > avail) n = avail;
+				memcpy(&out[d->out_idx], src, n);
+				d->out_idx += n;
+				d->in_idx += n;
+				if (d->out_idx == frame_len) d->state = DONE;
+				break;
+			default:
+				sf_decoder_reset(d);
+				err = UNK_ERR;
+				ret = -1;
+				goto out;
 		}
+	}
 
-		in_idx++;
+	if (d->state != DONE) {
+		if (d->state == START) err = NO_FRAME;
+		else flag |= PARTIAL;
+		goto out;
 	}
 
-#ifdef _DEBUG
-	if (state != DONE) return -1; // Sanity check, should never happen
-#endif
+	// Caller must check CRC status
+	if (!check_crc8(&out[ESP3_HEADER_SIZE], data_len + opt_len, out[frame_len - 1]))
+		flag |= CRC_ERROR;
+
+	if (opt_len) dest = out[ESP3_HEADER_SIZE + data_len]; // Our dest byte is the first optional byte
 	flag |= FRAME_FOUND;
-	ret = in_idx;
+	ret = d->in_idx;
 	memset(frame, 0, sizeof(serial_frame_t)); // Reset the frame
 	frame->dest = dest;
 	frame->type = type;
 	frame->sz = data_len;
+	frame->crc32 = out[frame_len - 1];
 
 	if (data_len == 0) {
 		flag |= NO_PAYLOAD;
 		frame->sz  = 0;
 		frame->buf = NULL;
-		serial_frame_reset();
+		sf_decoder_reset(d);
+		goto out;
+	}
+
+	if (d->opts & SF_OPT_VIEW) {
+		frame->buf = &out[ESP3_HEADER_SIZE]; // Valid until the next call on this decoder
+		flag |= BUF_VIEW;
+		sf_decoder_reset(d);
 		goto out;
 	}
 
 	frame->buf = (uint8_t *) serial_frame_malloc(frame->sz); // CALLER MUST FREE
 	if (frame->buf != NULL) {
-		memcpy(frame->buf, &out[6], frame->sz);
+		memcpy(frame->buf, &out[ESP3_HEADER_SIZE], frame->sz);
 	}
 	else {
 		err = MEM_ERR;
 		ret = -1;
-		goto out;
 	}
-	serial_frame_reset();
+	sf_decoder_reset(d);
 
 out:
+	if (frame == NULL) return ret;
 	frame->err = err;
 	frame->flag = flag;
 	return ret;
@@ -229,16 +316,24 @@ int sf_encode_from_struct_count(serial_frame_t *f) {
 	return serial_frame_encode_count(in, len_in, dest, pkt_type);
 }
 
-// [FLAG DEST TYPE DATA-N TIMESTAMP CRC32 FLAG]
-// Params: Input buffer (payload) to be encoded, its length, and max sized output buffer
+// [SYNC LEN(2) OPT_LEN TYPE CRC8H DATA-N DEST CRC8D]
+// Params: Payload segments to be encoded in order, and max sized output buffer
+// needed (optional) is set to the exact encoded size, also when buf is too small
 // Returns: Length of encoded buffer
-int serial_frame_encode(const uint8_t *in, uint32_t len_in, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type) {
+int sf_encodev(const sf_iovec_t *iov, uint32_t iovcnt, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type, uint32_t *needed) {
 	unsigned bytes = 0;
+	uint32_t len_in = 0;
 	uint8_t crc_H, crc_D;
 
-	if (in == NULL && len_in > 0) return -1;
+	if (needed) *needed = 0;
+	for (uint32_t i=0; i<iovcnt; i++) {
+		if (iov[i].buf == NULL && iov[i].len > 0) return -1;
+		len_in += iov[i].len;
+	}
 	if (len_in > 0xFFFF) return -1; // Too big
-	if (len_in + 8 > buf_max) return -1; // Provided buffer too small. Overhead is 8 bytes.
+	if (pkt_type & 0xFFFFFF00) return -1; // Type is only 1 byte
+	if (needed) *needed = len_in + 8;
+	if (buf == NULL || len_in + 8 > buf_max) return -1; // Provided buffer too small. Overhead is 8 bytes.
 
 	// Starting SYNC byte
 	buf[bytes++] = ESP3_SYNC;
@@ -251,7 +346,6 @@ int serial_frame_encode(const uint8_t *in, uint32_t len_in, uint32_t buf_max, ui
 	buf[bytes++] = 1;
 
 	// Type, only 1 byte.
-	if (pkt_type & 0xFFFFFF00) return -1;
 	buf[bytes++] = pkt_type & 0xFF;
 
 	// CRC8 of 4 header bytes (not including sync)
@@ -259,7 +353,11 @@ int serial_frame_encode(const uint8_t *in, uint32_t len_in, uint32_t buf_max, ui
 	buf[bytes++] = crc_H;
 
 	// The Data
-	for(int i=0; i<len_in; i++) { buf[bytes++] = in[i]; }
+	for (uint32_t i=0; i<iovcnt; i++) {
+		if (iov[i].len == 0) continue;
+		memcpy(&buf[bytes], iov[i].buf, iov[i].len);
+		bytes += iov[i].len;
+	}
 
 	// Shove the dest byte in the optional data section
 	buf[bytes++] = dest;
@@ -271,6 +369,13 @@ int serial_frame_encode(const uint8_t *in, uint32_t len_in, uint32_t buf_max, ui
 	return bytes;
 }
 
+// Params: Input buffer (payload) to be encoded, its length, and max sized output buffer
+// Returns: Length of encoded buffer
+int serial_frame_encode(const uint8_t *in, uint32_t len_in, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type) {
+	sf_iovec_t iov = { in, len_in };
+	return sf_encodev(&iov, 1, buf_max, buf, dest, pkt_type, NULL);
+}
+
 // Returns: Length if given data was encoded
 // A little janky, wasn't feeling well when I made this
 int serial_frame_encode_count(const uint8_t *in, uint32_t len_in, uint8_t dest, uint32_t pkt_type) {
@@ -25,6 +25,12 @@ It is already too smart.
 TYPICAL max packet shall be 4k
 ABSOLUTE max packet, after encoding, is 8k
 
+COBS framing (negotiated with FRAME_TYPE_HELLO, see sf_hello_select())
+[0x00 COBS(DEST TYPE DATA-N CRC32 TIMESTAMP) 0x00]
+Same fields and CRC, but zero bytes are removed by Consistent Overhead Byte
+Stuffing instead of escaping, so overhead is 1 byte per 254 rather than up to 2x.
+A decoder with SF_OPT_COBS takes both, FLAG starts an HDLC frame and 0x00 a COBS one.
+
 Nathan Stohs 2020-02-27
 nathan.stohs@samraksh.com
 The Samraksh Company
@@ -34,27 +40,234 @@ http://www.samraksh.com
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include "serial_frame.h"
 
-#ifndef FRAME_MAX_SIZE
-#define FRAME_MAX_SIZE 2048 // Only used for decoding. Host end should set larger for audio etc.
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRC32) && !defined(SERIAL_FRAME_HW_CRC)
+#include <arm_acle.h>
 #endif
 
 typedef enum {
-	START=0, FLAG_ON, ESC_ON, DONE
+	START=0, FLAG_ON, ESC_ON, DONE,
+	COBS_CODE,		// Next byte is a block code or the closing delimiter
+	COBS_CODE_Z,	// Same, but the previous block owes a zero first
+	COBS_DATA,		// In a block that ends with a zero
+	COBS_DATA_FF,	// In a full (254 byte) block, no zero after it
 } frame_state_t;
 
+enum { COBS_DELIM=0x00, COBS_FULL=0xFF };
+
 // Toggle the 5th bit (starting from 0)
 enum { FLAG_FLAG=0x7E, FLAG_ESC=0x7D, TOGGLE_BIT=0x20 };
 
-static uint8_t out[FRAME_MAX_SIZE];	// Working buffer
-static uint32_t in_idx;				// index into INPUT buffer
-static uint32_t out_idx;			// index into OUT buffer
-static frame_state_t state;			// State of decoding, preserved over calls
+// Default context for the legacy serial_frame_decode() API
+static uint8_t default_out[FRAME_MAX_SIZE];
+static sf_decoder_t default_decoder = { .out = default_out, .out_max = FRAME_MAX_SIZE, .state = START };
 
-// TODO
-static uint32_t compute_crc32(const uint8_t *buf __attribute__ ((unused)), unsigned len __attribute__ ((unused))) {
-	return 0;
+/*
+Bulk scanning
+
+Payloads are mostly free of FLAG and ESC bytes, so both directions look for
+the next special byte 16 (SSE2/NEON) or 4-8 (plain C, word-at-a-time) bytes
+per step and memcpy() the clean run in between. The scalar tail handles the
+rest and is the whole story for short fields.
+*/
+
+#if !defined(__SSE2__) && !defined(__ARM_NEON)
+// Word-at-a-time helpers, one byte lane per byte of a size_t
+#define SWAR_ONES	((size_t)-1 / 0xFF)
+#define SWAR_HIGHS	(SWAR_ONES * 0x80)
+#define SWAR_LOWS	(SWAR_ONES * 0x7F)
+
+// Non-zero if any byte lane of v is zero (may over-report lanes above the first zero)
+static inline size_t swar_any_zero(size_t v) { return (v - SWAR_ONES) & ~v & SWAR_HIGHS; }
+
+// Exactly one high bit per zero byte lane of v
+static inline size_t swar_zero_lanes(size_t v) { return ~(((v & SWAR_LOWS) + SWAR_LOWS) | v | SWAR_LOWS); }
+
+static inline size_t swar_load(const uint8_t *p) { size_t w; memcpy(&w, p, sizeof(w)); return w; }
+#endif
+
+static inline bool is_special(uint8_t x) { return x == FLAG_FLAG || x == FLAG_ESC; }
+
+// Returns offset of the first FLAG or ESC byte, or len if there is none
+static uint32_t find_special(const uint8_t *buf, uint32_t len) {
+	uint32_t i = 0;
+#if defined(__SSE2__)
+	const __m128i flag = _mm_set1_epi8(FLAG_FLAG);
+	const __m128i esc  = _mm_set1_epi8(FLAG_ESC);
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)&buf[i]);
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, flag), _mm_cmpeq_epi8(x, esc)));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t flag = vdupq_n_u8(FLAG_FLAG);
+	const uint8x16_t esc  = vdupq_n_u8(FLAG_ESC);
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t x = vld1q_u8(&buf[i]);
+		uint8x16_t m = vorrq_u8(vceqq_u8(x, flag), vceqq_u8(x, esc));
+		// Narrow to 4 bits per lane so the mask fits in 64 bits
+		uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+		if (bits) return i + (__builtin_ctzll(bits) >> 2);
+	}
+#else
+	const size_t flag = SWAR_ONES * FLAG_FLAG;
+	const size_t esc  = SWAR_ONES * FLAG_ESC;
+	for (; i + sizeof(size_t) <= len; i += sizeof(size_t)) {
+		size_t w = swar_load(&buf[i]);
+		if (swar_any_zero(w ^ flag) | swar_any_zero(w ^ esc)) break; // Scalar finds the lane
+	}
+#endif
+	for (; i < len; i++) {
+		if (is_special(buf[i])) return i;
+	}
+	return len;
+}
+
+// Returns number of FLAG and ESC bytes in buf
+static uint32_t count_special(const uint8_t *buf, uint32_t len) {
+	uint32_t i = 0, count = 0;
+#if defined(__SSE2__)
+	const __m128i flag = _mm_set1_epi8(FLAG_FLAG);
+	const __m128i esc  = _mm_set1_epi8(FLAG_ESC);
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)&buf[i]);
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, flag), _mm_cmpeq_epi8(x, esc)));
+		count += __builtin_popcount(mask);
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t flag = vdupq_n_u8(FLAG_FLAG);
+	const uint8x16_t esc  = vdupq_n_u8(FLAG_ESC);
+	while (i + 16 <= len) {
+		uint8x16_t acc = vdupq_n_u8(0);
+		// Byte lanes count up to 255 before they must be widened
+		for (unsigned k = 0; k < 255 && i + 16 <= len; k++, i += 16) {
+			uint8x16_t x = vld1q_u8(&buf[i]);
+			acc = vsubq_u8(acc, vorrq_u8(vceqq_u8(x, flag), vceqq_u8(x, esc))); // match is 0xFF (-1)
+		}
+		uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(acc)));
+		count += vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+	}
+#else
+	const size_t flag = SWAR_ONES * FLAG_FLAG;
+	const size_t esc  = SWAR_ONES * FLAG_ESC;
+	for (; i + sizeof(size_t) <= len; i += sizeof(size_t)) {
+		size_t w = swar_load(&buf[i]);
+		size_t z = swar_zero_lanes(w ^ flag) | swar_zero_lanes(w ^ esc);
+		if (z) count += __builtin_popcountl(z);
+	}
+#endif
+	for (; i < len; i++) {
+		if (is_special(buf[i])) count++;
+	}
+	return count;
+}
+
+/*
+CRC32
+
+Standard ethernet/zlib CRC-32: polynomial 0x04C11DB7 reflected (0xEDB88320),
+init and final XOR 0xFFFFFFFF. CRC of "123456789" is 0xCBF43926.
+Backend is picked at compile time:
+	SERIAL_FRAME_HW_CRC		Platform provides serial_frame_hw_crc32() (e.g. STM32H7 CRC peripheral)
+	__ARM_FEATURE_CRC32		ARMv8 crc32 instructions (Pi 3/4 with -march=armv8-a+crc)
+	SERIAL_FRAME_CRC_SMALL	Nibble table, 64 bytes. For small parts.
+	(default)				Slice-by-8, 8 kByte table built at startup
+*/
+
+#define CRC32_POLY_REFLECTED 0xEDB88320
+
+#if defined(SERIAL_FRAME_HW_CRC)
+
+uint32_t sf_crc32(uint32_t crc, const uint8_t *buf, uint32_t len) {
+	if (len == 0) return crc;
+	return serial_frame_hw_crc32(crc, buf, len);
+}
+
+#elif defined(__ARM_FEATURE_CRC32)
+
+uint32_t sf_crc32(uint32_t crc, const uint8_t *buf, uint32_t len) {
+	crc = ~crc;
+	while (len && ((uintptr_t)buf & 7)) { crc = __crc32b(crc, *buf++); len--; }
+#if defined(__aarch64__)
+	for (; len >= 8; len -= 8, buf += 8) {
+		uint64_t w;
+		memcpy(&w, buf, sizeof(w));
+		crc = __crc32d(crc, w);
+	}
+#endif
+	for (; len >= 4; len -= 4, buf += 4) {
+		uint32_t w;
+		memcpy(&w, buf, sizeof(w));
+		crc = __crc32w(crc, w);
+	}
+	while (len--) crc = __crc32b(crc, *buf++);
+	return ~crc;
+}
+
+#elif defined(SERIAL_FRAME_CRC_SMALL)
+
+static const uint32_t crc32_nibble[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+uint32_t sf_crc32(uint32_t crc, const uint8_t *buf, uint32_t len) {
+	crc = ~crc;
+	while (len--) {
+		crc ^= *buf++;
+		crc = (crc >> 4) ^ crc32_nibble[crc & 0xF];
+		crc = (crc >> 4) ^ crc32_nibble[crc & 0xF];
+	}
+	return ~crc;
+}
+
+#else
+
+static uint32_t crc32_table[8][256];
+
+// Runs before main() so decoders in other threads never see a half built table
+__attribute__ ((constructor)) static void crc32_init_tables(void) {
+	for (unsigned i=0; i<256; i++) {
+		uint32_t c = i;
+		for (unsigned k=0; k<8; k++)
+			c = (c & 1) ? (c >> 1) ^ CRC32_POLY_REFLECTED : c >> 1;
+		crc32_table[0][i] = c;
+	}
+	for (unsigned i=0; i<256; i++) {
+		for (unsigned t=1; t<8; t++)
+			crc32_table[t][i] = (crc32_table[t-1][i] >> 8) ^ crc32_table[0][crc32_table[t-1][i] & 0xFF];
+	}
+}
+
+// Slice-by-8, assumes little-endian like everything else in the frame
+uint32_t sf_crc32(uint32_t crc, const uint8_t *buf, uint32_t len) {
+	crc = ~crc;
+	for (; len >= 8; len -= 8, buf += 8) {
+		uint32_t lo, hi;
+		memcpy(&lo, buf, sizeof(lo));
+		memcpy(&hi, buf + 4, sizeof(hi));
+		lo ^= crc;
+		crc =	crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+				crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+				crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+				crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+	}
+	while (len--) crc = (crc >> 8) ^ crc32_table[0][(crc ^ *buf++) & 0xFF];
+	return ~crc;
+}
+
+#endif
+
+static uint32_t compute_crc32(const uint8_t *buf, unsigned len) {
+	return sf_crc32(0, buf, len);
 }
 
 // Returns true on CRC match
@@ -64,63 +277,216 @@ static bool check_crc32(uint8_t *buf, unsigned len, uint32_t pkt_crc) {
 }
 
 // Returns true if progress
-static bool decode_start(const uint8_t *in, uint32_t len_in) {
-	serial_frame_reset();
+static bool decode_start(sf_decoder_t *d, const uint8_t *in, uint32_t len_in) {
+	bool cobs = d->opts & SF_OPT_COBS;
+	uint32_t start = d->in_idx;
+	sf_decoder_reset(d);
 	// Find the flag
-	while(in_idx < len_in) {
-		if (in[in_idx++] == FLAG_FLAG) {
-			state = FLAG_ON;
+	while(d->in_idx < len_in) {
+		uint8_t x = in[d->in_idx++];
+		if (x == FLAG_FLAG) {
+			d->state = FLAG_ON;
+			d->skipped += d->in_idx - 1 - start;
+			return true;
+		}
+		if (cobs && x == COBS_DELIM) {
+			d->state = COBS_CODE;
+			d->skipped += d->in_idx - 1 - start;
 			return true;
 		}
 	}
+	d->skipped += d->in_idx - start;
 	return false;
 }
 
+// DEST + TYPE before the payload, CRC32 + TIMESTAMP after it
+#define HEAD_SIZE (1 + 4)
+#define TAIL_SIZE (4 + 8)
+
+// Working buffer is full mid-frame, hand the payload so far to the stream callback.
+// The last TAIL_SIZE bytes might turn out to be the CRC and time, so they stay behind.
+static bool spill(sf_decoder_t *d) {
+	uint8_t *out = d->out;
+	uint32_t type, n;
+	if (d->stream_cb == NULL || d->out_idx <= HEAD_SIZE + TAIL_SIZE) return false;
+
+	n = d->out_idx - HEAD_SIZE - TAIL_SIZE;
+	memcpy(&type, &out[1], sizeof(type));
+	d->stream_crc = sf_crc32(d->stream_crc, &out[HEAD_SIZE], n);
+	d->stream_cb(d->stream_ctx, out[0], type, d->streamed, &out[HEAD_SIZE], n);
+	d->streamed += n;
+
+	memmove(&out[HEAD_SIZE], &out[d->out_idx - TAIL_SIZE], TAIL_SIZE);
+	d->out_idx = HEAD_SIZE + TAIL_SIZE;
+	return true;
+}
+
+// copy_out() slow path, fill up, spill, repeat
+static void copy_out_spill(sf_decoder_t *d, const uint8_t *src, uint32_t n) {
+	uint32_t room = d->out_max - 1 - d->out_idx;
+	while (n > room) {
+		memcpy(&d->out[d->out_idx], src, room);
+		d->out_idx += room;
+		src += room;
+		n -= room;
+		if (!spill(d)) return; // No stream callback, lazy, just don't let it overflow
+		room = d->out_max - 1 - d->out_idx;
+	}
+	memcpy(&d->out[d->out_idx], src, n);
+	d->out_idx += n;
+}
+
+// Appends a run of already un-escaped bytes to the working buffer
+// Kept tiny, it runs once per escaped byte
+static inline void copy_out(sf_decoder_t *d, const uint8_t *src, uint32_t n) {
+	if (n > d->out_max - 1 - d->out_idx) {
+		copy_out_spill(d, src, n);
+		return;
+	}
+	memcpy(&d->out[d->out_idx], src, n);
+	d->out_idx += n;
+}
+
 // We have an esc and need to peek at the next byte (if we have it)
-static bool process_esc(const uint8_t *in, uint32_t len_in) {
+static bool process_esc(sf_decoder_t *d, const uint8_t *in, uint32_t len_in) {
 	uint8_t next;
-	state = ESC_ON;
-	if (in_idx >= len_in) return false; // No next byte available, wait for later
-	next = in[in_idx++];
+	d->state = ESC_ON;
+	if (d->in_idx >= len_in) return false; // No next byte available, wait for later
+	next = in[d->in_idx++];
 
 	if (next == FLAG_FLAG) { // aborted frame case
-		state = FLAG_ON;
-		out_idx = 0; // Toss decoded data from frame
+		d->state = FLAG_ON;
+		if (d->out_idx || d->streamed) d->aborted++;
+		d->out_idx = 0; // Toss decoded data from frame
+		d->streamed = 0;
+		d->stream_crc = 0;
 		return true;
 	}
 
 	next ^= TOGGLE_BIT;
-	out[out_idx++] = next;
-	if (out_idx == FRAME_MAX_SIZE) out_idx--; // Lazy, just don't let it overflow
-	state = FLAG_ON; // Leaving ESC_ON state
+	copy_out(d, &next, 1);
+	d->state = FLAG_ON; // Leaving ESC_ON state
 	return true;
 }
 
-// Walk the input and copy
-static bool decode_frame(const uint8_t *in, uint32_t len_in) {
-	if (state == ESC_ON) return process_esc(in, len_in);
-	while(in_idx < len_in) {
-		uint8_t x = in[in_idx++];
-		switch(x) {
-			case FLAG_FLAG: state = DONE; return false;
-			case FLAG_ESC: return process_esc(in, len_in);
-			default: out[out_idx++] = x;
+// Walk the input and copy, a clean run at a time
+static bool decode_frame(sf_decoder_t *d, const uint8_t *in, uint32_t len_in) {
+	if (d->state == ESC_ON) return process_esc(d, in, len_in);
+	while(d->in_idx < len_in) {
+		uint32_t run = find_special(&in[d->in_idx], len_in - d->in_idx);
+		copy_out(d, &in[d->in_idx], run);
+		d->in_idx += run;
+		if (d->in_idx >= len_in) break;
+
+		if (in[d->in_idx++] == FLAG_FLAG) { d->state = DONE; return false; }
+		if (!process_esc(d, in, len_in)) return false;
+	}
+	return false;
+}
+
+// COBS counterpart of decode_frame(). Blocks are copied whole, the only
+// per-byte work is looking for a delimiter that cuts a block short.
+static bool cobs_decode_frame(sf_decoder_t *d, const uint8_t *in, uint32_t len_in) {
+	static const uint8_t zero = 0;
+	while(d->in_idx < len_in) {
+		const uint8_t *src = &in[d->in_idx];
+		uint8_t code;
+
+		if (d->state == COBS_DATA || d->state == COBS_DATA_FF) {
+			uint32_t n = len_in - d->in_idx;
+			const uint8_t *delim;
+			if (n > d->data_count) n = d->data_count;
+			delim = memchr(src, COBS_DELIM, n);
+			if (delim) { // Frame cut short, what follows is the next one
+				d->in_idx += delim - src + 1;
+				d->aborted++;
+				d->state = COBS_CODE;
+				d->out_idx = 0; // Toss decoded data from frame
+				d->streamed = 0;
+				d->stream_crc = 0;
+				continue;
+			}
+			copy_out(d, src, n);
+			d->in_idx += n;
+			d->data_count -= n;
+			if (d->data_count == 0)
+				d->state = (d->state == COBS_DATA) ? COBS_CODE_Z : COBS_CODE;
+			continue;
+		}
+
+		code = in[d->in_idx++];
+		if (d->out_idx == 0 && d->streamed == 0) { // Between frames
+			if (code == COBS_DELIM) { // Back to back delimiters
+				d->state = COBS_CODE;
+				continue;
+			}
+			// TYPE < 2^24 puts a zero in the first 5 bytes, so no COBS frame
+			// opens with a code this big. It is an HDLC frame after idle delimiters.
+			if (code == FLAG_FLAG) {
+				d->state = FLAG_ON;
+				return true;
+			}
 		}
-		if (out_idx == FRAME_MAX_SIZE) out_idx--; // Lazy, just don't let it overflow
+		if (code == COBS_DELIM) {
+			// The zero owed by the last block is implied and dropped
+			d->state = DONE;
+			return false;
+		}
+		if (d->state == COBS_CODE_Z) copy_out(d, &zero, 1);
+		d->data_count = code - 1;
+		if (code == COBS_FULL)	d->state = COBS_DATA_FF;
+		else					d->state = d->data_count ? COBS_DATA : COBS_CODE_Z;
 	}
 	return false;
 }
 
+// Sets up a decoder context with a caller owned working buffer
+// buf_sz bounds the largest frame that can be decoded (after un-escaping)
+// The buffer is skewed so the payload (after DEST and TYPE) is 8-byte aligned,
+// which keeps SF_OPT_VIEW payloads safe to read as words, e.g. for flash programming.
+void sf_decoder_init(sf_decoder_t *d, uint8_t *buf, uint32_t buf_sz) {
+	uint32_t skew = (3 - (uintptr_t)buf) & 7; // 1 byte DEST + 4 byte TYPE
+	memset(d, 0, sizeof(sf_decoder_t));
+	if (buf_sz > skew + FRAME_MIN_SIZE) {
+		buf += skew;
+		buf_sz -= skew;
+	}
+	d->out = buf;
+	d->out_max = buf_sz;
+	d->state = START;
+}
+
+void sf_decoder_set_opts(sf_decoder_t *d, uint32_t opts) {
+	d->opts = opts;
+}
+
+// Frames that outgrow the working buffer are passed to cb in chunks instead of truncated
+// The buffer then only has to fit the frames you want whole, not the largest one
+void sf_decoder_set_stream(sf_decoder_t *d, sf_stream_cb_t cb, void *ctx) {
+	d->stream_cb = cb;
+	d->stream_ctx = ctx;
+}
+
 // Resets frame processing state
+void sf_decoder_reset(sf_decoder_t *d) {
+	d->out_idx = 0;
+	d->state = START;
+	d->streamed = 0;
+	d->stream_crc = 0;
+}
+
 void serial_frame_reset(void) {
-	out_idx = 0;
-	state = START;
+	sf_decoder_reset(&default_decoder);
+}
+
+int serial_frame_decode(const uint8_t *in, uint32_t len_in, serial_frame_t *frame) {
+	return sf_decode(&default_decoder, in, len_in, frame);
 }
 
 // Call on input serial stream
 // Returns: -1 on error, 0 on non-event, else index of *next* byte in input buffer
-int serial_frame_decode(const uint8_t *in, uint32_t len_in, serial_frame_t *frame) {
-	bool go = true;
+int sf_decode(sf_decoder_t *d, const uint8_t *in, uint32_t len_in, serial_frame_t *frame) {
+	bool go = true, cobs = false; // cobs: the last step was COBS, so is the frame it finished
 	frame_err_t err = NO_ERR;
 	frame_flag_t flag = NONE_FLAG;
 	int ret = 0;
@@ -131,46 +497,56 @@ int serial_frame_decode(const uint8_t *in, uint32_t len_in, serial_frame_t *fram
 		goto out;
 	}
 
-	if (in == NULL || frame == NULL) {
+	if (d == NULL || d->out == NULL || in == NULL || frame == NULL) {
 		err = BAD_PARM;
 		ret = -1;
 		goto out;
 	}
 
 	// Reset input buffer stats
-	in_idx = 0;
+	d->in_idx = 0;
 
 	while(go) {
-		switch(state) {
-			case START:		go = decode_start(in, len_in);	break;
+		switch(d->state) {
+			case START:		go = decode_start(d, in, len_in);	break;
 			case ESC_ON:
-			case FLAG_ON: 	go = decode_frame(in, len_in);	break;
-			default: break; // Falls through to error case in next switch
+			case FLAG_ON: 	go = decode_frame(d, in, len_in);	cobs = false;	break;
+			case COBS_CODE:
+			case COBS_CODE_Z:
+			case COBS_DATA:
+			case COBS_DATA_FF:	go = cobs_decode_frame(d, in, len_in);	cobs = true;	break;
+			default: go = false; break; // Falls through to error case in next switch
 		}
 
 		// Ignore zero size frames due to dropped bytes etc
 		// state is going to be a little messy until we re-sync
-		if (state == DONE && out_idx == 0) {
+		if (d->state == DONE && d->out_idx == 0) {
 			go = true;
-			state = FLAG_ON;
+			d->state = FLAG_ON;
 		}
 	}
 
 	// Mop things up
-	if (state == START) { // Nothing found
+	if (d->state == START) { // Nothing found
 		err = NO_FRAME;
-	} else if (state == FLAG_ON || state == ESC_ON) { // In the middle of a frame
+	} else if (d->state == FLAG_ON || d->state == ESC_ON || d->state >= COBS_CODE) { // In the middle of a frame
 		flag |= PARTIAL;
-	} else if (state == DONE) { // Full frame!
+	} else if (d->state == DONE) { // Full frame!
 		bool crc_ok;
+		uint8_t *out = d->out;
 		const unsigned dest_size = sizeof(frame->dest); // 1 byte at start
 		const unsigned type_size = sizeof(frame->type);	// bytes at start
 		const unsigned crc_size  = sizeof(frame->crc32);	// bytes at end
 		const unsigned time_size = sizeof(frame->time_us);// bytes after payload
 		const unsigned tot_meta_size  = dest_size + type_size + crc_size + time_size;
 
-		uint32_t payload_size = out_idx - tot_meta_size; // Whatever is left over
-		if (out_idx <  tot_meta_size) { err = MALFORM; ret = -1; goto out;}
+		uint32_t payload_size = d->out_idx - tot_meta_size; // Whatever is left over
+		if (d->out_idx <  tot_meta_size) {
+			err = MALFORM;
+			ret = -1;
+			sf_decoder_reset(d); // Don't wedge on the runt, resync on next call
+			goto out;
+		}
 
 		// Compute offsets
 		unsigned dest_offset	= 0;
@@ -189,19 +565,36 @@ int serial_frame_decode(const uint8_t *in, uint32_t len_in, serial_frame_t *fram
 		memcpy(&frame->time_us, &out[time_offset], time_size);
 
 		// Caller must check CRC status
-		// Caller should serial_frame_reset() on errors until back sync
-		crc_ok = check_crc32(&out[payload_offset], payload_size, frame->crc32);
+		// Caller should sf_decoder_reset() on errors until back sync
+		if (d->streamed) // Rest of an oversize frame, CRC continues from what was spilled
+			crc_ok = sf_crc32(d->stream_crc, &out[payload_offset], payload_size) == frame->crc32;
+		else
+			crc_ok = check_crc32(&out[payload_offset], payload_size, frame->crc32);
 		if (!crc_ok) {
 			// Will keep going in case other frames
 			flag |= CRC_ERROR;
 		}
+		if (cobs) flag |= COBS_FRAMED;
 
-		if (payload_size) {
+		if (d->streamed) {
+			if (payload_size)
+				d->stream_cb(d->stream_ctx, frame->dest, frame->type, d->streamed, &out[payload_offset], payload_size);
+			frame->sz = d->streamed + payload_size;
+			frame->buf = NULL;
+			flag |= STREAMED;
+		}
+		else if (payload_size && (d->opts & SF_OPT_VIEW)) {
+			frame->sz = payload_size;
+			frame->buf = &out[payload_offset]; // Valid until the next call on this decoder
+			flag |= BUF_VIEW;
+		}
+		else if (payload_size) {
 			frame->sz = payload_size;
 			frame->buf = (uint8_t *) serial_frame_malloc(frame->sz); // CALLER MUST FREE
 			if (frame->buf == NULL) {
-				frame->err = MEM_ERR;
+				err = MEM_ERR;
 				ret = -1;
+				sf_decoder_reset(d);
 				goto out;
 			}
 			memcpy(frame->buf, &out[payload_offset], frame->sz);
@@ -214,14 +607,15 @@ int serial_frame_decode(const uint8_t *in, uint32_t len_in, serial_frame_t *fram
 		}
 
 		flag |= FRAME_FOUND;
-		ret = in_idx; // CALLER MUST RE-CALL WITH REMAINING DATA (AFTER IDX, IF ANY) TO CHECK FOR MORE FRAMES
-		serial_frame_reset(); // Reset everything for next frame
+		ret = d->in_idx; // CALLER MUST RE-CALL WITH REMAINING DATA (AFTER IDX, IF ANY) TO CHECK FOR MORE FRAMES
+		sf_decoder_reset(d); // Reset everything for next frame
 	} else {
 		err = UNK_ERR;
 		ret = -1;
 	}
 
 out:
+	if (frame == NULL) return ret;
 	frame->err = err;
 	frame->flag = flag;
 	return ret;
@@ -246,154 +640,246 @@ int sf_encode_from_struct_count(serial_frame_t *f) {
 }
 
 
-// [FLAG DEST TYPE DATA-N TIMESTAMP CRC32 FLAG]
-// Params: Input buffer (payload) to be encoded, its length, and max sized output buffer
-// Returns: Length of encoded buffer
-int serial_frame_encode(const uint8_t *in, uint32_t len_in, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type) {
-	unsigned bytes = 0;
-	uint64_t time_us;
-	uint32_t crc;
-	// union... I know...
-	uint8_t *now = (uint8_t *)(&time_us);
-	uint8_t *t = (uint8_t *)(&pkt_type);
-	uint8_t *c = (uint8_t *)(&crc);
+// Escapes src and appends it to buf at *bytes
+// Returns false if it would not fit in buf_max
+static bool put_escaped(uint8_t *buf, uint32_t buf_max, unsigned *bytes, const uint8_t *src, uint32_t n) {
+	unsigned b = *bytes;
+	while (n) {
+		uint32_t run = find_special(src, n);
+		if (b + run > buf_max) return false;
+		memcpy(&buf[b], src, run);
+		b += run; src += run; n -= run;
+		if (n == 0) break;
+		if (b + 2 > buf_max) return false;
+		buf[b++] = FLAG_ESC;
+		buf[b++] = *src++ ^ TOGGLE_BIT;
+		n--;
+	}
+	*bytes = b;
+	return true;
+}
 
-	if (in == NULL && len_in > 0) return -1;
+// Returns the size of src once escaped
+static uint32_t escaped_size(const uint8_t *src, uint32_t n) {
+	return n + count_special(src, n);
+}
 
-	// Starting delimiter
-	buf[bytes++] = FLAG_FLAG;
-
-	// Dest
-	for (unsigned i=0; i<sizeof(dest); i++) {
-		uint8_t x = dest; // NOTICE BREAKS PATTERN
-		if (bytes >= buf_max) return -1;
-		switch(x) {
-			case FLAG_FLAG:
-			case FLAG_ESC:  buf[bytes++] = FLAG_ESC; buf[bytes++] = (x ^ TOGGLE_BIT); break;
-			default: buf[bytes++] = x;
+// Output cursor for sf_encodev(). Once the buffer overflows it keeps
+// counting so the caller learns the exact size it needs.
+typedef struct {
+	uint8_t *buf;
+	uint32_t buf_max;
+	unsigned bytes;
+	bool full;
+} encoder_t;
+
+static void emit(encoder_t *e, const uint8_t *src, uint32_t n) {
+	if (!e->full) {
+		unsigned b = e->bytes;
+		if (put_escaped(e->buf, e->buf_max, &b, src, n)) {
+			e->bytes = b;
+			return;
 		}
+		e->full = true; // Partial output is discarded, count from here on
 	}
+	e->bytes += escaped_size(src, n);
+}
 
-	// Type
-	for (unsigned i=0; i<sizeof(pkt_type); i++) {
-		uint8_t x = t[i];
-		if (bytes >= buf_max) return -1;
-		switch(x) {
-			case FLAG_FLAG:
-			case FLAG_ESC:  buf[bytes++] = FLAG_ESC; buf[bytes++] = (x ^ TOGGLE_BIT); break;
-			default: buf[bytes++] = x;
-		}
-	}
+static void emit_byte(encoder_t *e, uint8_t x) {
+	if (!e->full && e->bytes < e->buf_max)
+		e->buf[e->bytes] = x;
+	else
+		e->full = true;
+	e->bytes++;
+}
+
+// Payload is CRC'd and escaped in chunks so each one is still in L1 for the second look
+#define ENCODE_CHUNK 512
+
+// Monotonic device time stamped into every encoded frame
+// Weak so each target can supply its own clock, 0 means "no clock"
+__attribute__ ((weak)) uint64_t serial_frame_now_us(void) {
+	return 0;
+}
+
+// [FLAG DEST TYPE DATA-N CRC32 TIMESTAMP FLAG]
+// Params: Payload segments to be encoded in order, and max sized output buffer
+// needed (optional) is set to the encoded size. When buf is too small it is the
+// size a retry is guaranteed to fit in: the timestamp is re-read on every call
+// so its escaping is counted as worst case.
+// Returns: Length of encoded buffer, -1 on error or if buf_max is too small
+int sf_encodev(const sf_iovec_t *iov, uint32_t iovcnt, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type, uint32_t *needed) {
+	encoder_t e = { buf, buf_max, 0, buf == NULL };
+	uint64_t time_us;
+	unsigned time_start, time_escaped;
+	uint32_t crc = 0;
+
+	if (needed) *needed = 0;
+	for (uint32_t i=0; i<iovcnt; i++)
+		if (iov[i].buf == NULL && iov[i].len > 0) return -1;
 
-	// Payload
-	for (unsigned i=0; i<len_in; i++) {
-		uint8_t x = in[i];
-		if (bytes >= buf_max) return -1;
-		switch(x) {
-			case FLAG_FLAG:
-			case FLAG_ESC:  buf[bytes++] = FLAG_ESC; buf[bytes++] = (x ^ TOGGLE_BIT); break;
-			default: buf[bytes++] = x;
+	// Starting delimiter
+	emit_byte(&e, FLAG_FLAG);
+
+	// Dest, Type
+	emit(&e, &dest, sizeof(dest));
+	emit(&e, (uint8_t *)&pkt_type, sizeof(pkt_type));
+
+	// Payload, CRC'd on the way through
+	for (uint32_t i=0; i<iovcnt; i++) {
+		const uint8_t *src = (const uint8_t *)iov[i].buf;
+		uint32_t n = iov[i].len;
+		while (n) {
+			uint32_t c = n < ENCODE_CHUNK ? n : ENCODE_CHUNK;
+			crc = sf_crc32(crc, src, c);
+			emit(&e, src, c);
+			src += c; n -= c;
 		}
 	}
 
 	// CRC
-	crc = compute_crc32(in, len_in);
-	for (unsigned i=0; i<sizeof(crc); i++) {
-		uint8_t x = c[i];
-		if (bytes >= buf_max) return -1;
-		switch(x) {
-			case FLAG_FLAG:
-			case FLAG_ESC:  buf[bytes++] = FLAG_ESC; buf[bytes++] = (x ^ TOGGLE_BIT); break;
-			default: buf[bytes++] = x;
-		}
-	}
+	emit(&e, (uint8_t *)&crc, sizeof(crc));
 
 	// Time
-	time_us = 8; // TODO
-	for (unsigned i=0; i<sizeof(time_us); i++) {
-		uint8_t x = now[i];
-		if (bytes >= buf_max) return -1;
-		switch(x) {
-			case FLAG_FLAG:
-			case FLAG_ESC:  buf[bytes++] = FLAG_ESC; buf[bytes++] = (x ^ TOGGLE_BIT); break;
-			default: buf[bytes++] = x;
-		}
-	}
+	time_us = serial_frame_now_us();
+	time_start = e.bytes;
+	emit(&e, (uint8_t *)&time_us, sizeof(time_us));
+	time_escaped = e.bytes - time_start;
 
 	// End delimiter
-	buf[bytes++] = FLAG_FLAG;
-	return bytes;
+	emit_byte(&e, FLAG_FLAG);
+
+	if (!e.full) {
+		if (needed) *needed = e.bytes;
+		return (int)e.bytes;
+	}
+	if (needed) *needed = e.bytes - time_escaped + 2 * sizeof(time_us);
+	return -1;
 }
 
-// Returns: Length if given data was encoded
-// A little janky, wasn't feeling well when I made this
-int serial_frame_encode_count(const uint8_t *in, uint32_t len_in, uint8_t dest, uint32_t pkt_type) {
-	unsigned bytes = 0;
-	uint64_t time_us;
-	uint32_t crc;
-	// union... I know...
-	uint8_t *now = (uint8_t *)(&time_us);
-	uint8_t *t = (uint8_t *)(&pkt_type);
-	uint8_t *c = (uint8_t *)(&crc);
+// [FLAG DEST TYPE DATA-N CRC32 TIMESTAMP FLAG]
+// Params: Input buffer (payload) to be encoded, its length, and max sized output buffer
+// Returns: Length of encoded buffer
+int serial_frame_encode(const uint8_t *in, uint32_t len_in, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type) {
+	sf_iovec_t iov = { in, len_in };
+	if (buf == NULL) return -1;
+	return sf_encodev(&iov, 1, buf_max, buf, dest, pkt_type, NULL);
+}
 
-	if (in == NULL && len_in > 0) return -1;
+// COBS output cursor. code_pos is where the current block's code byte goes,
+// filled in once the block ends. Counting past the end works as for encoder_t.
+typedef struct {
+	encoder_t e;
+	unsigned code_pos;
+	uint8_t code;
+} cobs_encoder_t;
+
+static void cobs_raw(encoder_t *e, const uint8_t *src, uint32_t n) {
+	if (!e->full && e->bytes + n <= e->buf_max)
+		memcpy(&e->buf[e->bytes], src, n);
+	else
+		e->full = true;
+	e->bytes += n;
+}
 
-	// Starting delimiter
-	bytes++;
-
-	// Dest
-	for (unsigned i=0; i<sizeof(dest); i++) {
-		uint8_t x = 123; // dummy dest
-		switch(x) {
-			case FLAG_FLAG:
-			case FLAG_ESC:  bytes+=2; break;
-			default: bytes++;
-		}
-	}
+static void cobs_end_block(cobs_encoder_t *c) {
+	if (!c->e.full) c->e.buf[c->code_pos] = c->code;
+}
+
+static void cobs_new_block(cobs_encoder_t *c) {
+	c->code_pos = c->e.bytes;
+	c->code = 1;
+	emit_byte(&c->e, 0); // Placeholder
+}
 
-	// Type
-	for (unsigned i=0; i<sizeof(pkt_type); i++) {
-		uint8_t x = t[i];
-		switch(x) {
-			case FLAG_FLAG:
-			case FLAG_ESC:  bytes+=2; break;
-			default: bytes++;
+// Runs of non-zero bytes go out with memcpy, each zero just closes a block
+static void cobs_emit(cobs_encoder_t *c, const uint8_t *src, uint32_t n) {
+	while (n) {
+		uint32_t room = COBS_FULL - c->code;
+		uint32_t lim = n < room ? n : room;
+		const uint8_t *zero = memchr(src, 0, lim);
+		uint32_t run = zero ? (uint32_t)(zero - src) : lim;
+
+		cobs_raw(&c->e, src, run);
+		c->code += run;
+		src += run; n -= run;
+		if (zero) {
+			src++; n--;
+		} else if (c->code != COBS_FULL) {
+			break; // Out of input, block stays open
 		}
+		cobs_end_block(c);
+		cobs_new_block(c);
 	}
+}
 
-	// Payload
-	for (unsigned i=0; i<len_in; i++) {
-		uint8_t x = in[i];
-		switch(x) {
-			case FLAG_FLAG:
-			case FLAG_ESC:  bytes+=2; break;
-			default: bytes++;
-		}
+// [0x00 COBS(DEST TYPE DATA-N CRC32 TIMESTAMP) 0x00]
+// Same contract as sf_encodev(). When buf is too small, needed is
+// SF_COBS_ENCODED_MAX() of the payload, which any timestamp fits in.
+int sf_cobs_encodev(const sf_iovec_t *iov, uint32_t iovcnt, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type, uint32_t *needed) {
+	cobs_encoder_t c = { { buf, buf_max, 0, buf == NULL }, 0, 1 };
+	uint64_t time_us;
+	uint32_t crc = 0, len = 0;
+
+	if (needed) *needed = 0;
+	for (uint32_t i=0; i<iovcnt; i++) {
+		if (iov[i].buf == NULL && iov[i].len > 0) return -1;
+		len += iov[i].len;
 	}
 
-	// CRC
-	crc = compute_crc32(in, len_in);
-	for (unsigned i=0; i<sizeof(crc); i++) {
-		uint8_t x = c[i];
-		switch(x) {
-			case FLAG_FLAG:
-			case FLAG_ESC:  bytes+=2; break;
-			default: bytes++;
+	emit_byte(&c.e, COBS_DELIM);
+	cobs_new_block(&c);
+
+	cobs_emit(&c, &dest, sizeof(dest));
+	cobs_emit(&c, (uint8_t *)&pkt_type, sizeof(pkt_type));
+
+	for (uint32_t i=0; i<iovcnt; i++) {
+		const uint8_t *src = (const uint8_t *)iov[i].buf;
+		uint32_t n = iov[i].len;
+		while (n) {
+			uint32_t k = n < ENCODE_CHUNK ? n : ENCODE_CHUNK;
+			crc = sf_crc32(crc, src, k);
+			cobs_emit(&c, src, k);
+			src += k; n -= k;
 		}
 	}
 
-	// Time
-	time_us = 8; // TODO
-	for (unsigned i=0; i<sizeof(time_us); i++) {
-		uint8_t x = now[i];
-		switch(x) {
-			case FLAG_FLAG:
-			case FLAG_ESC:  bytes+=2; break;
-			default: bytes++;
-		}
+	cobs_emit(&c, (uint8_t *)&crc, sizeof(crc));
+	time_us = serial_frame_now_us();
+	cobs_emit(&c, (uint8_t *)&time_us, sizeof(time_us));
+	cobs_end_block(&c);
+
+	emit_byte(&c.e, COBS_DELIM);
+
+	if (!c.e.full) {
+		if (needed) *needed = c.e.bytes;
+		return (int)c.e.bytes;
 	}
+	if (needed) *needed = SF_COBS_ENCODED_MAX(len);
+	return -1;
+}
 
-	// End delimiter
-	bytes++;
-	return bytes;
+// Encodes with whichever framing a link negotiated, anything unknown is HDLC
+int sf_encodev_framing(uint32_t framing, const sf_iovec_t *iov, uint32_t iovcnt, uint32_t buf_max, uint8_t *buf, uint8_t dest, uint32_t pkt_type, uint32_t *needed) {
+	if (framing == SF_FRAMING_COBS)
+		return sf_cobs_encodev(iov, iovcnt, buf_max, buf, dest, pkt_type, needed);
+	return sf_encodev(iov, iovcnt, buf_max, buf, dest, pkt_type, needed);
+}
+
+// Picks the framing for a link from a received HELLO payload (advertised or selected).
+// Old peers say HELLO with no payload, so that and anything unrecognised is HDLC.
+uint32_t sf_hello_select(const uint8_t *buf, uint32_t sz) {
+	sf_hello_t hello;
+	if (buf == NULL || sz < sizeof(hello)) return SF_FRAMING_HDLC;
+	memcpy(&hello, buf, sizeof(hello));
+	if (hello.framings & SF_FRAMINGS_SUPPORTED & SF_FRAMING_COBS) return SF_FRAMING_COBS;
+	return SF_FRAMING_HDLC;
+}
+
+// Returns: Length if given data was encoded, allowing for a worst case timestamp
+int serial_frame_encode_count(const uint8_t *in, uint32_t len_in, uint8_t dest, uint32_t pkt_type) {
+	sf_iovec_t iov = { in, len_in };
+	uint32_t needed;
+	sf_encodev(&iov, 1, 0, NULL, dest, pkt_type, &needed);
+	return needed ? (int)needed : -1;
 }